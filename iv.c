@@ -1,6 +1,7 @@
 //
 // iv.c -- A simple terminal image viewer with vi-style navigation
 //
+#define _GNU_SOURCE /* pipe2 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,20 @@
 #include <termios.h>
 #include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <linux/io_uring.h>
 
 /* -------------------- CONFIG -------------------- */
 
@@ -22,7 +37,8 @@
 
 /*
  * Pixel dimensions for the generated thumbnails (higher = bigger).
- * We use a good downscaling filter (Lanczos).
+ * We use a good downscaling filter (Catmull-Rom, see cubic_weight; magick,
+ * for the formats it renders, uses Lanczos).
  */
 #define THUMB_PIXEL_WIDTH  180
 #define THUMB_PIXEL_HEIGHT 120
@@ -34,22 +50,137 @@
 #define FOCUS_HEIGHT 600
 
 /*
- * Directory for storing the temporary thumbnails/focus images.
- * In a real program, you might want random filenames, a subfolder, caching, etc.
+ * Thumbnails and focus images are cached in a pack file in $XDG_CACHE_HOME/iv
+ * (or ~/.cache/iv). TMP_DIR is only used when neither variable is set.
  */
-#define TMP_DIR "/tmp"
+#define CACHE_SUBDIR "iv"
+#define TMP_DIR      "/tmp"
 
+/* The cache directory, for the pack and the directory catalogs; set by cache_init(). */
+static char cache_dir[4096];
 
+/* Default cap on the cached images' total size; -s overrides it. */
+#define CACHE_MAX_BYTES (256ull << 20)
 
+
+
+typedef enum { THUMB_NONE, THUMB_QUEUED, THUMB_READY, THUMB_FAILED } ThumbState;
+
+/* Orders for the grid within each command-line argument; -o and 's' pick one. */
+typedef enum { SORT_SCAN, SORT_NAME, SORT_MTIME, SORT_SIZE, SORT_TAKEN, SORT_MODES } SortMode;
+static const char* const sort_names[SORT_MODES] = {"scan", "name", "mtime", "size", "date"};
+
+/* Columns read from the file system on demand, as bits in ImageList.keys. */
+typedef enum {
+  KEY_STAT = 1, /* size and mtime */
+  KEY_META = 2, /* width, height, orient, taken and format, see ImageMeta */
+} SortKey;
+
+/* Paths are interned in blocks of this size, see ImageList. */
+#define ARENA_BLOCK (1 << 20)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t used, cap;
+  char data[];
+} ArenaBlock;
+
+/* An entry that has been taken off the grid, see ImageList. */
+#define NOT_SHOWN SIZE_MAX
+
+/* Image shapes a filter can ask for, upright. */
+typedef enum { SHAPE_ANY, SHAPE_LANDSCAPE, SHAPE_PORTRAIT } Shape;
+
+//
+// What the grid is narrowed to, see list_filter(). The predicates come from
+// the command line; '/' edits the words, where "key:value" words such as
+// "size:2M" add predicates of their own. Zero asks for nothing, and so
+// does INT64_MIN for 'since', where 0 is a date like any other.
+//
 typedef struct {
-  char* original_path; // The original image path
-  char* thumb_path;    // The generated thumbnail path
-  int   generated;     // 1 if this program created thumb_path => remove on exit
-} ImageEntry;
+  char name[256];       /* words every file name must contain, in any case and order */
+  uint64_t min_size;    /* bytes */
+  int64_t since;        /* capture time, or mtime for images without one; see FILTER_ANY_TIME */
+  uint32_t min_width;   /* upright */
+  unsigned char format; /* ImageFormat */
+  unsigned char shape;  /* Shape */
+} Filter;
+
+#define FILTER_ANY_TIME INT64_MIN /* 'since' when no date was asked for */
+
+/* The predicate keys, both as "key:value" filter words and, behind --, as options. */
+typedef enum { PRED_SIZE, PRED_SINCE, PRED_FORMAT, PRED_WIDTH, PRED_ORIENTATION, PRED_COUNT } PredKey;
+static const char* const pred_words[PRED_COUNT]   = {"size", "since", "format", "width", "orientation"};
+static const char* const pred_options[PRED_COUNT] = {"min-size", "since", "format", "min-width",
+                                                     "orientation"};
+
+/* Words a filter is split into at most, and the trigram table size, see list_index_names(). */
+#define FILTER_WORDS 32
+#define TRIGRAM_BITS 18
 
 typedef struct {
-  ImageEntry* entries;
-  size_t count;
+  uint32_t* ids; /* entries, ascending */
+  uint32_t count, cap;
+} Posting;
+
+//
+// The images, one parallel array per field, grown geometrically. Paths are
+// packed into arena blocks that never move, so a path pointer stays valid
+// while the list grows and the workers can hold on to it.
+//
+// Entries are never removed or reordered, so an index stays valid for as
+// long as the list lives. What the grid shows is 'view', a list of indices
+// in display order, and 'pos' maps each entry back to its cell, or to
+// NOT_SHOWN once the file is gone. The view keeps the command-line arguments
+// in order, however the scan of each one interleaves with the others, and
+// the entries of each in 'sort' order: as found, by natural name, by mtime,
+// by size or by capture date. 'by_path' is an open-addressed hash of the
+// shown entries so a path reported by the directory watch can be found.
+//
+// A filter narrows the grid to 'match', the entries of the view it lets
+// through in view order; the grid_*() functions map cells either way. The
+// file names are folded into 'folded' with a trigram index over them, built
+// the first time a filter is set and extended as entries arrive. Its
+// predicates are checked against the columns alone, see list_keep(); the
+// columns a scan did not fill are read in the background (see KeyLoader).
+//
+typedef struct {
+  size_t count, cap;
+  const char** path;          // The original image paths, interned in 'names'
+  uint64_t* thumb_off;        // Where each thumbnail PNG lives in the pack, once ready
+  uint32_t* thumb_len;
+  unsigned char* thumb_state; // ThumbState; only the main thread changes it
+  uint32_t* gen;              // Bumped when the file is rewritten, to drop older thumbnails
+  uint32_t* group;            // Which command-line argument it came from
+  uint32_t* dev;              // Its device in io_devices, 0 if not known
+  uint64_t* ino;              // Its inode, for reading a spinning disk in order
+  unsigned char* keys;        // Which of the columns below are loaded, see SortKey
+  unsigned char* asked;       // Keys handed to the KeyLoader and not back yet
+  int64_t* mtime;
+  uint64_t* size;
+  uint32_t* width;            // As stored, before orientation; 0 if not known
+  uint32_t* height;
+  unsigned char* orient;      // EXIF orientation 1..8
+  unsigned char* format;      // ImageFormat
+  int64_t* taken;             // Capture time from EXIF, INT64_MIN if it has none
+  int sort;                   // SortMode the view is kept in
+  int sort_next;              // SortMode it goes into once the keys are in, see list_resort()
+  unsigned char missing;      // Keys a filter or 'sort_next' found shown entries without
+  size_t asking;              // Entries with the KeyLoader
+  size_t* pos;                // Grid position of each entry, or NOT_SHOWN
+  size_t* view;               // Entry shown at each grid position
+  size_t view_count;
+  size_t* by_path;            // Entry index + 1, 0 for an empty slot
+  size_t by_path_cap;         // Power of two, at least twice view_count
+  ArenaBlock* names;
+  Filter filter;              // Narrows the grid once set, see list_filter()
+  size_t* match;              // Entry in each cell of a filtered grid
+  size_t match_count;
+  char* folded;               // File names in lower case, each NUL-terminated
+  size_t folded_len, folded_cap;
+  size_t* folded_at;          // Where each indexed entry's name starts in 'folded'
+  size_t indexed;             // Entries in 'folded' and 'trigrams' so far
+  Posting* trigrams;          // For each trigram, the entries whose name has it
 } ImageList;
 
 typedef enum { MODE_GRID, MODE_FOCUS } ViewerMode;
@@ -89,142 +220,7715 @@ enable_raw_mode(void)
   atexit(disable_raw_mode);
 }
 
-static int
-read_keypress(void)
+static int
+read_keypress(void)
+{
+  unsigned char ch;
+  int n = read(STDIN_FILENO, &ch, 1);
+  if (n == 1)
+    return ch;
+  return EOF;
+}
+
+
+/* -------------------- IMAGE ENGINE -------------------- */
+
+//
+// A small in-process decode -> resize -> encode pipeline, so that a thumbnail
+// costs a function call instead of a shell plus an ImageMagick process.
+// Decoders produce 8-bit RGBA. Anything they do not understand (arithmetic
+// coded JPEG, RLE bitmaps, WebP, ...) reports ENGINE_UNSUPPORTED and the
+// caller falls back to magick.
+//
+
+#define ENGINE_OK          0
+#define ENGINE_ERROR       (-1)
+#define ENGINE_UNSUPPORTED (-2)
+
+/* Refuse to allocate more than 512 MiB of RGBA; magick can have those. */
+#define ENGINE_MAX_PIXELS (1u << 27)
+/* Nor read more of a file than that much RGBA takes. */
+#define ENGINE_MAX_BYTES ((uint64_t)ENGINE_MAX_PIXELS * 4)
+
+typedef enum {
+  FMT_UNKNOWN = 0,
+  FMT_JPEG,
+  FMT_PNG,
+  FMT_GIF,
+  FMT_BMP,
+  FMT_PNM,
+  FMT_QOI,
+  /* Recognized, but left to magick. */
+  FMT_WEBP,
+  FMT_TIFF,
+  FMT_RAW,
+  FMT_HEIF,
+  FMT_JXL,
+  FMT_COUNT
+} ImageFormat;
+
+static const char* const format_names[FMT_COUNT] = {"",     "jpeg", "png",  "gif", "bmp",  "pnm",
+                                                    "qoi",  "webp", "tiff", "raw", "heif", "jxl"};
+
+/* Bytes sniff_format() needs to tell every format apart. */
+#define SNIFF_BYTES 32
+
+typedef struct {
+  int w, h;
+  int orient;        /* EXIF orientation 1..8, 1 = as stored */
+  unsigned char* px; /* w * h * 4 bytes, RGBA */
+} Pixmap;
+
+/* What an image's header says, read without decoding it; see image_meta(). */
+typedef struct {
+  int64_t taken;   /* capture time from EXIF, INT64_MIN if it has none */
+  uint32_t w, h;   /* as stored, 0 if not known */
+  uint32_t orient; /* EXIF orientation 1..8 */
+  uint32_t format; /* ImageFormat */
+} ImageMeta;
+
+typedef struct {
+  unsigned char* data;
+  size_t len, cap;
+} Buf;
+
+static int
+pixmap_alloc(Pixmap* pm, int w, int h)
+{
+  if (w <= 0 || h <= 0 || (uint64_t)w * (uint64_t)h > ENGINE_MAX_PIXELS)
+    return ENGINE_UNSUPPORTED;
+  pm->px = malloc((size_t)w * h * 4);
+  if (!pm->px)
+    return ENGINE_ERROR;
+  pm->w      = w;
+  pm->h      = h;
+  pm->orient = 1;
+  return ENGINE_OK;
+}
+
+static void
+pixmap_free(Pixmap* pm)
+{
+  free(pm->px);
+  pm->px = NULL;
+}
+
+static int
+buf_reserve(Buf* b, size_t extra)
+{
+  if (b->len + extra <= b->cap)
+    return 0;
+  size_t cap = b->cap ? b->cap : 4096;
+  while (cap < b->len + extra)
+    cap *= 2;
+  unsigned char* p = realloc(b->data, cap);
+  if (!p)
+    return -1;
+  b->data = p;
+  b->cap  = cap;
+  return 0;
+}
+
+static int
+buf_put(Buf* b, const void* p, size_t n)
+{
+  if (buf_reserve(b, n) != 0)
+    return -1;
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+  return 0;
+}
+
+static uint32_t rd_be16(const unsigned char* p) { return (uint32_t)p[0] << 8 | p[1]; }
+static uint32_t rd_le16(const unsigned char* p) { return (uint32_t)p[1] << 8 | p[0]; }
+
+static uint32_t
+rd_be32(const unsigned char* p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t
+rd_le32(const unsigned char* p)
+{
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static unsigned char
+clamp_u8(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+}
+
+// Identify an image by its first bytes.
+static ImageFormat
+sniff_format(const unsigned char* d, size_t n)
+{
+  if (n >= 3 && d[0] == 0xFF && d[1] == 0xD8 && d[2] == 0xFF)
+    return FMT_JPEG;
+  if (n >= 8 && memcmp(d, "\x89PNG\r\n\x1a\n", 8) == 0)
+    return FMT_PNG;
+  if (n >= 6 && (memcmp(d, "GIF87a", 6) == 0 || memcmp(d, "GIF89a", 6) == 0))
+    return FMT_GIF;
+  if (n >= 18 && d[0] == 'B' && d[1] == 'M') {
+    uint32_t hsz = rd_le32(d + 14);
+    if (hsz == 12 || hsz == 40 || hsz == 52 || hsz == 56 || hsz == 108 || hsz == 124)
+      return FMT_BMP;
+  }
+  if (n >= 3 && d[0] == 'P' && d[1] >= '1' && d[1] <= '6' && isspace(d[2]))
+    return FMT_PNM;
+  if (n >= 4 && memcmp(d, "qoif", 4) == 0)
+    return FMT_QOI;
+  if (n >= 12 && memcmp(d, "RIFF", 4) == 0 && memcmp(d + 8, "WEBP", 4) == 0)
+    return FMT_WEBP;
+
+  /* Camera raw containers, including the TIFF-based ones that say so. */
+  if (n >= 16 && (memcmp(d, "FUJIFILMCCD-RAW", 15) == 0 ||            /* RAF */
+                  memcmp(d, "II\x1a\0\0\0HEAPCCDR", 14) == 0))         /* CRW */
+    return FMT_RAW;
+  if (n >= 12 && memcmp(d + 4, "ftypcrx ", 8) == 0) /* CR3 */
+    return FMT_RAW;
+  if (n >= 4 && (memcmp(d, "IIRO", 4) == 0 || memcmp(d, "IIRS", 4) == 0 || /* ORF */
+                 memcmp(d, "IIU\0", 4) == 0 ||                           /* RW2 */
+                 memcmp(d, "\0MRM", 4) == 0 || memcmp(d, "FOVb", 4) == 0)) /* MRW, X3F */
+    return FMT_RAW;
+  if (n >= 4 && (memcmp(d, "II*\0", 4) == 0 || memcmp(d, "MM\0*", 4) == 0))
+    return n >= 11 && memcmp(d + 8, "CR\x02", 3) == 0 ? FMT_RAW : FMT_TIFF; /* CR2 */
+
+  if (n >= 12 && memcmp(d + 4, "ftyp", 4) == 0 &&
+      (memcmp(d + 8, "heic", 4) == 0 || memcmp(d + 8, "heix", 4) == 0 ||
+       memcmp(d + 8, "mif1", 4) == 0 || memcmp(d + 8, "avif", 4) == 0))
+    return FMT_HEIF;
+  if ((n >= 2 && d[0] == 0xFF && d[1] == 0x0A) ||
+      (n >= 12 && memcmp(d, "\0\0\0\x0cJXL \r\n\x87\n", 12) == 0))
+    return FMT_JXL;
+  return FMT_UNKNOWN;
+}
+
+// Fit w x h inside a bw x bh box keeping the aspect ratio (magick -resize WxH).
+static void
+fit_box(int w, int h, int bw, int bh, int* ow, int* oh)
+{
+  if ((int64_t)w * bh > (int64_t)h * bw) {
+    *ow = bw;
+    *oh = (int)(((int64_t)h * bw + w / 2) / w);
+  } else {
+    *oh = bh;
+    *ow = (int)(((int64_t)w * bh + h / 2) / h);
+  }
+  if (*ow < 1)
+    *ow = 1;
+  if (*oh < 1)
+    *oh = 1;
+}
+
+//
+// Read the orientation tag (0x0112) from IFD0 of a TIFF-structured EXIF
+// block. Returns 1 when there is none.
+//
+static int
+exif_orientation(const unsigned char* t, size_t n)
+{
+  if (n < 8)
+    return 1;
+  int le;
+  if (t[0] == 'I' && t[1] == 'I')
+    le = 1;
+  else if (t[0] == 'M' && t[1] == 'M')
+    le = 0;
+  else
+    return 1;
+
+  uint32_t ifd = le ? rd_le32(t + 4) : rd_be32(t + 4);
+  if (ifd > n - 2)
+    return 1;
+  uint32_t cnt = le ? rd_le16(t + ifd) : rd_be16(t + ifd);
+  for (uint32_t i = 0; i < cnt; i++) {
+    size_t e = ifd + 2 + 12 * (size_t)i;
+    if (e + 12 > n)
+      break;
+    uint32_t tag = le ? rd_le16(t + e) : rd_be16(t + e);
+    if (tag == 0x0112) {
+      uint32_t v = le ? rd_le16(t + e + 8) : rd_be16(t + e + 8);
+      return (v >= 1 && v <= 8) ? (int)v : 1;
+    }
+  }
+  return 1;
+}
+
+// Find 'tag' in the TIFF IFD at 'ifd'. Returns the offset of its 12-byte entry, or 0.
+static size_t
+tiff_entry(const unsigned char* t, size_t n, int le, uint32_t ifd, uint32_t tag)
+{
+  if (ifd < 8 || ifd > n - 2)
+    return 0;
+  uint32_t cnt = le ? rd_le16(t + ifd) : rd_be16(t + ifd);
+  for (uint32_t i = 0; i < cnt; i++) {
+    size_t e = ifd + 2 + 12 * (size_t)i;
+    if (e + 12 > n)
+      break;
+    if ((le ? rd_le16(t + e) : rd_be16(t + e)) == tag)
+      return e;
+  }
+  return 0;
+}
+
+//
+// When the picture was taken, from the EXIF block 't' (a TIFF header and
+// IFDs): DateTimeOriginal, else DateTimeDigitized, else the IFD0 DateTime,
+// read as UTC. Returns seconds since the epoch, or INT64_MIN if none.
+//
+static int64_t
+exif_taken(const unsigned char* t, size_t n)
+{
+  if (n < 8 || !((t[0] == 'I' && t[1] == 'I') || (t[0] == 'M' && t[1] == 'M')))
+    return INT64_MIN;
+  int le       = t[0] == 'I';
+  uint32_t ifd = le ? rd_le32(t + 4) : rd_be32(t + 4);
+
+  size_t e = 0, sub = tiff_entry(t, n, le, ifd, 0x8769); /* Exif sub-IFD */
+  if (sub) {
+    uint32_t exif = le ? rd_le32(t + sub + 8) : rd_be32(t + sub + 8);
+    e             = tiff_entry(t, n, le, exif, 0x9003);
+    if (!e)
+      e = tiff_entry(t, n, le, exif, 0x9004);
+  }
+  if (!e)
+    e = tiff_entry(t, n, le, ifd, 0x0132);
+  if (!e)
+    return INT64_MIN;
+
+  /* "YYYY:MM:DD HH:MM:SS", too long to sit in the entry itself */
+  uint32_t off = le ? rd_le32(t + e + 8) : rd_be32(t + e + 8);
+  if (off > n || n - off < 19)
+    return INT64_MIN;
+  struct tm tm = {0};
+  char when[20];
+  memcpy(when, t + off, 19);
+  when[19] = '\0';
+  if (sscanf(when, "%4d:%2d:%2d %2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
+             &tm.tm_min, &tm.tm_sec) != 6 || tm.tm_year < 1)
+    return INT64_MIN;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+
+/* ---- inflate (RFC 1950/1951) ---- */
+
+#define INF_FAST_BITS 9
+
+typedef struct {
+  uint16_t fast[1 << INF_FAST_BITS]; /* sym | len << 9, 0 = take the slow path */
+  uint16_t count[16];
+  uint16_t symbol[288];
+} InfHuff;
+
+typedef struct {
+  const unsigned char* in;
+  size_t inlen, pos;
+  uint64_t bitbuf;
+  int bitcnt;
+} InfBits;
+
+static const uint16_t deflate_len_base[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                                              15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                                              67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t deflate_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t deflate_dist_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t deflate_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static InfHuff inf_fixed_lit, inf_fixed_dist;
+
+static void
+inf_refill(InfBits* b)
+{
+  /* Past the end we shift in zeros; inf_overrun() catches real overreads. */
+  while (b->bitcnt <= 56) {
+    if (b->pos < b->inlen)
+      b->bitbuf |= (uint64_t)b->in[b->pos] << b->bitcnt;
+    b->pos++;
+    b->bitcnt += 8;
+  }
+}
+
+static unsigned
+inf_bits(InfBits* b, int n)
+{
+  if (b->bitcnt < n)
+    inf_refill(b);
+  unsigned v = (unsigned)(b->bitbuf & ((1u << n) - 1));
+  b->bitbuf >>= n;
+  b->bitcnt -= n;
+  return v;
+}
+
+static int
+inf_overrun(const InfBits* b)
+{
+  return b->pos - (size_t)(b->bitcnt / 8) > b->inlen;
+}
+
+static int
+inf_huff_build(InfHuff* h, const uint8_t* lens, int n)
+{
+  uint16_t offs[16], next[16];
+  memset(h->count, 0, sizeof(h->count));
+  memset(h->fast, 0, sizeof(h->fast));
+  for (int i = 0; i < n; i++)
+    h->count[lens[i]]++;
+  h->count[0] = 0;
+
+  int left = 1;
+  for (int len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0)
+      return -1; /* over-subscribed */
+  }
+
+  offs[1] = 0;
+  for (int len = 1; len < 15; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+
+  int code = 0;
+  for (int len = 1; len < 16; len++) {
+    code      = (code + h->count[len - 1]) << 1;
+    next[len] = code;
+  }
+
+  for (int sym = 0; sym < n; sym++) {
+    int len = lens[sym];
+    if (!len)
+      continue;
+    h->symbol[offs[len]++] = sym;
+    int c                  = next[len]++;
+    if (len <= INF_FAST_BITS) {
+      int rev = 0;
+      for (int i = 0; i < len; i++)
+        rev |= ((c >> i) & 1) << (len - 1 - i);
+      for (int j = rev; j < (1 << INF_FAST_BITS); j += 1 << len)
+        h->fast[j] = (uint16_t)(sym | len << 9);
+    }
+  }
+  return 0;
+}
+
+static int
+inf_decode(InfBits* b, const InfHuff* h)
+{
+  if (b->bitcnt < 16)
+    inf_refill(b);
+  unsigned e = h->fast[b->bitbuf & ((1u << INF_FAST_BITS) - 1)];
+  if (e) {
+    int len = e >> 9;
+    b->bitbuf >>= len;
+    b->bitcnt -= len;
+    return e & 511;
+  }
+
+  /* Codes longer than INF_FAST_BITS: canonical decode one bit at a time. */
+  int code = 0, first = 0, index = 0;
+  uint64_t bits = b->bitbuf;
+  for (int len = 1; len < 16; len++) {
+    code |= bits & 1;
+    bits >>= 1;
+    int count = h->count[len];
+    if (code - count < first) {
+      b->bitbuf >>= len;
+      b->bitcnt -= len;
+      return h->symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static int
+inf_dynamic(InfBits* b, InfHuff* lit, InfHuff* dist)
+{
+  static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  uint8_t lens[286 + 30];
+
+  int nlen  = inf_bits(b, 5) + 257;
+  int ndist = inf_bits(b, 5) + 1;
+  int ncode = inf_bits(b, 4) + 4;
+  if (nlen > 286 || ndist > 30)
+    return -1;
+
+  memset(lens, 0, 19);
+  for (int i = 0; i < ncode; i++)
+    lens[order[i]] = inf_bits(b, 3);
+
+  InfHuff cl;
+  if (inf_huff_build(&cl, lens, 19) != 0)
+    return -1;
+
+  int idx = 0;
+  while (idx < nlen + ndist) {
+    int sym = inf_decode(b, &cl);
+    if (sym < 0)
+      return -1;
+    if (sym < 16) {
+      lens[idx++] = sym;
+      continue;
+    }
+    int len = 0, rep;
+    if (sym == 16) {
+      if (idx == 0)
+        return -1;
+      len = lens[idx - 1];
+      rep = 3 + inf_bits(b, 2);
+    } else if (sym == 17) {
+      rep = 3 + inf_bits(b, 3);
+    } else {
+      rep = 11 + inf_bits(b, 7);
+    }
+    if (idx + rep > nlen + ndist)
+      return -1;
+    while (rep--)
+      lens[idx++] = len;
+  }
+
+  if (lens[256] == 0)
+    return -1;
+  if (inf_huff_build(lit, lens, nlen) != 0 || inf_huff_build(dist, lens + nlen, ndist) != 0)
+    return -1;
+  return 0;
+}
+
+//
+// Inflate a raw deflate stream into out[0..outcap). Callers always know the
+// decompressed size up front, so there is no need for a growing window.
+// With 'partial' a stream longer than that is not an error: inflating stops
+// once 'out' is full, which is how just the head of one is read.
+//
+static int
+inflate_raw(const unsigned char* in, size_t inlen, unsigned char* out, size_t outcap,
+            size_t* outlen, int partial)
+{
+  InfBits b = {in, inlen, 0, 0, 0};
+  InfHuff dyn_lit, dyn_dist;
+  size_t o = 0;
+  int final;
+
+  do {
+    if (partial && o == outcap)
+      goto done;
+    final    = inf_bits(&b, 1);
+    int type = inf_bits(&b, 2);
+
+    if (type == 0) {
+      /* Stored block: drop to a byte boundary and copy straight from the input. */
+      size_t p = b.pos - (size_t)(b.bitcnt / 8);
+      b.bitbuf = 0;
+      b.bitcnt = 0;
+      if (p + 4 > inlen)
+        return -1;
+      unsigned len  = in[p] | in[p + 1] << 8;
+      unsigned nlen = in[p + 2] | in[p + 3] << 8;
+      if ((len ^ 0xFFFF) != nlen)
+        return -1;
+      p += 4;
+      if (partial && len > outcap - o)
+        len = (unsigned)(outcap - o);
+      if (len > inlen - p || len > outcap - o)
+        return -1;
+      memcpy(out + o, in + p, len);
+      o += len;
+      b.pos = p + len;
+      continue;
+    }
+
+    const InfHuff* lit  = &inf_fixed_lit;
+    const InfHuff* dist = &inf_fixed_dist;
+    if (type == 2) {
+      if (inf_dynamic(&b, &dyn_lit, &dyn_dist) != 0)
+        return -1;
+      lit  = &dyn_lit;
+      dist = &dyn_dist;
+    } else if (type != 1) {
+      return -1;
+    }
+
+    for (;;) {
+      if (partial && o == outcap)
+        goto done;
+      int sym = inf_decode(&b, lit);
+      if (sym < 0)
+        return -1;
+      if (sym < 256) {
+        if (o >= outcap)
+          return -1;
+        out[o++] = (unsigned char)sym;
+        continue;
+      }
+      if (sym == 256)
+        break;
+
+      sym -= 257;
+      if (sym >= 29)
+        return -1;
+      size_t len = deflate_len_base[sym] + inf_bits(&b, deflate_len_extra[sym]);
+      int ds     = inf_decode(&b, dist);
+      if (ds < 0 || ds >= 30)
+        return -1;
+      size_t d = deflate_dist_base[ds] + inf_bits(&b, deflate_dist_extra[ds]);
+      if (partial && len > outcap - o)
+        len = outcap - o;
+      if (d > o || len > outcap - o)
+        return -1;
+      const unsigned char* src = out + o - d;
+      for (size_t i = 0; i < len; i++)
+        out[o + i] = src[i];
+      o += len;
+    }
+    if (inf_overrun(&b))
+      return -1;
+  } while (!final);
+
+done:
+  if (inf_overrun(&b))
+    return -1;
+  *outlen = o;
+  return 0;
+}
+
+static int
+zlib_decompress(const unsigned char* in, size_t inlen, unsigned char* out, size_t outcap,
+                size_t* outlen)
+{
+  if (inlen < 2 || (in[0] & 0x0F) != 8 || ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 0x20))
+    return -1;
+  return inflate_raw(in + 2, inlen - 2, out, outcap, outlen, 0);
+}
+
+
+/* ---- PNG ---- */
+
+static const int adam7_x0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const int adam7_y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const int adam7_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const int adam7_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+
+static int
+png_unfilter(unsigned char* row, const unsigned char* prev, size_t len, int bpp, int type)
+{
+  size_t i;
+  switch (type) {
+  case 0: break;
+  case 1:
+    for (i = bpp; i < len; i++)
+      row[i] += row[i - bpp];
+    break;
+  case 2:
+    if (prev)
+      for (i = 0; i < len; i++)
+        row[i] += prev[i];
+    break;
+  case 3:
+    for (i = 0; i < len; i++) {
+      int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+      int b = prev ? prev[i] : 0;
+      row[i] += (a + b) >> 1;
+    }
+    break;
+  case 4:
+    for (i = 0; i < len; i++) {
+      int a  = i >= (size_t)bpp ? row[i - bpp] : 0;
+      int b  = prev ? prev[i] : 0;
+      int c  = (prev && i >= (size_t)bpp) ? prev[i - bpp] : 0;
+      int p  = a + b - c;
+      int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+      row[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+    }
+    break;
+  default: return -1;
+  }
+  return 0;
+}
+
+static unsigned
+png_sample(const unsigned char* row, size_t idx, int depth)
+{
+  if (depth == 8)
+    return row[idx];
+  if (depth == 16)
+    return (unsigned)row[idx * 2] << 8 | row[idx * 2 + 1];
+  size_t bit = idx * depth;
+  return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1u << depth) - 1);
+}
+
+static int
+decode_png(const unsigned char* d, size_t n, Pixmap* pm)
+{
+  uint32_t w = 0, h = 0;
+  int depth = 0, ctype = 0, interlace = 0;
+  unsigned char pal[256 * 4];
+  int npal = 0, has_trns = 0;
+  unsigned trns[3] = {0, 0, 0};
+  Buf idat          = {0};
+  unsigned char* raw = NULL;
+  int rc             = ENGINE_ERROR;
+
+  memset(pal, 0, sizeof(pal));
+  for (int i = 0; i < 256; i++)
+    pal[i * 4 + 3] = 255;
+
+  size_t p = 8;
+  while (p + 12 <= n) {
+    uint32_t len = rd_be32(d + p);
+    const unsigned char* type = d + p + 4;
+    const unsigned char* body = d + p + 8;
+    if (len > n - p - 12)
+      goto done;
+
+    if (memcmp(type, "IHDR", 4) == 0) {
+      if (len < 13)
+        goto done;
+      w         = rd_be32(body);
+      h         = rd_be32(body + 4);
+      depth     = body[8];
+      ctype     = body[9];
+      interlace = body[12];
+      if (body[10] != 0 || body[11] != 0 || interlace > 1)
+        goto done;
+    } else if (memcmp(type, "PLTE", 4) == 0) {
+      npal = len / 3 > 256 ? 256 : len / 3;
+      for (int i = 0; i < npal; i++)
+        memcpy(pal + i * 4, body + i * 3, 3);
+    } else if (memcmp(type, "tRNS", 4) == 0) {
+      has_trns = 1;
+      if (ctype == 3) {
+        for (uint32_t i = 0; i < len && i < 256; i++)
+          pal[i * 4 + 3] = body[i];
+      } else if (ctype == 0 && len >= 2) {
+        trns[0] = rd_be16(body);
+      } else if (ctype == 2 && len >= 6) {
+        trns[0] = rd_be16(body);
+        trns[1] = rd_be16(body + 2);
+        trns[2] = rd_be16(body + 4);
+      }
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      if (buf_put(&idat, body, len) != 0)
+        goto done;
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      break;
+    }
+    p += 12 + (size_t)len;
+  }
+
+  int channels;
+  switch (ctype) {
+  case 0: channels = 1; break;
+  case 2: channels = 3; break;
+  case 3: channels = 1; break;
+  case 4: channels = 2; break;
+  case 6: channels = 4; break;
+  default: goto done;
+  }
+  if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+    goto done;
+  if ((ctype == 3 && depth > 8) || ((ctype == 2 || ctype == 4 || ctype == 6) && depth < 8))
+    goto done;
+  if (w == 0 || h == 0 || w > 0x7FFFFFFF || h > 0x7FFFFFFF)
+    goto done;
+
+  if ((rc = pixmap_alloc(pm, (int)w, (int)h)) != ENGINE_OK)
+    goto done;
+  rc = ENGINE_ERROR;
+
+  int bits_pp = depth * channels;
+  int bpp     = bits_pp < 8 ? 1 : bits_pp / 8;
+  int passes  = interlace ? 7 : 1;
+  size_t total = 0;
+  for (int pass = 0; pass < passes; pass++) {
+    int x0 = interlace ? adam7_x0[pass] : 0, dx = interlace ? adam7_dx[pass] : 1;
+    int y0 = interlace ? adam7_y0[pass] : 0, dy = interlace ? adam7_dy[pass] : 1;
+    size_t pw = w > (uint32_t)x0 ? (w - x0 + dx - 1) / dx : 0;
+    size_t ph = h > (uint32_t)y0 ? (h - y0 + dy - 1) / dy : 0;
+    if (pw && ph)
+      total += ph * ((pw * bits_pp + 7) / 8 + 1);
+  }
+
+  raw = malloc(total);
+  size_t got;
+  if (!raw || zlib_decompress(idat.data, idat.len, raw, total, &got) != 0 || got != total)
+    goto done;
+
+  unsigned maxv = (1u << depth) - 1;
+  size_t off    = 0;
+  for (int pass = 0; pass < passes; pass++) {
+    int x0 = interlace ? adam7_x0[pass] : 0, dx = interlace ? adam7_dx[pass] : 1;
+    int y0 = interlace ? adam7_y0[pass] : 0, dy = interlace ? adam7_dy[pass] : 1;
+    size_t pw = w > (uint32_t)x0 ? (w - x0 + dx - 1) / dx : 0;
+    size_t ph = h > (uint32_t)y0 ? (h - y0 + dy - 1) / dy : 0;
+    if (!pw || !ph)
+      continue;
+    size_t rowbytes          = (pw * bits_pp + 7) / 8;
+    const unsigned char* prev = NULL;
+
+    for (size_t y = 0; y < ph; y++) {
+      unsigned char* row = raw + off + 1;
+      if (png_unfilter(row, prev, rowbytes, bpp, raw[off]) != 0)
+        goto done;
+      prev = row;
+      off += rowbytes + 1;
+
+      unsigned char* out = pm->px + ((y0 + y * dy) * (size_t)w + x0) * 4;
+      for (size_t x = 0; x < pw; x++, out += dx * 4) {
+        unsigned v, r, g, b, a = 255;
+        switch (ctype) {
+        case 0:
+          v = png_sample(row, x, depth);
+          if (has_trns && v == trns[0])
+            a = 0;
+          r = g = b = depth == 16 ? v >> 8 : v * 255 / maxv;
+          break;
+        case 2:
+          r = png_sample(row, x * 3, depth);
+          g = png_sample(row, x * 3 + 1, depth);
+          b = png_sample(row, x * 3 + 2, depth);
+          if (has_trns && r == trns[0] && g == trns[1] && b == trns[2])
+            a = 0;
+          if (depth == 16) {
+            r >>= 8;
+            g >>= 8;
+            b >>= 8;
+          }
+          break;
+        case 3:
+          v = png_sample(row, x, depth);
+          memcpy(out, pal + v * 4, 4);
+          continue;
+        case 4:
+          r = g = b = png_sample(row, x * 2, depth);
+          a         = png_sample(row, x * 2 + 1, depth);
+          if (depth == 16) {
+            r = g = b = r >> 8;
+            a         = a >> 8;
+          }
+          break;
+        default:
+          r = png_sample(row, x * 4, depth);
+          g = png_sample(row, x * 4 + 1, depth);
+          b = png_sample(row, x * 4 + 2, depth);
+          a = png_sample(row, x * 4 + 3, depth);
+          if (depth == 16) {
+            r >>= 8;
+            g >>= 8;
+            b >>= 8;
+            a >>= 8;
+          }
+          break;
+        }
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = a;
+      }
+    }
+  }
+  rc = ENGINE_OK;
+
+done:
+  free(idat.data);
+  free(raw);
+  if (rc != ENGINE_OK)
+    pixmap_free(pm);
+  return rc;
+}
+
+
+/* ---- JPEG (baseline and progressive, Huffman coded) ---- */
+
+static const uint8_t jpeg_zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+/* IDCT basis for 8, 4, 2 and 1 output samples per block: [x * 8 + u]. */
+static float jpeg_idct_tab[4][64];
+
+#define JPEG_LOOK_BITS 9
+
+typedef struct {
+  int present;
+  uint8_t look_len[1 << JPEG_LOOK_BITS]; /* 0 = code longer than JPEG_LOOK_BITS */
+  uint8_t look_val[1 << JPEG_LOOK_BITS];
+  int32_t maxcode[17];                   /* largest code of each length, -1 if none */
+  int32_t valoff[17];                    /* values[] index minus first code of each length */
+  uint8_t values[256];
+} JpegHuff;
+
+typedef struct {
+  int id, hs, vs, tq;
+  int td, ta;           /* Huffman tables used by the current scan */
+  int bw, bh;           /* blocks per row/column, padded to whole MCUs */
+  int pred;             /* DC predictor */
+  unsigned char* plane; /* samples, (bw * scale) x (bh * scale) */
+  int16_t* coef;        /* progressive only: quantized coefficients, natural order */
+} JpegComp;
+
+typedef struct {
+  const unsigned char* d;
+  size_t n, pos;
+  uint32_t bits;
+  int nbits;
+  int marker; /* ran into a marker inside entropy-coded data */
+  uint16_t q[4][64];
+  JpegHuff dc[4], ac[4];
+  int w, h, ncomp, progressive;
+  int hmax, vmax, mcux, mcuy;
+  int restart;
+  int adobe, adobe_transform;
+  int scale;  /* samples per block edge: 8, 4, 2 or 1 (DC only) */
+  int cstride; /* coefficients stored per block: 64, or 1 in DC-only mode */
+  int eobrun;
+  int orient;
+  JpegComp comp[4];
+} Jpeg;
+
+static int
+jpeg_huff_build(JpegHuff* h, const uint8_t* counts, const uint8_t* vals, int nvals)
+{
+  memcpy(h->values, vals, nvals);
+  memset(h->look_len, 0, sizeof(h->look_len));
+  int code = 0, k = 0;
+  for (int len = 1; len <= 16; len++) {
+    int cnt        = counts[len - 1];
+    h->valoff[len] = k - code;
+    for (int i = 0; i < cnt; i++, code++, k++) {
+      /* An over-subscribed table runs out of codes of this length. */
+      if (code >= 1 << len || k >= nvals)
+        return -1;
+      if (len <= JPEG_LOOK_BITS) {
+        int shift = JPEG_LOOK_BITS - len;
+        for (int j = 0; j < 1 << shift; j++) {
+          h->look_len[(code << shift) | j] = len;
+          h->look_val[(code << shift) | j] = vals[k];
+        }
+      }
+    }
+    h->maxcode[len] = cnt ? code - 1 : -1;
+    code <<= 1;
+  }
+  h->present = 1;
+  return 0;
+}
+
+static void
+jpeg_fill(Jpeg* j)
+{
+  while (j->nbits <= 24) {
+    int c = 0;
+    if (!j->marker && j->pos < j->n) {
+      c = j->d[j->pos];
+      if (c == 0xFF) {
+        int c2 = j->pos + 1 < j->n ? j->d[j->pos + 1] : 0xD9;
+        if (c2 == 0) {
+          j->pos += 2;
+        } else {
+          j->marker = 1;
+          c         = 0;
+        }
+      } else {
+        j->pos++;
+      }
+    }
+    j->bits |= (uint32_t)c << (24 - j->nbits);
+    j->nbits += 8;
+  }
+}
+
+static int
+jpeg_bits(Jpeg* j, int n)
+{
+  if (n == 0)
+    return 0;
+  if (j->nbits < n)
+    jpeg_fill(j);
+  int v = (int)(j->bits >> (32 - n));
+  j->bits <<= n;
+  j->nbits -= n;
+  return v;
+}
+
+static int
+jpeg_extend(int v, int n)
+{
+  return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+}
+
+static int
+jpeg_decode(Jpeg* j, const JpegHuff* h)
+{
+  if (j->nbits < 16)
+    jpeg_fill(j);
+  int look = j->bits >> (32 - JPEG_LOOK_BITS);
+  int len  = h->look_len[look];
+  if (len) {
+    j->bits <<= len;
+    j->nbits -= len;
+    return h->look_val[look];
+  }
+  for (len = JPEG_LOOK_BITS + 1; len <= 16; len++) {
+    int code = (int)(j->bits >> (32 - len));
+    if (code <= h->maxcode[len]) {
+      j->bits <<= len;
+      j->nbits -= len;
+      return h->values[h->valoff[len] + code];
+    }
+  }
+  return -1;
+}
+
+// Move past the next marker after entropy-coded data (but not past other markers).
+static void
+jpeg_seek_marker(Jpeg* j)
+{
+  while (j->pos + 1 < j->n && !(j->d[j->pos] == 0xFF && j->d[j->pos + 1] != 0))
+    j->pos++;
+}
+
+static void
+jpeg_reset(Jpeg* j)
+{
+  j->bits   = 0;
+  j->nbits  = 0;
+  j->marker = 0;
+  j->eobrun = 0;
+  for (int i = 0; i < j->ncomp; i++)
+    j->comp[i].pred = 0;
+}
+
+static void
+jpeg_restart(Jpeg* j)
+{
+  jpeg_seek_marker(j);
+  if (j->pos + 1 < j->n && j->d[j->pos + 1] >= 0xD0 && j->d[j->pos + 1] <= 0xD7)
+    j->pos += 2;
+  jpeg_reset(j);
+}
+
+// Scaled IDCT of dequantized coefficients into n x n samples.
+static void
+jpeg_idct(const int32_t* coef, int n, int dc_only, unsigned char* out, int stride)
+{
+  if (dc_only || n == 1) {
+    unsigned char v = clamp_u8(((coef[0] + 4) >> 3) + 128);
+    for (int y = 0; y < n; y++)
+      memset(out + y * stride, v, n);
+    return;
+  }
+
+  const float* t = jpeg_idct_tab[n == 8 ? 0 : n == 4 ? 1 : 2];
+  float tmp[8][8];
+  for (int v = 0; v < n; v++) {
+    const int32_t* row = coef + v * 8;
+    for (int x = 0; x < n; x++) {
+      float s = 0;
+      for (int u = 0; u < n; u++)
+        s += t[x * 8 + u] * row[u];
+      tmp[v][x] = s;
+    }
+  }
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      float s = 128.5f;
+      for (int v = 0; v < n; v++)
+        s += t[y * 8 + v] * tmp[v][x];
+      out[y * stride + x] = clamp_u8((int)s - (s < 0));
+    }
+  }
+}
+
+static int
+jpeg_block_baseline(Jpeg* j, JpegComp* c, int bx, int by)
+{
+  int32_t coef[64];
+  const uint16_t* q = j->q[c->tq];
+  int n             = j->scale;
+
+  memset(coef, 0, sizeof(coef));
+  int t = jpeg_decode(j, &j->dc[c->td]);
+  if (t < 0 || t > 15)
+    return -1;
+  c->pred += t ? jpeg_extend(jpeg_bits(j, t), t) : 0;
+  coef[0] = c->pred * q[0];
+
+  const JpegHuff* ac = &j->ac[c->ta];
+  int dc_only        = 1;
+  for (int k = 1; k < 64;) {
+    int rs = jpeg_decode(j, ac);
+    if (rs < 0)
+      return -1;
+    int r = rs >> 4, s = rs & 15;
+    if (s == 0) {
+      if (r != 15)
+        break;
+      k += 16;
+      continue;
+    }
+    k += r;
+    if (k > 63)
+      return -1;
+    int v   = jpeg_extend(jpeg_bits(j, s), s);
+    int pos = jpeg_zigzag[k];
+    if (n > 1) {
+      coef[pos] = v * q[pos];
+      dc_only   = 0;
+    }
+    k++;
+  }
+
+  int stride = c->bw * n;
+  jpeg_idct(coef, n, dc_only, c->plane + (size_t)by * n * stride + (size_t)bx * n, stride);
+  return 0;
+}
+
+static int
+jpeg_block_prog_dc(Jpeg* j, JpegComp* c, int16_t* blk, int ah, int al)
+{
+  if (ah == 0) {
+    int t = jpeg_decode(j, &j->dc[c->td]);
+    if (t < 0 || t > 15)
+      return -1;
+    c->pred += t ? jpeg_extend(jpeg_bits(j, t), t) : 0;
+    blk[0] = (int16_t)(c->pred * (1 << al));
+  } else if (jpeg_bits(j, 1)) {
+    blk[0] |= (int16_t)(1 << al);
+  }
+  return 0;
+}
+
+static int
+jpeg_block_prog_ac(Jpeg* j, JpegComp* c, int16_t* blk, int ss, int se, int ah, int al)
+{
+  const JpegHuff* ac = &j->ac[c->ta];
+
+  if (ah == 0) {
+    if (j->eobrun > 0) {
+      j->eobrun--;
+      return 0;
+    }
+    for (int k = ss; k <= se;) {
+      int rs = jpeg_decode(j, ac);
+      if (rs < 0)
+        return -1;
+      int r = rs >> 4, s = rs & 15;
+      if (s == 0) {
+        if (r < 15) {
+          j->eobrun = (1 << r) - 1;
+          if (r)
+            j->eobrun += jpeg_bits(j, r);
+          break;
+        }
+        k += 16;
+        continue;
+      }
+      k += r;
+      if (k > 63)
+        return -1;
+      blk[jpeg_zigzag[k]] = (int16_t)(jpeg_extend(jpeg_bits(j, s), s) * (1 << al));
+      k++;
+    }
+    return 0;
+  }
+
+  /* Successive approximation refinement (G.1.2.3). */
+  int p1 = 1 << al, m1 = -1 * (1 << al);
+  int k  = ss;
+  if (j->eobrun <= 0) {
+    for (; k <= se; k++) {
+      int rs = jpeg_decode(j, ac);
+      if (rs < 0)
+        return -1;
+      int r = rs >> 4, s = rs & 15, val = 0;
+      if (s) {
+        val = jpeg_bits(j, 1) ? p1 : m1;
+      } else if (r != 15) {
+        j->eobrun = 1 << r;
+        if (r)
+          j->eobrun += jpeg_bits(j, r);
+        break;
+      }
+      do {
+        int16_t* cf = &blk[jpeg_zigzag[k]];
+        if (*cf != 0) {
+          if (jpeg_bits(j, 1) && (*cf & p1) == 0)
+            *cf += *cf >= 0 ? p1 : m1;
+        } else {
+          if (--r < 0)
+            break;
+        }
+        k++;
+      } while (k <= se);
+      if (val && k <= se)
+        blk[jpeg_zigzag[k]] = (int16_t)val;
+    }
+  }
+  if (j->eobrun > 0) {
+    for (; k <= se; k++) {
+      int16_t* cf = &blk[jpeg_zigzag[k]];
+      if (*cf != 0 && jpeg_bits(j, 1) && (*cf & p1) == 0)
+        *cf += *cf >= 0 ? p1 : m1;
+    }
+    j->eobrun--;
+  }
+  return 0;
+}
+
+static int
+jpeg_block(Jpeg* j, JpegComp* c, int bx, int by, int ss, int se, int ah, int al)
+{
+  if (!j->progressive)
+    return jpeg_block_baseline(j, c, bx, by);
+  int16_t* blk = c->coef + ((size_t)by * c->bw + bx) * j->cstride;
+  if (ss == 0)
+    return jpeg_block_prog_dc(j, c, blk, ah, al);
+  return jpeg_block_prog_ac(j, c, blk, ss, se, ah, al);
+}
+
+static int
+jpeg_scan(Jpeg* j, JpegComp** sc, int ns, int ss, int se, int ah, int al)
+{
+  jpeg_reset(j);
+
+  /* DC-only decoding never needs the AC scans of a progressive image. */
+  if (j->progressive && j->cstride == 1 && ss > 0) {
+    for (;;) {
+      jpeg_seek_marker(j);
+      if (j->pos + 1 < j->n && j->d[j->pos + 1] >= 0xD0 && j->d[j->pos + 1] <= 0xD7)
+        j->pos += 2;
+      else
+        return 0;
+    }
+  }
+
+  int todo = j->restart;
+  if (ns == 1) {
+    JpegComp* c = sc[0];
+    int cw      = (j->w * c->hs + j->hmax - 1) / j->hmax;
+    int ch      = (j->h * c->vs + j->vmax - 1) / j->vmax;
+    int nbx = (cw + 7) / 8, nby = (ch + 7) / 8;
+    for (int by = 0; by < nby; by++) {
+      for (int bx = 0; bx < nbx; bx++) {
+        if (j->restart && todo-- == 0) {
+          jpeg_restart(j);
+          todo = j->restart - 1;
+        }
+        if (jpeg_block(j, c, bx, by, ss, se, ah, al) != 0)
+          return -1;
+      }
+    }
+  } else {
+    for (int my = 0; my < j->mcuy; my++) {
+      for (int mx = 0; mx < j->mcux; mx++) {
+        if (j->restart && todo-- == 0) {
+          jpeg_restart(j);
+          todo = j->restart - 1;
+        }
+        for (int i = 0; i < ns; i++) {
+          JpegComp* c = sc[i];
+          for (int v = 0; v < c->vs; v++)
+            for (int h = 0; h < c->hs; h++)
+              if (jpeg_block(j, c, mx * c->hs + h, my * c->vs + v, ss, se, ah, al) != 0)
+                return -1;
+        }
+      }
+    }
+  }
+  jpeg_seek_marker(j);
+  return 0;
+}
+
+// Dequantize and IDCT every stored block of a progressive image.
+static void
+jpeg_finish_progressive(Jpeg* j)
+{
+  int n = j->scale;
+  for (int i = 0; i < j->ncomp; i++) {
+    JpegComp* c       = &j->comp[i];
+    const uint16_t* q = j->q[c->tq];
+    int stride        = c->bw * n;
+    for (int by = 0; by < c->bh; by++) {
+      for (int bx = 0; bx < c->bw; bx++) {
+        const int16_t* blk = c->coef + ((size_t)by * c->bw + bx) * j->cstride;
+        int32_t coef[64];
+        int dc_only = 1;
+        coef[0]     = blk[0] * q[0];
+        if (n > 1) {
+          for (int k = 1; k < 64; k++) {
+            coef[k] = blk[k] * q[k];
+            dc_only &= coef[k] == 0;
+          }
+        }
+        jpeg_idct(coef, n, dc_only, c->plane + (size_t)by * n * stride + (size_t)bx * n, stride);
+      }
+    }
+  }
+}
+
+static int
+jpeg_frame(Jpeg* j, int sof, const unsigned char* s, size_t len, int box_w, int box_h)
+{
+  if (len < 6)
+    return ENGINE_ERROR;
+  if (s[0] != 8)
+    return ENGINE_UNSUPPORTED; /* 12-bit precision */
+  j->progressive = sof == 0xC2;
+  j->h           = rd_be16(s + 1);
+  j->w           = rd_be16(s + 3);
+  j->ncomp       = s[5];
+  if (j->h == 0)
+    return ENGINE_UNSUPPORTED; /* height deferred to a DNL marker */
+  if (j->w == 0 || (j->ncomp != 1 && j->ncomp != 3 && j->ncomp != 4) || len < 6 + 3u * j->ncomp)
+    return ENGINE_ERROR;
+  if ((uint64_t)j->w * j->h > ENGINE_MAX_PIXELS)
+    return ENGINE_UNSUPPORTED;
+
+  j->hmax = j->vmax = 1;
+  for (int i = 0; i < j->ncomp; i++) {
+    JpegComp* c = &j->comp[i];
+    c->id       = s[6 + i * 3];
+    c->hs       = s[7 + i * 3] >> 4;
+    c->vs       = s[7 + i * 3] & 15;
+    c->tq       = s[8 + i * 3];
+    if (c->hs < 1 || c->hs > 4 || c->vs < 1 || c->vs > 4 || c->tq > 3)
+      return ENGINE_ERROR;
+    if (c->hs > j->hmax)
+      j->hmax = c->hs;
+    if (c->vs > j->vmax)
+      j->vmax = c->vs;
+  }
+  j->mcux = (j->w + 8 * j->hmax - 1) / (8 * j->hmax);
+  j->mcuy = (j->h + 8 * j->vmax - 1) / (8 * j->vmax);
+
+  /*
+   * Decode straight at a reduced size when the result still covers the
+   * target box: only the low-frequency corner of each block is transformed,
+   * and at 1/8 only the DC coefficient is used at all.
+   */
+  int tw, th;
+  if (j->orient >= 5)
+    fit_box(j->h, j->w, box_w, box_h, &th, &tw);
+  else
+    fit_box(j->w, j->h, box_w, box_h, &tw, &th);
+  j->scale = 8;
+  for (int denom = 8; denom > 1; denom >>= 1) {
+    if ((j->w + denom - 1) / denom >= tw && (j->h + denom - 1) / denom >= th) {
+      j->scale = 8 / denom;
+      break;
+    }
+  }
+  j->cstride = j->scale == 1 ? 1 : 64;
+
+  for (int i = 0; i < j->ncomp; i++) {
+    JpegComp* c = &j->comp[i];
+    c->bw       = j->mcux * c->hs;
+    c->bh       = j->mcuy * c->vs;
+    c->plane    = malloc((size_t)c->bw * c->bh * j->scale * j->scale);
+    if (!c->plane)
+      return ENGINE_ERROR;
+    if (j->progressive) {
+      c->coef = calloc((size_t)c->bw * c->bh, j->cstride * sizeof(int16_t));
+      if (!c->coef)
+        return ENGINE_ERROR;
+    }
+  }
+  return ENGINE_OK;
+}
+
+static int
+jpeg_sos(Jpeg* j, const unsigned char* s, size_t len)
+{
+  if (!j->ncomp || len < 1)
+    return -1;
+  int ns = s[0];
+  if (ns < 1 || ns > j->ncomp || len < 4 + 2u * ns)
+    return -1;
+
+  JpegComp* sc[4];
+  for (int i = 0; i < ns; i++) {
+    int id = s[1 + i * 2], tables = s[2 + i * 2];
+    sc[i]  = NULL;
+    for (int k = 0; k < j->ncomp; k++)
+      if (j->comp[k].id == id)
+        sc[i] = &j->comp[k];
+    if (!sc[i])
+      return -1;
+    sc[i]->td = tables >> 4;
+    sc[i]->ta = tables & 15;
+    if (sc[i]->td > 3 || sc[i]->ta > 3)
+      return -1;
+  }
+  int ss = s[1 + ns * 2], se = s[2 + ns * 2];
+  int ah = s[3 + ns * 2] >> 4, al = s[3 + ns * 2] & 15;
+
+  if (j->progressive) {
+    if (ss > se || se > 63 || (ss == 0 && se != 0) || (ss > 0 && ns != 1) || al > 13)
+      return -1;
+  } else {
+    ss = 0;
+    se = 63;
+    ah = al = 0;
+  }
+  for (int i = 0; i < ns; i++) {
+    if (ss == 0 && ah == 0 && !j->dc[sc[i]->td].present)
+      return -1;
+    if (se > 0 && !j->ac[sc[i]->ta].present)
+      return -1;
+  }
+  return jpeg_scan(j, sc, ns, ss, se, ah, al);
+}
+
+// Adobe CMYK is stored inverted, so the product of the two gives the intensity.
+static unsigned char
+jpeg_cmyk(int c, int k)
+{
+  int t = c * k + 128;
+  return (unsigned char)((t + (t >> 8)) >> 8);
+}
+
+static int
+jpeg_output(Jpeg* j, Pixmap* pm)
+{
+  int denom = 8 / j->scale;
+  int ow = (j->w + denom - 1) / denom, oh = (j->h + denom - 1) / denom;
+  int rc = pixmap_alloc(pm, ow, oh);
+  if (rc != ENGINE_OK)
+    return rc;
+  pm->orient = j->orient;
+
+  int* xmap = malloc(sizeof(int) * (size_t)ow * j->ncomp);
+  if (!xmap) {
+    pixmap_free(pm);
+    return ENGINE_ERROR;
+  }
+  for (int i = 0; i < j->ncomp; i++)
+    for (int x = 0; x < ow; x++)
+      xmap[i * ow + x] = x * j->comp[i].hs / j->hmax;
+
+  int rgb = j->ncomp == 3 && ((j->adobe && j->adobe_transform == 0) ||
+                              (j->comp[0].id == 'R' && j->comp[1].id == 'G' && j->comp[2].id == 'B'));
+  int ycck = j->ncomp == 4 && j->adobe && j->adobe_transform == 2;
+
+  for (int y = 0; y < oh; y++) {
+    const unsigned char* rows[4];
+    for (int i = 0; i < j->ncomp; i++) {
+      JpegComp* c = &j->comp[i];
+      rows[i]     = c->plane + (size_t)(y * c->vs / j->vmax) * c->bw * j->scale;
+    }
+    unsigned char* out = pm->px + (size_t)y * ow * 4;
+    for (int x = 0; x < ow; x++, out += 4) {
+      int s0 = rows[0][xmap[x]];
+      out[3] = 255;
+      if (j->ncomp == 1) {
+        out[0] = out[1] = out[2] = s0;
+        continue;
+      }
+      int s1 = rows[1][xmap[ow + x]], s2 = rows[2][xmap[2 * ow + x]];
+      int r, g, b;
+      if (rgb) {
+        r = s0;
+        g = s1;
+        b = s2;
+      } else if (j->ncomp == 4 && !ycck) {
+        r = s0;
+        g = s1;
+        b = s2;
+      } else {
+        int cb = s1 - 128, cr = s2 - 128;
+        r      = clamp_u8(s0 + ((91881 * cr + 32768) >> 16));
+        g      = clamp_u8(s0 - ((22554 * cb + 46802 * cr - 32768) >> 16));
+        b      = clamp_u8(s0 + ((116130 * cb + 32768) >> 16));
+      }
+      if (j->ncomp == 4) {
+        int k = rows[3][xmap[3 * ow + x]];
+        if (ycck) {
+          r = 255 - r;
+          g = 255 - g;
+          b = 255 - b;
+        }
+        r = jpeg_cmyk(r, k);
+        g = jpeg_cmyk(g, k);
+        b = jpeg_cmyk(b, k);
+      }
+      out[0] = r;
+      out[1] = g;
+      out[2] = b;
+    }
+  }
+  free(xmap);
+  return ENGINE_OK;
+}
+
+//
+// Decode a JPEG, reducing it by 2, 4 or 8 in the DCT domain when the
+// result will still cover box_w x box_h after orientation.
+//
+static int
+decode_jpeg(const unsigned char* d, size_t n, int box_w, int box_h, Pixmap* pm)
+{
+  Jpeg* j = calloc(1, sizeof(*j));
+  if (!j)
+    return ENGINE_ERROR;
+  j->d      = d;
+  j->n      = n;
+  j->pos    = 2;
+  j->orient = 1;
+
+  int rc = ENGINE_ERROR, scans = 0;
+  while (j->pos + 1 < n) {
+    if (d[j->pos] != 0xFF) {
+      j->pos++;
+      continue;
+    }
+    int m = d[j->pos + 1];
+    j->pos += 2;
+    if (m == 0xFF) {
+      j->pos--;
+      continue;
+    }
+    if (m == 0xD9)
+      break;
+    if ((m >= 0xD0 && m <= 0xD7) || m == 0x01 || m == 0x00)
+      continue;
+    if (j->pos + 2 > n)
+      goto done;
+    size_t len = rd_be16(d + j->pos);
+    if (len < 2 || j->pos + len > n)
+      goto done;
+    const unsigned char* s = d + j->pos + 2;
+    size_t slen            = len - 2;
+
+    switch (m) {
+    case 0xDB: /* DQT */
+      for (size_t p = 0; p < slen;) {
+        int pq = s[p] >> 4, tq = s[p] & 15;
+        if (tq > 3 || p + 1 + 64 * (pq + 1) > slen)
+          goto done;
+        for (int k = 0; k < 64; k++)
+          j->q[tq][jpeg_zigzag[k]] = pq ? rd_be16(s + p + 1 + k * 2) : s[p + 1 + k];
+        p += 1 + 64 * (pq + 1);
+      }
+      break;
+    case 0xC4: /* DHT */
+      for (size_t p = 0; p < slen;) {
+        if (p + 17 > slen)
+          goto done;
+        int tc = s[p] >> 4, th = s[p] & 15, total = 0;
+        for (int k = 0; k < 16; k++)
+          total += s[p + 1 + k];
+        if (tc > 1 || th > 3 || total > 256 || p + 17 + total > slen)
+          goto done;
+        if (jpeg_huff_build(tc ? &j->ac[th] : &j->dc[th], s + p + 1, s + p + 17, total) != 0)
+          goto done;
+        p += 17 + total;
+      }
+      break;
+    case 0xDD: /* DRI */
+      if (slen < 2)
+        goto done;
+      j->restart = rd_be16(s);
+      break;
+    case 0xC0:
+    case 0xC1:
+    case 0xC2:
+      if (j->ncomp) /* only one frame per image */
+        goto done;
+      if ((rc = jpeg_frame(j, m, s, slen, box_w, box_h)) != ENGINE_OK)
+        goto done;
+      rc = ENGINE_ERROR;
+      break;
+    case 0xC3:
+    case 0xC5:
+    case 0xC6:
+    case 0xC7:
+    case 0xC9:
+    case 0xCA:
+    case 0xCB:
+    case 0xCD:
+    case 0xCE:
+    case 0xCF: rc = ENGINE_UNSUPPORTED; goto done; /* lossless, hierarchical, arithmetic */
+    case 0xE1:
+      if (slen > 6 && memcmp(s, "Exif\0\0", 6) == 0)
+        j->orient = exif_orientation(s + 6, slen - 6);
+      break;
+    case 0xEE:
+      if (slen >= 12 && memcmp(s, "Adobe", 5) == 0) {
+        j->adobe           = 1;
+        j->adobe_transform = s[11];
+      }
+      break;
+    case 0xDA:
+      j->pos += len;
+      if (jpeg_sos(j, s, slen) != 0)
+        goto done;
+      scans++;
+      continue;
+    }
+    j->pos += len;
+  }
+
+  if (!j->ncomp || !scans)
+    goto done;
+  if (j->progressive)
+    jpeg_finish_progressive(j);
+  rc = jpeg_output(j, pm);
+
+done:
+  for (int i = 0; i < 4; i++) {
+    free(j->comp[i].plane);
+    free(j->comp[i].coef);
+  }
+  free(j);
+  return rc;
+}
+
+
+/* ---- GIF (first frame) ---- */
+
+static void
+gif_lzw(const unsigned char* in, size_t n, int min, unsigned char* out, size_t outn)
+{
+  uint16_t prefix[4096];
+  uint8_t suffix[4096], first[4096], stack[4097];
+  int clear = 1 << min, eoi = clear + 1;
+  int size = min + 1, next = clear + 2, prev = -1;
+  uint32_t bits = 0;
+  int nbits     = 0;
+  size_t p = 0, o = 0;
+
+  for (int i = 0; i < clear; i++) {
+    suffix[i] = (uint8_t)i;
+    first[i]  = (uint8_t)i;
+  }
+
+  while (o < outn) {
+    while (nbits < size) {
+      if (p >= n)
+        return; /* truncated: keep what we have */
+      bits |= (uint32_t)in[p++] << nbits;
+      nbits += 8;
+    }
+    int code = bits & ((1u << size) - 1);
+    bits >>= size;
+    nbits -= size;
+
+    if (code == clear) {
+      size = min + 1;
+      next = clear + 2;
+      prev = -1;
+      continue;
+    }
+    if (code == eoi)
+      return;
+    if (prev < 0) {
+      if (code >= clear)
+        return;
+      out[o++] = (unsigned char)code;
+      prev     = code;
+      continue;
+    }
+    if (code > next)
+      return;
+
+    int sp = 0, c = code;
+    if (code == next) {
+      stack[sp++] = first[prev];
+      c           = prev;
+    }
+    while (c >= clear) {
+      stack[sp++] = suffix[c];
+      c           = prefix[c];
+    }
+    stack[sp++] = (uint8_t)c;
+    while (sp && o < outn)
+      out[o++] = stack[--sp];
+
+    if (next < 4096) {
+      prefix[next] = (uint16_t)prev;
+      suffix[next] = (uint8_t)c;
+      first[next]  = first[prev];
+      next++;
+      if (next == (1 << size) && size < 12)
+        size++;
+    }
+    prev = code;
+  }
+}
+
+static int
+decode_gif(const unsigned char* d, size_t n, Pixmap* pm)
+{
+  if (n < 13)
+    return ENGINE_ERROR;
+  int sw = rd_le16(d + 6), sh = rd_le16(d + 8), flags = d[10];
+  size_t p = 13;
+  const unsigned char* gct = NULL;
+  int gct_n = 0, transparent = -1;
+  if (flags & 0x80) {
+    gct_n = 2 << (flags & 7);
+    gct   = d + p;
+    p += 3 * (size_t)gct_n;
+    if (p > n)
+      return ENGINE_ERROR;
+  }
+
+  while (p < n) {
+    int b = d[p++];
+    if (b == 0x3B)
+      break;
+    if (b == 0x21) {
+      if (p >= n)
+        break;
+      int label = d[p++];
+      while (p < n) {
+        int sz = d[p++];
+        if (!sz)
+          break;
+        if (label == 0xF9 && sz >= 4 && p + 4 <= n && (d[p] & 1))
+          transparent = d[p + 3];
+        p += sz;
+      }
+      continue;
+    }
+    if (b != 0x2C || p + 9 > n)
+      return ENGINE_ERROR;
+
+    int fx = rd_le16(d + p), fy = rd_le16(d + p + 2);
+    int fw = rd_le16(d + p + 4), fh = rd_le16(d + p + 6), fflags = d[p + 8];
+    p += 9;
+    const unsigned char* ct = gct;
+    int ct_n                = gct_n;
+    if (fflags & 0x80) {
+      ct_n = 2 << (fflags & 7);
+      ct   = d + p;
+      p += 3 * (size_t)ct_n;
+    }
+    if (!ct || p >= n || fw == 0 || fh == 0)
+      return ENGINE_ERROR;
+    int min = d[p++];
+    if (min < 1 || min > 11)
+      return ENGINE_ERROR;
+
+    Buf lzw = {0};
+    while (p < n) {
+      size_t sz = d[p++];
+      if (!sz)
+        break;
+      if (sz > n - p)
+        sz = n - p;
+      if (buf_put(&lzw, d + p, sz) != 0) {
+        free(lzw.data);
+        return ENGINE_ERROR;
+      }
+      p += sz;
+    }
+
+    if (sw == 0 || sh == 0) {
+      sw = fx + fw;
+      sh = fy + fh;
+    }
+    unsigned char* idx = malloc((size_t)fw * fh);
+    int rc             = idx ? pixmap_alloc(pm, sw, sh) : ENGINE_ERROR;
+    if (rc != ENGINE_OK) {
+      free(idx);
+      free(lzw.data);
+      return rc;
+    }
+    memset(pm->px, 0, (size_t)sw * sh * 4);
+    memset(idx, transparent >= 0 ? transparent : 0, (size_t)fw * fh);
+    gif_lzw(lzw.data, lzw.len, min, idx, (size_t)fw * fh);
+    free(lzw.data);
+
+    /* Interlaced frames store rows 0,8,16.. then 4,12.. then 2,6.. then 1,3.. */
+    int row = 0, pass = 0;
+    static const int istart[4] = {0, 4, 2, 1}, istep[4] = {8, 8, 4, 2};
+    for (int r = 0; r < fh; r++) {
+      int y;
+      if (fflags & 0x40) {
+        while (row >= fh && pass < 3)
+          row = istart[++pass];
+        y = row;
+        row += istep[pass];
+      } else {
+        y = r;
+      }
+      if (y >= fh || fy + y >= sh)
+        continue;
+      for (int x = 0; x < fw && fx + x < sw; x++) {
+        int ci = idx[(size_t)r * fw + x];
+        if (ci == transparent || ci >= ct_n)
+          continue;
+        unsigned char* out = pm->px + ((size_t)(fy + y) * sw + fx + x) * 4;
+        out[0]             = ct[ci * 3];
+        out[1]             = ct[ci * 3 + 1];
+        out[2]             = ct[ci * 3 + 2];
+        out[3]             = 255;
+      }
+    }
+    free(idx);
+    return ENGINE_OK;
+  }
+  return ENGINE_ERROR;
+}
+
+
+/* ---- BMP, PNM, QOI ---- */
+
+static void
+bmp_mask(uint32_t m, int* shift, int* bits)
+{
+  *shift = *bits = 0;
+  if (!m)
+    return;
+  while (!(m & 1)) {
+    m >>= 1;
+    (*shift)++;
+  }
+  while (m & 1) {
+    m >>= 1;
+    (*bits)++;
+  }
+}
+
+static unsigned char
+bmp_channel(uint32_t v, int shift, int bits)
+{
+  if (!bits)
+    return 0;
+  uint32_t c = (v >> shift) & ((1u << bits) - 1);
+  return (unsigned char)(bits >= 8 ? c >> (bits - 8) : c * 255 / ((1u << bits) - 1));
+}
+
+static int
+decode_bmp(const unsigned char* d, size_t n, Pixmap* pm)
+{
+  if (n < 26)
+    return ENGINE_ERROR;
+  uint32_t off = rd_le32(d + 10), hsz = rd_le32(d + 14);
+  int32_t w, h;
+  int bpp, comp = 0;
+  uint32_t ncolors = 0, mask[4] = {0, 0, 0, 0};
+
+  if (hsz == 12) {
+    w   = (int16_t)rd_le16(d + 18);
+    h   = (int16_t)rd_le16(d + 20);
+    bpp = rd_le16(d + 24);
+  } else {
+    if (n < 54)
+      return ENGINE_ERROR;
+    w       = (int32_t)rd_le32(d + 18);
+    h       = (int32_t)rd_le32(d + 22);
+    bpp     = rd_le16(d + 28);
+    comp    = rd_le32(d + 30);
+    ncolors = rd_le32(d + 46);
+    if ((comp == 3 || comp == 6) && n >= 66) {
+      mask[0] = rd_le32(d + 54);
+      mask[1] = rd_le32(d + 58);
+      mask[2] = rd_le32(d + 62);
+      if ((comp == 6 || hsz >= 56) && n >= 70)
+        mask[3] = rd_le32(d + 66);
+    }
+  }
+  if (comp != 0 && comp != 3 && comp != 6)
+    return ENGINE_UNSUPPORTED; /* RLE, embedded JPEG/PNG */
+  if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)
+    return ENGINE_UNSUPPORTED;
+
+  int topdown = h < 0;
+  if (topdown)
+    h = -h;
+  if (w <= 0 || h <= 0)
+    return ENGINE_ERROR;
+  if (comp == 0 && bpp == 16) {
+    mask[0] = 0x7C00;
+    mask[1] = 0x03E0;
+    mask[2] = 0x001F;
+  } else if (comp == 0 && bpp == 32) {
+    mask[0] = 0xFF0000;
+    mask[1] = 0x00FF00;
+    mask[2] = 0x0000FF;
+  }
+
+  /* The header has to fit, and the pixels start past it. */
+  if (14 + (uint64_t)hsz > n || off < 14 + (uint64_t)hsz)
+    return ENGINE_ERROR;
+  const unsigned char* pal = d + 14 + hsz;
+  int pal_entry            = hsz == 12 ? 3 : 4;
+  uint32_t pal_n           = 0;
+  if (bpp <= 8) {
+    pal_n = ncolors && ncolors < (1u << bpp) ? ncolors : 1u << bpp;
+    if (14 + hsz + (uint64_t)pal_n * pal_entry > n)
+      pal_n = (n - 14 - hsz) / pal_entry;
+  }
+
+  size_t stride = (((size_t)w * bpp + 31) / 32) * 4;
+  if (off > n || stride * (size_t)h > n - off)
+    return ENGINE_ERROR;
+
+  int rc = pixmap_alloc(pm, w, h);
+  if (rc != ENGINE_OK)
+    return rc;
+
+  int sh[4], bits[4];
+  for (int i = 0; i < 4; i++)
+    bmp_mask(mask[i], &sh[i], &bits[i]);
+
+  int any_alpha = 0;
+  for (int y = 0; y < h; y++) {
+    const unsigned char* src = d + off + (size_t)(topdown ? y : h - 1 - y) * stride;
+    unsigned char* out       = pm->px + (size_t)y * w * 4;
+    for (int x = 0; x < w; x++, out += 4) {
+      out[3] = 255;
+      if (bpp <= 8) {
+        uint32_t i = (src[(size_t)x * bpp / 8] >> (8 - bpp - (x * bpp) % 8)) & ((1u << bpp) - 1);
+        if (i < pal_n) {
+          out[0] = pal[i * pal_entry + 2];
+          out[1] = pal[i * pal_entry + 1];
+          out[2] = pal[i * pal_entry];
+        } else {
+          out[0] = out[1] = out[2] = 0;
+        }
+      } else if (bpp == 24) {
+        out[0] = src[x * 3 + 2];
+        out[1] = src[x * 3 + 1];
+        out[2] = src[x * 3];
+      } else {
+        uint32_t v = bpp == 16 ? rd_le16(src + x * 2) : rd_le32(src + x * 4);
+        out[0]     = bmp_channel(v, sh[0], bits[0]);
+        out[1]     = bmp_channel(v, sh[1], bits[1]);
+        out[2]     = bmp_channel(v, sh[2], bits[2]);
+        if (bits[3]) {
+          out[3] = bmp_channel(v, sh[3], bits[3]);
+          any_alpha |= out[3];
+        }
+      }
+    }
+  }
+
+  /* Plenty of writers leave the alpha mask set and the channel zeroed. */
+  if (bits[3] && !any_alpha)
+    for (size_t i = 0; i < (size_t)w * h; i++)
+      pm->px[i * 4 + 3] = 255;
+  return ENGINE_OK;
+}
+
+static int
+pnm_number(const unsigned char* d, size_t n, size_t* p, unsigned* v)
+{
+  for (;;) {
+    while (*p < n && isspace(d[*p]))
+      (*p)++;
+    if (*p < n && d[*p] == '#') {
+      while (*p < n && d[*p] != '\n')
+        (*p)++;
+      continue;
+    }
+    break;
+  }
+  if (*p >= n || !isdigit(d[*p]))
+    return -1;
+  uint64_t x = 0;
+  while (*p < n && isdigit(d[*p]) && x < 0x10000000)
+    x = x * 10 + (d[(*p)++] - '0');
+  *v = (unsigned)x;
+  return 0;
+}
+
+static int
+decode_pnm(const unsigned char* d, size_t n, Pixmap* pm)
+{
+  int type = d[1];
+  if (type != '5' && type != '6')
+    return ENGINE_UNSUPPORTED; /* ASCII and bitmap variants */
+
+  size_t p = 2;
+  unsigned w, h, maxv;
+  if (pnm_number(d, n, &p, &w) || pnm_number(d, n, &p, &h) || pnm_number(d, n, &p, &maxv))
+    return ENGINE_ERROR;
+  if (maxv == 0 || maxv > 65535 || p >= n)
+    return ENGINE_ERROR;
+  p++; /* single whitespace before the raster */
+
+  int ch = type == '6' ? 3 : 1, bps = maxv > 255 ? 2 : 1;
+  int rc = pixmap_alloc(pm, (int)w, (int)h);
+  if (rc != ENGINE_OK)
+    return w && h ? rc : ENGINE_ERROR;
+  if ((uint64_t)w * h * ch * bps > n - p) {
+    pixmap_free(pm);
+    return ENGINE_ERROR;
+  }
+
+  const unsigned char* src = d + p;
+  unsigned char* out       = pm->px;
+  for (size_t i = 0; i < (size_t)w * h; i++, out += 4) {
+    for (int c = 0; c < 3; c++) {
+      const unsigned char* s = src + (ch == 3 ? c : 0) * bps;
+      unsigned v             = bps == 2 ? rd_be16(s) : s[0];
+      out[c]                 = (unsigned char)(v * 255 / maxv);
+    }
+    out[3] = 255;
+    src += ch * bps;
+  }
+  return ENGINE_OK;
+}
+
+static int
+decode_qoi(const unsigned char* d, size_t n, Pixmap* pm)
+{
+  if (n < 14 + 8)
+    return ENGINE_ERROR;
+  uint32_t w = rd_be32(d + 4), h = rd_be32(d + 8);
+  if (w == 0 || h == 0 || w > 0x7FFFFFFF || h > 0x7FFFFFFF)
+    return ENGINE_ERROR;
+  int rc = pixmap_alloc(pm, (int)w, (int)h);
+  if (rc != ENGINE_OK)
+    return rc;
+
+  unsigned char index[64 * 4], px[4] = {0, 0, 0, 255};
+  memset(index, 0, sizeof(index));
+  size_t p = 14, end = n - 8, total = (size_t)w * h;
+  int run = 0;
+  for (size_t i = 0; i < total; i++) {
+    if (run > 0) {
+      run--;
+    } else if (p < end) {
+      int b = d[p++];
+      if (b == 0xFE && p + 3 <= end) {
+        memcpy(px, d + p, 3);
+        p += 3;
+      } else if (b == 0xFF && p + 4 <= end) {
+        memcpy(px, d + p, 4);
+        p += 4;
+      } else if ((b >> 6) == 0) {
+        memcpy(px, index + b * 4, 4);
+      } else if ((b >> 6) == 1) {
+        px[0] += ((b >> 4) & 3) - 2;
+        px[1] += ((b >> 2) & 3) - 2;
+        px[2] += (b & 3) - 2;
+      } else if ((b >> 6) == 2 && p < end) {
+        int dg = (b & 0x3F) - 32, b2 = d[p++];
+        px[0] += dg - 8 + ((b2 >> 4) & 15);
+        px[1] += dg;
+        px[2] += dg - 8 + (b2 & 15);
+      } else {
+        run = b & 0x3F;
+      }
+      memcpy(index + ((px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64) * 4, px, 4);
+    }
+    memcpy(pm->px + i * 4, px, 4);
+  }
+  return ENGINE_OK;
+}
+
+
+/* ---- resize and orientation ---- */
+
+static int
+ifloor(float v)
+{
+  int i = (int)v;
+  return (float)i > v ? i - 1 : i;
+}
+
+// Catmull-Rom: sharp like Lanczos, but a polynomial so we need no libm.
+static float
+cubic_weight(float x)
+{
+  if (x < 0)
+    x = -x;
+  if (x < 1)
+    return 1.5f * x * x * x - 2.5f * x * x + 1;
+  if (x < 2)
+    return -0.5f * x * x * x + 2.5f * x * x - 4 * x + 2;
+  return 0;
+}
+
+typedef struct {
+  int ntaps;
+  int* first;  /* [out] first input index */
+  float* w;    /* [out * ntaps] normalized weights */
+} Taps;
+
+static int
+taps_build(Taps* t, int in, int out)
+{
+  float scale   = (float)in / out;
+  float stretch = scale > 1 ? scale : 1;
+  float support = 2 * stretch;
+  t->ntaps      = (int)(2 * support) + 2;
+  t->first      = malloc(sizeof(int) * out);
+  t->w          = calloc((size_t)out * t->ntaps, sizeof(float));
+  if (!t->first || !t->w)
+    return -1;
+
+  for (int o = 0; o < out; o++) {
+    float center = (o + 0.5f) * scale - 0.5f;
+    int lo       = ifloor(center - support) + 1;
+    float* w     = t->w + (size_t)o * t->ntaps;
+    float sum    = 0;
+    for (int k = 0; k < t->ntaps; k++) {
+      w[k] = cubic_weight((lo + k - center) / stretch);
+      sum += w[k];
+    }
+    for (int k = 0; k < t->ntaps; k++)
+      w[k] /= sum;
+    t->first[o] = lo;
+  }
+  return 0;
+}
+
+static void
+taps_free(Taps* t)
+{
+  free(t->first);
+  free(t->w);
+}
+
+// Average f x f blocks; cheap first step for very large reductions.
+static int
+pixmap_box_shrink(Pixmap* pm, int f)
+{
+  int w = pm->w / f, h = pm->h / f;
+  unsigned char* px = malloc((size_t)w * h * 4);
+  uint32_t* acc     = malloc(sizeof(uint32_t) * w * 4);
+  if (!px || !acc) {
+    free(px);
+    free(acc);
+    return ENGINE_ERROR;
+  }
+  for (int y = 0; y < h; y++) {
+    memset(acc, 0, sizeof(uint32_t) * w * 4);
+    for (int yy = 0; yy < f; yy++) {
+      const unsigned char* src = pm->px + (size_t)(y * f + yy) * pm->w * 4;
+      for (int x = 0; x < w; x++)
+        for (int xx = 0; xx < f; xx++, src += 4) {
+          acc[x * 4]     += src[0];
+          acc[x * 4 + 1] += src[1];
+          acc[x * 4 + 2] += src[2];
+          acc[x * 4 + 3] += src[3];
+        }
+    }
+    unsigned div = (unsigned)f * f;
+    for (int i = 0; i < w * 4; i++)
+      px[(size_t)y * w * 4 + i] = (unsigned char)((acc[i] + div / 2) / div);
+  }
+  free(acc);
+  free(pm->px);
+  pm->px = px;
+  pm->w  = w;
+  pm->h  = h;
+  return ENGINE_OK;
+}
+
+static int
+pixmap_resize(Pixmap* pm, int ow, int oh)
+{
+  if (pm->w == ow && pm->h == oh)
+    return ENGINE_OK;
+
+  /* Bring huge reductions down to roughly 3x with a box filter first. */
+  int f = pm->w / ow < pm->h / oh ? pm->w / ow : pm->h / oh;
+  if (f >= 6 && pixmap_box_shrink(pm, f / 3) != ENGINE_OK)
+    return ENGINE_ERROR;
+
+  int alpha = 0;
+  for (size_t i = 0; i < (size_t)pm->w * pm->h && !alpha; i++)
+    alpha = pm->px[i * 4 + 3] != 255;
+
+  Taps tx = {0}, ty = {0};
+  float* tmp        = malloc(sizeof(float) * 4 * (size_t)ow * pm->h);
+  unsigned char* px = malloc((size_t)ow * oh * 4);
+  if (!tmp || !px || taps_build(&tx, pm->w, ow) != 0 || taps_build(&ty, pm->h, oh) != 0) {
+    free(tmp);
+    free(px);
+    taps_free(&tx);
+    taps_free(&ty);
+    return ENGINE_ERROR;
+  }
+
+  /* Horizontal pass, premultiplying alpha so edges do not bleed colour. */
+  for (int y = 0; y < pm->h; y++) {
+    const unsigned char* src = pm->px + (size_t)y * pm->w * 4;
+    float* dst               = tmp + (size_t)y * ow * 4;
+    for (int x = 0; x < ow; x++, dst += 4) {
+      const float* w = tx.w + (size_t)x * tx.ntaps;
+      float r = 0, g = 0, b = 0, a = 0;
+      for (int k = 0; k < tx.ntaps; k++) {
+        int i = tx.first[x] + k;
+        i     = i < 0 ? 0 : i >= pm->w ? pm->w - 1 : i;
+        const unsigned char* s = src + i * 4;
+        float wa               = alpha ? w[k] * s[3] * (1.0f / 255) : w[k];
+        r += wa * s[0];
+        g += wa * s[1];
+        b += wa * s[2];
+        a += w[k] * s[3];
+      }
+      dst[0] = r;
+      dst[1] = g;
+      dst[2] = b;
+      dst[3] = a;
+    }
+  }
+
+  for (int y = 0; y < oh; y++) {
+    const float* w     = ty.w + (size_t)y * ty.ntaps;
+    unsigned char* out = px + (size_t)y * ow * 4;
+    for (int x = 0; x < ow; x++, out += 4) {
+      float r = 0, g = 0, b = 0, a = 0;
+      for (int k = 0; k < ty.ntaps; k++) {
+        int i = ty.first[y] + k;
+        i     = i < 0 ? 0 : i >= pm->h ? pm->h - 1 : i;
+        const float* s = tmp + ((size_t)i * ow + x) * 4;
+        r += w[k] * s[0];
+        g += w[k] * s[1];
+        b += w[k] * s[2];
+        a += w[k] * s[3];
+      }
+      if (alpha) {
+        float inv = a > 0.5f ? 255.0f / a : 0;
+        r *= inv;
+        g *= inv;
+        b *= inv;
+      }
+      out[0] = clamp_u8((int)(r + 0.5f));
+      out[1] = clamp_u8((int)(g + 0.5f));
+      out[2] = clamp_u8((int)(b + 0.5f));
+      out[3] = clamp_u8((int)(a + 0.5f));
+    }
+  }
+
+  free(tmp);
+  taps_free(&tx);
+  taps_free(&ty);
+  free(pm->px);
+  pm->px = px;
+  pm->w  = ow;
+  pm->h  = oh;
+  return ENGINE_OK;
+}
+
+// Apply the EXIF orientation so the pixels are upright (magick -auto-orient).
+static int
+pixmap_orient(Pixmap* pm)
+{
+  int o = pm->orient;
+  if (o <= 1 || o > 8)
+    return ENGINE_OK;
+  int w = pm->w, h = pm->h;
+  int ow = o >= 5 ? h : w, oh = o >= 5 ? w : h;
+  unsigned char* px = malloc((size_t)w * h * 4);
+  if (!px)
+    return ENGINE_ERROR;
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int dx, dy;
+      switch (o) {
+      case 2:  dx = w - 1 - x; dy = y; break;
+      case 3:  dx = w - 1 - x; dy = h - 1 - y; break;
+      case 4:  dx = x; dy = h - 1 - y; break;
+      case 5:  dx = y; dy = x; break;
+      case 6:  dx = h - 1 - y; dy = x; break;
+      case 7:  dx = h - 1 - y; dy = w - 1 - x; break;
+      default: dx = y; dy = w - 1 - x; break;
+      }
+      memcpy(px + ((size_t)dy * ow + dx) * 4, pm->px + ((size_t)y * w + x) * 4, 4);
+    }
+  }
+  free(pm->px);
+  pm->px     = px;
+  pm->w      = ow;
+  pm->h      = oh;
+  pm->orient = 1;
+  return ENGINE_OK;
+}
+
+
+/* ---- PNG encoder (fixed-Huffman deflate) ---- */
+
+static uint32_t crc_table[256];
+static uint16_t deflate_fixed_code[288]; /* bit-reversed, ready for an LSB-first stream */
+static uint8_t deflate_len_code[259];
+
+typedef struct {
+  Buf* out;
+  uint64_t bits;
+  int n;
+} BitWriter;
+
+static void
+bw_put(BitWriter* w, uint32_t v, int nb)
+{
+  w->bits |= (uint64_t)v << w->n;
+  w->n += nb;
+  while (w->n >= 8) {
+    w->out->data[w->out->len++] = (unsigned char)w->bits;
+    w->bits >>= 8;
+    w->n -= 8;
+  }
+}
+
+static void
+bw_sym(BitWriter* w, int sym)
+{
+  int len = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+  bw_put(w, deflate_fixed_code[sym], len);
+}
+
+static uint32_t
+bitrev(uint32_t v, int n)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++)
+    r |= ((v >> i) & 1) << (n - 1 - i);
+  return r;
+}
+
+static uint32_t
+crc32_update(uint32_t c, const unsigned char* p, size_t n)
+{
+  c = ~c;
+  for (size_t i = 0; i < n; i++)
+    c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+  return ~c;
+}
+
+static uint32_t
+adler32(const unsigned char* p, size_t n)
+{
+  uint32_t a = 1, b = 0;
+  while (n) {
+    size_t k = n < 5552 ? n : 5552;
+    n -= k;
+    while (k--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+#define LZ_HASH_BITS 15
+#define LZ_CHAIN     16
+
+// One fixed-Huffman block with hash-chain LZ77; plenty for small thumbnails.
+static int
+deflate_fixed(const unsigned char* in, size_t n, Buf* out)
+{
+  /* A 3-byte match can cost 31 bits, so a byte may take up to 11 bits. */
+  if (buf_reserve(out, n + n / 2 + 64) != 0)
+    return -1;
+  int32_t* head = malloc(sizeof(int32_t) << LZ_HASH_BITS);
+  int32_t* prev = malloc(sizeof(int32_t) * (n ? n : 1));
+  if (!head || !prev) {
+    free(head);
+    free(prev);
+    return -1;
+  }
+  memset(head, 0xFF, sizeof(int32_t) << LZ_HASH_BITS);
+
+  BitWriter w = {out, 0, 0};
+  bw_put(&w, 1, 1); /* BFINAL */
+  bw_put(&w, 1, 2); /* fixed Huffman */
+
+  size_t i = 0;
+  while (i < n) {
+    size_t best_len = 0, best_dist = 0;
+    if (i + 3 <= n) {
+      uint32_t h   = ((in[i] << 16 | in[i + 1] << 8 | in[i + 2]) * 2654435761u) >> (32 - LZ_HASH_BITS);
+      int32_t cand = head[h];
+      size_t max   = n - i < 258 ? n - i : 258;
+      for (int chain = LZ_CHAIN; cand >= 0 && i - cand <= 32768 && chain--; cand = prev[cand]) {
+        size_t l = 0;
+        while (l < max && in[cand + l] == in[i + l])
+          l++;
+        if (l > best_len) {
+          best_len  = l;
+          best_dist = i - cand;
+          if (l == max)
+            break;
+        }
+      }
+    }
+
+    size_t step = best_len >= 3 ? best_len : 1;
+    for (size_t k = i; k < i + step && k + 3 <= n; k++) {
+      uint32_t h = ((in[k] << 16 | in[k + 1] << 8 | in[k + 2]) * 2654435761u) >> (32 - LZ_HASH_BITS);
+      prev[k]    = head[h];
+      head[h]    = (int32_t)k;
+    }
+
+    if (best_len >= 3) {
+      int lc = deflate_len_code[best_len];
+      bw_sym(&w, 257 + lc);
+      bw_put(&w, best_len - deflate_len_base[lc], deflate_len_extra[lc]);
+      int dc = 29;
+      while (deflate_dist_base[dc] > best_dist)
+        dc--;
+      bw_put(&w, bitrev(dc, 5), 5);
+      bw_put(&w, best_dist - deflate_dist_base[dc], deflate_dist_extra[dc]);
+    } else {
+      bw_sym(&w, in[i]);
+    }
+    i += step;
+  }
+  bw_sym(&w, 256);
+  if (w.n)
+    bw_put(&w, 0, 8 - w.n);
+
+  free(head);
+  free(prev);
+  return 0;
+}
+
+static int
+png_chunk(Buf* b, const char* type, const unsigned char* data, size_t n)
+{
+  unsigned char hdr[8], crc[4];
+  uint32_t c = crc32_update(0, (const unsigned char*)type, 4);
+  c          = crc32_update(c, data, n);
+  for (int i = 0; i < 4; i++) {
+    hdr[i]     = (unsigned char)(n >> (24 - 8 * i));
+    hdr[4 + i] = type[i];
+    crc[i]     = (unsigned char)(c >> (24 - 8 * i));
+  }
+  if (buf_put(b, hdr, 8) != 0 || buf_put(b, data, n) != 0 || buf_put(b, crc, 4) != 0)
+    return -1;
+  return 0;
+}
+
+static int
+png_encode(const Pixmap* pm, Buf* out)
+{
+  int alpha = 0;
+  for (size_t i = 0; i < (size_t)pm->w * pm->h && !alpha; i++)
+    alpha = pm->px[i * 4 + 3] != 255;
+  int ch        = alpha ? 4 : 3;
+  size_t stride = (size_t)pm->w * ch;
+  size_t rawlen = (stride + 1) * pm->h;
+
+  unsigned char* raw  = malloc(rawlen);
+  unsigned char* rows = malloc(stride * 7); /* five filter candidates, this row, last row */
+  Buf z               = {0};
+  int rc              = ENGINE_ERROR;
+  if (!raw || !rows)
+    goto done;
+
+  /* Try every filter per row and keep the smallest sum of absolute values. */
+  unsigned char* cur = rows + stride * 5;
+  unsigned char* prv = rows + stride * 6;
+  for (int y = 0; y < pm->h; y++) {
+    for (int x = 0; x < pm->w; x++)
+      memcpy(cur + (size_t)x * ch, pm->px + ((size_t)y * pm->w + x) * 4, ch);
+    uint64_t best_score = UINT64_MAX;
+    int best            = 0;
+    for (int f = 0; f < 5; f++) {
+      unsigned char* c = rows + stride * f;
+      uint64_t score   = 0;
+      for (size_t i = 0; i < stride; i++) {
+        int a = i >= (size_t)ch ? cur[i - ch] : 0;
+        int b = y ? prv[i] : 0;
+        int d = (y && i >= (size_t)ch) ? prv[i - ch] : 0;
+        int v;
+        switch (f) {
+        case 0: v = cur[i]; break;
+        case 1: v = cur[i] - a; break;
+        case 2: v = cur[i] - b; break;
+        case 3: v = cur[i] - ((a + b) >> 1); break;
+        default: {
+          int p  = a + b - d;
+          int pa = abs(p - a), pb = abs(p - b), pc = abs(p - d);
+          v      = cur[i] - ((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : d);
+        }
+        }
+        c[i] = (unsigned char)v;
+        score += (uint64_t)abs((signed char)c[i]);
+      }
+      if (score < best_score) {
+        best_score = score;
+        best       = f;
+      }
+    }
+    unsigned char* dst = raw + (size_t)y * (stride + 1);
+    dst[0]             = (unsigned char)best;
+    memcpy(dst + 1, rows + stride * best, stride);
+    memcpy(prv, cur, stride);
+  }
+
+  unsigned char zhdr[2] = {0x78, 0x01}, trailer[4], ihdr[13];
+  uint32_t ad           = adler32(raw, rawlen);
+  for (int i = 0; i < 4; i++) {
+    trailer[i]  = (unsigned char)(ad >> (24 - 8 * i));
+    ihdr[i]     = (unsigned char)((uint32_t)pm->w >> (24 - 8 * i));
+    ihdr[4 + i] = (unsigned char)((uint32_t)pm->h >> (24 - 8 * i));
+  }
+  ihdr[8]  = 8;
+  ihdr[9]  = alpha ? 6 : 2;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  if (buf_put(&z, zhdr, 2) != 0 || deflate_fixed(raw, rawlen, &z) != 0 ||
+      buf_put(&z, trailer, 4) != 0 || buf_put(out, "\x89PNG\r\n\x1a\n", 8) != 0 ||
+      png_chunk(out, "IHDR", ihdr, 13) != 0 || png_chunk(out, "IDAT", z.data, z.len) != 0 ||
+      png_chunk(out, "IEND", NULL, 0) != 0)
+    goto done;
+  rc = ENGINE_OK;
+
+done:
+  free(raw);
+  free(rows);
+  free(z.data);
+  return rc;
+}
+
+
+/* ---- header metadata ---- */
+
+//
+// Walk the JPEG markers in d[p..n) for the frame size, and the EXIF block
+// for orientation and capture time. Returns 0 once done, or the offset (past
+// what 'd' holds) to go on reading from: a camera's EXIF often carries a
+// preview large enough to push the frame header well beyond the head.
+//
+static size_t
+jpeg_meta(const unsigned char* d, size_t n, size_t p, ImageMeta* m)
+{
+  while (p + 4 <= n) {
+    int marker = d[p + 1];
+    if (d[p] != 0xFF)
+      return 0;
+    if (marker == 0xFF) {
+      p++; /* fill byte */
+      continue;
+    }
+    if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      p += 2;
+      continue;
+    }
+    if (marker == 0xDA || marker == 0xD9)
+      return 0;
+    size_t len = rd_be16(d + p + 2);
+    if (len < 2)
+      return 0;
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (p + 9 > n)
+        return p;
+      m->h = rd_be16(d + p + 5);
+      m->w = rd_be16(d + p + 7);
+      return 0;
+    }
+    if (marker == 0xE1 && len >= 8 && p + 10 <= n && memcmp(d + p + 4, "Exif\0\0", 6) == 0) {
+      size_t end = p + 2 + len < n ? p + 2 + len : n;
+      m->orient  = exif_orientation(d + p + 10, end - (p + 10));
+      m->taken   = exif_taken(d + p + 10, end - (p + 10));
+    }
+    p += 2 + len;
+  }
+  return p;
+}
+
+// The SHORT or LONG value of 'tag' in IFD0 of a TIFF, or 0.
+static uint32_t
+tiff_value(const unsigned char* t, size_t n, uint32_t tag)
+{
+  if (n < 8)
+    return 0;
+  int le       = t[0] == 'I';
+  uint32_t ifd = le ? rd_le32(t + 4) : rd_be32(t + 4);
+  size_t e     = tiff_entry(t, n, le, ifd, tag);
+  if (!e)
+    return 0;
+  uint32_t type = le ? rd_le16(t + e + 2) : rd_be16(t + e + 2);
+  if (type == 3)
+    return le ? rd_le16(t + e + 8) : rd_be16(t + e + 8);
+  return type == 4 ? (le ? rd_le32(t + e + 8) : rd_be32(t + e + 8)) : 0;
+}
+
+//
+// Fill 'm' from the first 'n' bytes of an image of format 'fmt': its size
+// from the JPEG frame header, PNG IHDR, GIF screen, BMP and WebP headers or
+// TIFF IFD0, and orientation and capture time from EXIF in JPEG, WebP and
+// the TIFF family. Nothing is decoded. Returns what jpeg_meta() does, 0 for
+// the other formats.
+//
+static size_t
+image_meta(const unsigned char* d, size_t n, ImageFormat fmt, ImageMeta* m)
+{
+  *m = (ImageMeta){INT64_MIN, 0, 0, 1, fmt};
+  switch (fmt) {
+  case FMT_JPEG:
+    return jpeg_meta(d, n, 2, m);
+  case FMT_PNG:
+    if (n >= 24 && memcmp(d + 12, "IHDR", 4) == 0) {
+      m->w = rd_be32(d + 16);
+      m->h = rd_be32(d + 20);
+    }
+    break;
+  case FMT_GIF:
+    if (n >= 10) {
+      m->w = rd_le16(d + 6);
+      m->h = rd_le16(d + 8);
+    }
+    break;
+  case FMT_BMP:
+    if (n >= 26 && rd_le32(d + 14) == 12) {
+      m->w = rd_le16(d + 18);
+      m->h = rd_le16(d + 20);
+    } else if (n >= 26) {
+      int32_t h = (int32_t)rd_le32(d + 22); /* negative for top-down rows */
+      m->w      = rd_le32(d + 18);
+      m->h      = h < 0 ? -(uint32_t)h : (uint32_t)h;
+    }
+    break;
+  case FMT_PNM: {
+    size_t p = 2;
+    unsigned w, h;
+    if (pnm_number(d, n, &p, &w) == 0 && pnm_number(d, n, &p, &h) == 0) {
+      m->w = w;
+      m->h = h;
+    }
+    break;
+  }
+  case FMT_QOI:
+    if (n >= 12) {
+      m->w = rd_be32(d + 4);
+      m->h = rd_be32(d + 8);
+    }
+    break;
+  case FMT_WEBP:
+    for (size_t off = 12; off + 8 <= n;) {
+      const unsigned char* c = d + off + 8;
+      size_t len = rd_le32(d + off + 4), have = n - off - 8 < len ? n - off - 8 : len;
+      if (memcmp(d + off, "VP8X", 4) == 0 && have >= 10) {
+        m->w = 1 + (c[4] | c[5] << 8 | (uint32_t)c[6] << 16);
+        m->h = 1 + (c[7] | c[8] << 8 | (uint32_t)c[9] << 16);
+      } else if (memcmp(d + off, "VP8 ", 4) == 0 && have >= 10 && !m->w) {
+        m->w = rd_le16(c + 6) & 0x3FFF;
+        m->h = rd_le16(c + 8) & 0x3FFF;
+      } else if (memcmp(d + off, "VP8L", 4) == 0 && have >= 5 && !m->w) {
+        uint32_t bits = rd_le32(c + 1);
+        m->w          = (bits & 0x3FFF) + 1;
+        m->h          = (bits >> 14 & 0x3FFF) + 1;
+      } else if (memcmp(d + off, "EXIF", 4) == 0) {
+        if (have >= 6 && memcmp(c, "Exif\0\0", 6) == 0) {
+          c += 6;
+          have -= 6;
+        }
+        m->orient = exif_orientation(c, have);
+        m->taken  = exif_taken(c, have);
+      }
+      if (len > n)
+        break;
+      off += 8 + len + (len & 1);
+    }
+    break;
+  case FMT_TIFF:
+    m->w = tiff_value(d, n, 0x0100);
+    m->h = tiff_value(d, n, 0x0101);
+    /* fall through */
+  case FMT_RAW:
+    m->orient = exif_orientation(d, n);
+    m->taken  = exif_taken(d, n);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+
+/* ---- pipeline ---- */
+
+// Build the lookup tables. Must run once before any other engine call.
+static void
+engine_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+
+  uint8_t lens[288];
+  for (int i = 0; i < 288; i++)
+    lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  inf_huff_build(&inf_fixed_lit, lens, 288);
+  for (int i = 0; i < 30; i++)
+    lens[i] = 5;
+  inf_huff_build(&inf_fixed_dist, lens, 30);
+
+  for (int s = 0; s < 288; s++) {
+    if (s < 144)
+      deflate_fixed_code[s] = bitrev(0x30 + s, 8);
+    else if (s < 256)
+      deflate_fixed_code[s] = bitrev(0x190 + s - 144, 9);
+    else if (s < 280)
+      deflate_fixed_code[s] = bitrev(s - 256, 7);
+    else
+      deflate_fixed_code[s] = bitrev(0xC0 + s - 280, 8);
+  }
+  for (int c = 0; c < 29; c++)
+    for (int l = deflate_len_base[c]; l < deflate_len_base[c] + (1 << deflate_len_extra[c]) && l <= 258; l++)
+      deflate_len_code[l] = c;
+
+  /* cos(k * pi / 16) for k = 0..8; everything the scaled IDCTs need. */
+  static const float cos16[9] = {1.0f,         0.98078528f, 0.92387953f, 0.83146961f, 0.70710678f,
+                                 0.55557023f, 0.38268343f, 0.19509032f, 0.0f};
+  for (int level = 0; level < 4; level++) {
+    int n = 8 >> level;
+    for (int x = 0; x < n; x++) {
+      for (int u = 0; u < n; u++) {
+        int m     = ((2 * x + 1) * u * (8 / n)) % 32;
+        int sign  = 1;
+        if (m > 16)
+          m = 32 - m;
+        if (m > 8) {
+          m    = 16 - m;
+          sign = -1;
+        }
+        float cu                     = u == 0 ? 0.70710678f : 1.0f;
+        jpeg_idct_tab[level][x * 8 + u] = sign * cu * 0.5f * cos16[m];
+      }
+    }
+  }
+}
+
+//
+// Decode an in-memory image, fit it inside max_w x max_h with the EXIF
+// orientation applied, and append the result to 'out' as a PNG.
+//
+static int
+engine_render_mem(const unsigned char* d, size_t n, int max_w, int max_h, Buf* out)
+{
+  Pixmap pm = {0};
+  int rc;
+  switch (sniff_format(d, n)) {
+  case FMT_JPEG: rc = decode_jpeg(d, n, max_w, max_h, &pm); break;
+  case FMT_PNG:  rc = decode_png(d, n, &pm); break;
+  case FMT_GIF:  rc = decode_gif(d, n, &pm); break;
+  case FMT_BMP:  rc = decode_bmp(d, n, &pm); break;
+  case FMT_PNM:  rc = decode_pnm(d, n, &pm); break;
+  case FMT_QOI:  rc = decode_qoi(d, n, &pm); break;
+  default:       return ENGINE_UNSUPPORTED;
+  }
+  if (rc != ENGINE_OK)
+    return rc;
+
+  /* Fit the upright image, but resize before rotating: fewer pixels to move. */
+  int tw, th;
+  if (pm.orient >= 5)
+    fit_box(pm.h, pm.w, max_w, max_h, &th, &tw);
+  else
+    fit_box(pm.w, pm.h, max_w, max_h, &tw, &th);
+
+  if ((rc = pixmap_resize(&pm, tw, th)) == ENGINE_OK && (rc = pixmap_orient(&pm)) == ENGINE_OK)
+    rc = png_encode(&pm, out);
+  pixmap_free(&pm);
+  return rc;
+}
+
+// Append what is left of 'fd', 'size' bytes by its last fstat(), to 'out'.
+static int
+read_fd(int fd, off_t size, Buf* out)
+{
+  if (buf_reserve(out, size) != 0)
+    return -1;
+  for (;;) {
+    if (buf_reserve(out, 4096) != 0)
+      return -1;
+    ssize_t r = read(fd, out->data + out->len, out->cap - out->len);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return r == 0 ? 0 : -1;
+    out->len += r;
+  }
+}
+
+static int
+read_file(const char* path, Buf* out)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  int rc = fstat(fd, &st) == 0 ? read_fd(fd, st.st_size, out) : -1;
+  close(fd);
+  return rc;
+}
+
+//
+// Render 'orig' into a PNG in 'out' no larger than max_w x max_h. The file
+// is read into memory rather than mapped, so one truncated while it is
+// decoded fails the render instead of raising SIGBUS.
+//
+static int
+engine_render_file(const char* orig, int max_w, int max_h, Buf* out)
+{
+  int fd = open(orig, O_RDONLY);
+  if (fd < 0)
+    return ENGINE_ERROR;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return ENGINE_ERROR;
+  }
+  if ((uint64_t)st.st_size > ENGINE_MAX_BYTES) {
+    close(fd);
+    return ENGINE_UNSUPPORTED;
+  }
+  Buf b  = {0};
+  int rc = read_fd(fd, st.st_size, &b) == 0 && b.len
+               ? engine_render_mem(b.data, b.len, max_w, max_h, out)
+               : ENGINE_ERROR;
+  close(fd);
+  free(b.data);
+  return rc;
+}
+
+
+//
+/* -------------------- IMAGE LOADING -------------------- */
+//
+
+/* Directory entries are read this many bytes at a time. */
+#define DIRENT_BUF (256 * 1024)
+
+/* Threads walking the tree with -r; more than cores, to overlap NFS round trips. */
+#define SCAN_WALKERS 16
+
+/* How often a scanner blocked on a -0 path list checks whether to stop. */
+#define LIST_POLL_MS 100
+
+/* Batched sniffing and stat-ing, see IoRing. */
+#define IO_DEPTH     256 /* operations in flight per io_uring_enter() */
+#define IO_THREADS   4   /* helpers per batch without io_uring */
+#define IO_MIN_SPLIT 64  /* files below which a helper thread does not pay */
+
+/* Header metadata, see read_image_head(). */
+#define META_HEAD 4096 /* bytes read at a time */
+#define META_HOPS 8    /* further reads to find a JPEG's frame header */
+
+typedef struct {
+  void (*fn)(void*, size_t, size_t);
+  void* ctx;
+  size_t begin, end;
+} IoPart;
+
+static void*
+io_part_run(void* arg)
+{
+  IoPart* part = arg;
+  part->fn(part->ctx, part->begin, part->end);
+  return NULL;
+}
+
+// Run fn(ctx, begin, end) over [0, n), split across up to IO_THREADS threads.
+static void
+io_parallel(size_t n, void (*fn)(void*, size_t, size_t), void* ctx)
+{
+  size_t nparts = n / IO_MIN_SPLIT < IO_THREADS ? n / IO_MIN_SPLIT : IO_THREADS;
+  if (nparts < 2) {
+    fn(ctx, 0, n);
+    return;
+  }
+
+  IoPart parts[IO_THREADS];
+  pthread_t threads[IO_THREADS];
+  int started[IO_THREADS];
+  for (size_t t = 0; t < nparts; t++) {
+    parts[t]   = (IoPart){fn, ctx, n * t / nparts, n * (t + 1) / nparts};
+    started[t] = t > 0 && pthread_create(&threads[t], NULL, io_part_run, &parts[t]) == 0;
+  }
+  for (size_t t = 0; t < nparts; t++)
+    if (!started[t])
+      io_part_run(&parts[t]);
+  for (size_t t = 1; t < nparts; t++)
+    if (started[t])
+      pthread_join(threads[t], NULL);
+}
+
+// Copy 'len' bytes of 's' plus a NUL into the arena.
+static const char*
+arena_strndup(ArenaBlock** arena, const char* s, size_t len)
+{
+  ArenaBlock* b = *arena;
+  if (!b || b->cap - b->used < len + 1) {
+    size_t cap = len + 1 > ARENA_BLOCK ? len + 1 : ARENA_BLOCK;
+    b          = malloc(sizeof(ArenaBlock) + cap);
+    if (!b)
+      return NULL;
+    b->next = *arena;
+    b->used = 0;
+    b->cap  = cap;
+    *arena  = b;
+  }
+  char* p = b->data + b->used;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  b->used += len + 1;
+  return p;
+}
+
+static size_t
+path_hash(const char* path)
+{
+  size_t h = 14695981039346656037ull;
+  for (; *path; path++)
+    h = (h ^ (unsigned char)*path) * 1099511628211ull;
+  return h;
+}
+
+// The slot in by_path holding 'path', or the empty slot where it would go.
+static size_t*
+path_slot(const ImageList* list, const char* path)
+{
+  size_t mask = list->by_path_cap - 1;
+  for (size_t h = path_hash(path) & mask;; h = (h + 1) & mask) {
+    size_t* s = &list->by_path[h];
+    if (!*s || strcmp(list->path[*s - 1], path) == 0)
+      return s;
+  }
+}
+
+// The shown entry for 'path', or NOT_SHOWN.
+static size_t
+list_find(const ImageList* list, const char* path)
+{
+  if (!list->by_path_cap)
+    return NOT_SHOWN;
+  size_t* s = path_slot(list, path);
+  return *s ? *s - 1 : NOT_SHOWN;
+}
+
+static void
+path_rehash(ImageList* list, size_t cap)
+{
+  free(list->by_path);
+  list->by_path     = calloc(cap, sizeof(*list->by_path));
+  list->by_path_cap = cap;
+  if (!list->by_path) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t p = 0; p < list->view_count; p++)
+    *path_slot(list, list->path[list->view[p]]) = list->view[p] + 1;
+}
+
+// Append an entry for 'path' and return its index. It is not shown yet.
+static size_t
+new_image_entry(ImageList* list, const char* path, uint32_t group)
+{
+  if (list->count == list->cap) {
+    size_t cap        = list->cap ? list->cap * 2 : 1024;
+    list->path        = realloc(list->path, sizeof(*list->path) * cap);
+    list->thumb_off   = realloc(list->thumb_off, sizeof(*list->thumb_off) * cap);
+    list->thumb_len   = realloc(list->thumb_len, sizeof(*list->thumb_len) * cap);
+    list->thumb_state = realloc(list->thumb_state, sizeof(*list->thumb_state) * cap);
+    list->gen         = realloc(list->gen, sizeof(*list->gen) * cap);
+    list->group       = realloc(list->group, sizeof(*list->group) * cap);
+    list->dev         = realloc(list->dev, sizeof(*list->dev) * cap);
+    list->ino         = realloc(list->ino, sizeof(*list->ino) * cap);
+    list->keys        = realloc(list->keys, sizeof(*list->keys) * cap);
+    list->asked       = realloc(list->asked, sizeof(*list->asked) * cap);
+    list->mtime       = realloc(list->mtime, sizeof(*list->mtime) * cap);
+    list->size        = realloc(list->size, sizeof(*list->size) * cap);
+    list->width       = realloc(list->width, sizeof(*list->width) * cap);
+    list->height      = realloc(list->height, sizeof(*list->height) * cap);
+    list->orient      = realloc(list->orient, sizeof(*list->orient) * cap);
+    list->format      = realloc(list->format, sizeof(*list->format) * cap);
+    list->taken       = realloc(list->taken, sizeof(*list->taken) * cap);
+    list->pos         = realloc(list->pos, sizeof(*list->pos) * cap);
+    list->view        = realloc(list->view, sizeof(*list->view) * cap);
+    if (!list->path || !list->thumb_off || !list->thumb_len || !list->thumb_state || !list->gen ||
+        !list->group || !list->dev || !list->ino || !list->keys || !list->asked || !list->mtime ||
+        !list->size ||
+        !list->width || !list->height || !list->orient || !list->format || !list->taken ||
+        !list->pos || !list->view) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    list->cap = cap;
+  }
+
+  size_t i      = list->count;
+  list->path[i] = arena_strndup(&list->names, path, strlen(path));
+  if (!list->path[i]) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  list->thumb_off[i]   = 0;
+  list->thumb_len[i]   = 0;
+  list->thumb_state[i] = THUMB_NONE;
+  list->gen[i]         = 0;
+  list->group[i]       = group;
+  list->dev[i]         = 0;
+  list->ino[i]         = 0;
+  list->keys[i]        = 0;
+  list->asked[i]       = 0;
+  list->mtime[i]       = 0;
+  list->size[i]        = 0;
+  list->width[i]       = 0;
+  list->height[i]      = 0;
+  list->orient[i]      = 1;
+  list->format[i]      = FMT_UNKNOWN;
+  list->taken[i]       = INT64_MIN;
+  list->pos[i]         = NOT_SHOWN;
+  list->count++;
+  return i;
+}
+
+//
+// Natural order: runs of digits compare by value, so "img9" sorts before
+// "img10". Each run is read as the byte '0', its length without leading
+// zeros, then those digits; other bytes stand for themselves. Names equal
+// that way ("a01", "a1") fall back to strcmp.
+//
+static int
+natural_cmp(const char* a, const char* b)
+{
+  const unsigned char *p = (const unsigned char*)a, *q = (const unsigned char*)b;
+  while (*p && *q) {
+    if (isdigit(*p) && isdigit(*q)) {
+      while (*p == '0')
+        p++;
+      while (*q == '0')
+        q++;
+      size_t m = 0, n = 0;
+      while (isdigit(p[m]))
+        m++;
+      while (isdigit(q[n]))
+        n++;
+      if (m != n)
+        return m < n ? -1 : 1;
+      int c = memcmp(p, q, m);
+      if (c)
+        return c;
+      p += m;
+      q += n;
+      continue;
+    }
+    int x = isdigit(*p) ? '0' : *p, y = isdigit(*q) ? '0' : *q;
+    if (x != y)
+      return x < y ? -1 : 1;
+    p++;
+    q++;
+  }
+  if (*p || *q)
+    return *p ? 1 : -1;
+  return strcmp(a, b);
+}
+
+//
+// The first 8 bytes of the natural_cmp() reading of 's' as a number, so that
+// a smaller key always means a smaller name. A run longer than 254 digits
+// ends the key, as its length byte cannot order it.
+//
+static uint64_t
+natural_key(const char* s)
+{
+  unsigned char k[8] = {0};
+  const unsigned char* p = (const unsigned char*)s;
+  size_t n = 0;
+  while (*p && n < 8) {
+    if (!isdigit(*p)) {
+      k[n++] = *p++;
+      continue;
+    }
+    while (*p == '0')
+      p++;
+    size_t len = 0;
+    while (isdigit(p[len]))
+      len++;
+    k[n++] = '0';
+    if (len > 254)
+      break;
+    if (n < 8)
+      k[n++] = (unsigned char)len;
+    for (; len && n < 8; len--)
+      k[n++] = *p++;
+    p += len;
+  }
+  uint64_t key = 0;
+  for (int i = 0; i < 8; i++)
+    key = key << 8 | k[i];
+  return key;
+}
+
+// The numeric key of entry i under the list's mode; signed times are biased to sort unsigned.
+static uint64_t
+sort_key(const ImageList* list, size_t i)
+{
+  switch (list->sort) {
+  case SORT_MTIME:
+    return (uint64_t)list->mtime[i] ^ (1ull << 63);
+  case SORT_SIZE:
+    return list->size[i];
+  case SORT_TAKEN: /* pictures without a date go by when they were last written */
+    return (uint64_t)(list->taken[i] != INT64_MIN ? list->taken[i] : list->mtime[i]) ^ (1ull << 63);
+  default:
+    return 0;
+  }
+}
+
+// The grid order of entries a and b: group, then the sort key, then natural name, then index.
+static int
+list_cmp(const ImageList* list, size_t a, size_t b)
+{
+  if (list->group[a] != list->group[b])
+    return list->group[a] < list->group[b] ? -1 : 1;
+  if (list->sort != SORT_SCAN) {
+    uint64_t x = sort_key(list, a), y = sort_key(list, b);
+    if (x != y)
+      return x < y ? -1 : 1;
+    int c = natural_cmp(list->path[a], list->path[b]);
+    if (c)
+      return c;
+  }
+  return a < b ? -1 : a > b;
+}
+
+static int
+list_qsort_cmp(const void* a, const void* b, void* list)
+{
+  return list_cmp(list, *(const size_t*)a, *(const size_t*)b);
+}
+
+// Go on with jpeg_meta() from offset 'off' of the image at 'base' in the file, until it is done.
+static void
+meta_follow(int fd, off_t base, size_t off, ImageMeta* m)
+{
+  unsigned char buf[META_HEAD];
+  for (int hop = 0; off && hop < META_HOPS; hop++) {
+    ssize_t n = pread(fd, buf, sizeof(buf), base + off);
+    if (n <= 0)
+      return;
+    size_t next = jpeg_meta(buf, n, 0, m);
+    off         = next ? off + next : 0;
+  }
+}
+
+//
+// Sniff 'name' in 'dirfd' and read what its header says. Returns its
+// format, FMT_UNKNOWN if it is not an image (and 'm' is left as is).
+//
+static ImageFormat
+read_image_head(int dirfd, const char* name, ImageMeta* m)
+{
+  unsigned char head[META_HEAD];
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return FMT_UNKNOWN;
+  ssize_t n       = read(fd, head, sizeof(head));
+  ImageFormat fmt = n > 0 ? sniff_format(head, n) : FMT_UNKNOWN;
+  if (fmt != FMT_UNKNOWN)
+    meta_follow(fd, 0, image_meta(head, n, fmt, m), m);
+  close(fd);
+  return fmt;
+}
+
+//
+// A zip (or cbz) or tar (or cbt) archive is browsed as a directory: its
+// images are named "<archive>/<member>" and decoded from the archive's own
+// bytes, with nothing ever extracted. Opening one takes an index of the
+// images in it: an ArcHeader, the ArcEntry records sorted by name, then the
+// names, each record saying where the member's bytes lie, how they are
+// stored and what its header says. A zip's comes from its central
+// directory; a tar has none, so its headers are walked once, one read per
+// member. The index is kept under $XDG_CACHE_HOME/iv/archives, named for
+// the archive's device and inode like a catalog, and holds while the
+// archive's size and mtime do, so opening a big tar again reads one small
+// file.
+//
+// An archive stays open while it is in use, and its members are read with
+// pread(), so one truncated under iv fails the read rather than killing it.
+// Each use checks the archive's size and mtime first. Once they change, and
+// the archive has then been left alone for ARCHIVE_SETTLE seconds, it is
+// opened and indexed again; the old one is closed when its last user lets
+// go of it, and until it settles the old index is used. A stored member is
+// read as it is, a deflated one inflated into memory. Zip's other methods,
+// encrypted members and compressed tars are not read.
+//
+
+#define ARCHIVE_DIR   "archives"
+#define ARCHIVE_MAGIC 0x32415649u /* "IVA2" */
+#define ARCHIVE_SNIFF (64 * 1024) /* deflated bytes read to inflate a member's head */
+#define ARCHIVE_SETTLE 2          /* seconds an archive must be unchanged to index again */
+
+typedef enum { ARCHIVE_NONE, ARCHIVE_ZIP, ARCHIVE_TAR } ArchiveKind;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;    /* ArcEntry records that follow */
+  uint64_t dev, ino; /* the archive's */
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t names_len; /* NUL-terminated names after the records */
+} ArcHeader;
+
+typedef struct {
+  uint64_t off;   /* of the member's bytes in the archive */
+  uint64_t csize; /* bytes there */
+  uint64_t size;  /* once inflated */
+  int64_t mtime;
+  int64_t taken; /* the image's ImageMeta */
+  uint32_t width, height;
+  uint32_t name;        /* offset into the names */
+  unsigned char method; /* 0 stored, 8 deflated */
+  unsigned char format; /* ImageFormat */
+  unsigned char orient;
+  unsigned char pad;
+} ArcEntry;
+
+typedef struct {
+  char* path;
+  size_t len;
+  struct stat st;
+  Buf index; /* ArcHeader, entries, names */
+  const ArcEntry* entries;
+  size_t count;
+  const char* names;
+  int fd;
+  int refs;    /* archive_get() calls not yet archive_put(); under archives.lock */
+  int retired; /* taken off the list for a newer index; freed with its last user */
+} Archive;
+
+// The archives open, in the order opened.
+static struct {
+  pthread_mutex_t lock;
+  Archive** list;
+  size_t count, cap;
+} archives = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t
+rd_le64(const unsigned char* p)
+{
+  return (uint64_t)rd_le32(p + 4) << 32 | rd_le32(p);
+}
+
+// Whether the first 'len' bytes of 'path' end in the name of an archive.
+static int
+archive_name(const char* path, size_t len)
+{
+  static const char* const ext[] = {".zip", ".cbz", ".tar", ".cbt"};
+  for (size_t k = 0; len > 4 && k < sizeof(ext) / sizeof(ext[0]); k++)
+    if (strncasecmp(path + len - 4, ext[k], 4) == 0)
+      return 1;
+  return 0;
+}
+
+// A tar header field: octal, or big-endian base 256 when the top bit is set.
+static uint64_t
+tar_number(const unsigned char* p, size_t n)
+{
+  uint64_t v = 0;
+  if (p[0] & 0x80) {
+    for (size_t k = 0; k < n; k++)
+      v = v << 8 | (k ? p[k] : p[k] & 0x7F);
+    return v;
+  }
+  size_t k = 0;
+  while (k < n && p[k] == ' ')
+    k++;
+  for (; k < n && p[k] >= '0' && p[k] <= '7'; k++)
+    v = v << 3 | (p[k] - '0');
+  return v;
+}
+
+// Whether 'h' is a tar header: its checksum counts its own field as spaces.
+static int
+tar_header_ok(const unsigned char* h)
+{
+  uint64_t sum = 8 * ' ';
+  for (int k = 0; k < 512; k++)
+    sum += k >= 148 && k < 156 ? 0 : h[k];
+  return tar_number(h + 148, 8) == sum;
+}
+
+// Identify an archive by its first bytes.
+static ArchiveKind
+archive_kind(const unsigned char* h, size_t n)
+{
+  if (n >= 4 && h[0] == 'P' && h[1] == 'K' && ((h[2] == 3 && h[3] == 4) || (h[2] == 5 && h[3] == 6)))
+    return ARCHIVE_ZIP;
+  if (n >= 512 && tar_header_ok(h))
+    return ARCHIVE_TAR;
+  return ARCHIVE_NONE;
+}
+
+// Whether the file at 'path' is an archive rather than an image.
+static int
+is_archive(const char* path)
+{
+  unsigned char head[512];
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, head, sizeof(head));
+  close(fd);
+  return n > 0 && sniff_format(head, n) == FMT_UNKNOWN && archive_kind(head, n) != ARCHIVE_NONE;
+}
+
+//
+// Tidy a member's name in place, dropping a leading "/" or "./". Returns
+// NULL for a directory, or for a file a directory listing would skip as
+// hidden, itself or one of its directories (which covers ".." and the "._"
+// files macOS adds).
+//
+static char*
+archive_member_name(char* name)
+{
+  while (name[0] == '/' || (name[0] == '.' && name[1] == '/'))
+    name += name[0] == '/' ? 1 : 2;
+  size_t len = strlen(name);
+  if (!len || name[len - 1] == '/')
+    return NULL;
+  for (const char* c = name; c; c = strchr(c, '/')) {
+    c += *c == '/';
+    if (*c == '.' || *c == '/')
+      return NULL;
+  }
+  return name;
+}
+
+// An index being built.
+typedef struct {
+  Buf entries, names;
+} ArcBuild;
+
+//
+// Add member 'name' of the archive on 'fd' to 'b' if head[0..n), the start
+// of its bytes, is an image, with what its header says. A stored JPEG's
+// frame header is looked for past the head as in read_image_head(); a
+// deflated one's only within it.
+//
+static int
+archive_add(ArcBuild* b, int fd, ArcEntry e, const char* name, const unsigned char* head, size_t n)
+{
+  ImageFormat fmt = n ? sniff_format(head, n) : FMT_UNKNOWN;
+  if (fmt == FMT_UNKNOWN)
+    return 0;
+  ImageMeta m = {INT64_MIN, 0, 0, 1, fmt};
+  size_t next = image_meta(head, n, fmt, &m);
+  if (e.method == 0 && next < e.size)
+    meta_follow(fd, e.off, next, &m);
+  e.format = (unsigned char)fmt;
+  e.taken  = m.taken;
+  e.width  = m.w;
+  e.height = m.h;
+  e.orient = (unsigned char)m.orient;
+  e.name   = (uint32_t)b->names.len;
+  if (buf_put(&b->entries, &e, sizeof(e)) != 0 || buf_put(&b->names, name, strlen(name) + 1) != 0)
+    return -1;
+  return 0;
+}
+
+// A zip member's local time, read as UTC like the EXIF date, so the index does not depend on TZ.
+static int64_t
+dos_time(unsigned date, unsigned time)
+{
+  struct tm tm = {.tm_year = (date >> 9) + 80,
+                  .tm_mon  = ((date >> 5) & 15) - 1,
+                  .tm_mday = date & 31,
+                  .tm_hour = time >> 11,
+                  .tm_min  = (time >> 5) & 63,
+                  .tm_sec  = (time & 31) * 2};
+  return timegm(&tm);
+}
+
+static int
+pread_full(int fd, void* buf, size_t n, uint64_t off)
+{
+  for (size_t got = 0; got < n;) {
+    ssize_t r = pread(fd, (char*)buf + got, n - got, off + got);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    got += r;
+  }
+  return 0;
+}
+
+//
+// Index the zip on 'fd' from its central directory, found through the end
+// of central directory record, or with zip64 the record that locator points
+// to. Each member's local header is read to find where its bytes start.
+//
+static int
+zip_index(int fd, uint64_t size, ArcBuild* b)
+{
+  size_t tail_len     = size < 22 + 0xFFFF ? size : 22 + 0xFFFF;
+  unsigned char* tail = malloc(tail_len);
+  unsigned char* cd   = NULL;
+  unsigned char* in   = malloc(ARCHIVE_SNIFF);
+  char* name          = malloc(0x10000);
+  int ret             = -1;
+  if (!tail || !in || !name || tail_len < 22 || pread_full(fd, tail, tail_len, size - tail_len) != 0)
+    goto out;
+
+  /* The end record is the last thing in the file but for a comment of up to 64K. */
+  ssize_t p = tail_len - 22;
+  while (p >= 0 && rd_le32(tail + p) != 0x06054b50)
+    p--;
+  if (p < 0)
+    goto out;
+  uint64_t count = rd_le16(tail + p + 10), cd_len = rd_le32(tail + p + 12);
+  uint64_t cd_off = rd_le32(tail + p + 16);
+  if ((count == 0xFFFF || cd_len == 0xFFFFFFFF || cd_off == 0xFFFFFFFF) && p >= 20 &&
+      rd_le32(tail + p - 20) == 0x07064b50) {
+    unsigned char z[56];
+    if (pread_full(fd, z, sizeof(z), rd_le64(tail + p - 12)) != 0 || rd_le32(z) != 0x06064b50)
+      goto out;
+    count  = rd_le64(z + 32);
+    cd_len = rd_le64(z + 40);
+    cd_off = rd_le64(z + 48);
+  }
+  if (cd_off > size || cd_len > size - cd_off || !(cd = malloc(cd_len ? cd_len : 1)) ||
+      pread_full(fd, cd, cd_len, cd_off) != 0)
+    goto out;
+
+  size_t q = 0;
+  for (uint64_t k = 0; k < count && q + 46 <= cd_len && rd_le32(cd + q) == 0x02014b50; k++) {
+    const unsigned char* c = cd + q;
+    unsigned flags = rd_le16(c + 8), method = rd_le16(c + 10);
+    size_t nlen = rd_le16(c + 28), xlen = rd_le16(c + 30), clen = rd_le16(c + 32);
+    if (46 + nlen + xlen + clen > cd_len - q)
+      break;
+    q += 46 + nlen + xlen + clen;
+    ArcEntry e     = {.csize = rd_le32(c + 20), .size = rd_le32(c + 24), .method = method};
+    uint64_t local = rd_le32(c + 42);
+    e.mtime        = dos_time(rd_le16(c + 14), rd_le16(c + 12));
+
+    /* Zip64 sizes and offset, and a Unix mtime, come in extra fields. */
+    for (const unsigned char *x = c + 46 + nlen, *end = x + xlen; end - x >= 4;) {
+      unsigned id = rd_le16(x), len = rd_le16(x + 2);
+      const unsigned char* d = x + 4;
+      if (len > end - d)
+        break;
+      x = d + len;
+      if (id == 0x0001) {
+        if (e.size == 0xFFFFFFFF && x - d >= 8)
+          e.size = rd_le64(d), d += 8;
+        if (e.csize == 0xFFFFFFFF && x - d >= 8)
+          e.csize = rd_le64(d), d += 8;
+        if (local == 0xFFFFFFFF && x - d >= 8)
+          local = rd_le64(d);
+      } else if (id == 0x5455 && len >= 5 && (d[0] & 1)) {
+        e.mtime = (int32_t)rd_le32(d + 1);
+      }
+    }
+
+    if ((flags & 1) || (method != 0 && method != 8) || memchr(c + 46, '\0', nlen))
+      continue;
+    memcpy(name, c + 46, nlen);
+    name[nlen]        = '\0';
+    const char* clean = archive_member_name(name);
+    if (!clean)
+      continue;
+
+    /* The bytes follow the local header, whose extra field need not be the central one's. */
+    unsigned char lh[30];
+    if (local > size || pread_full(fd, lh, sizeof(lh), local) != 0 || rd_le32(lh) != 0x04034b50)
+      continue;
+    e.off = local + 30 + rd_le16(lh + 26) + rd_le16(lh + 28);
+    if (e.off > size || e.csize > size - e.off || (method == 0 && e.size != e.csize))
+      continue;
+
+    unsigned char head[META_HEAD];
+    size_t n     = 0;
+    size_t first = e.size < sizeof(head) ? e.size : sizeof(head);
+    if (method == 0) {
+      n = pread_full(fd, head, first, e.off) == 0 ? first : 0;
+    } else {
+      size_t want = e.csize < ARCHIVE_SNIFF ? e.csize : ARCHIVE_SNIFF;
+      if (pread_full(fd, in, want, e.off) != 0 || inflate_raw(in, want, head, first, &n, 1) != 0)
+        n = 0;
+    }
+    if (archive_add(b, fd, e, clean, head, n) != 0)
+      goto out;
+  }
+  ret = 0;
+out:
+  free(tail);
+  free(cd);
+  free(in);
+  free(name);
+  return ret;
+}
+
+//
+// Index the tar on 'fd' by walking its headers, each read together with
+// the head of the member after it. Long names come from GNU 'L' records and
+// pax 'x' records, which may also give a size or an mtime. The walk ends at
+// the first block that is not a header, which includes the zero blocks
+// closing the archive.
+//
+static int
+tar_index(int fd, uint64_t size, ArcBuild* b)
+{
+  unsigned char* blk = malloc(512 + META_HEAD);
+  Buf longname       = {0}; /* from the record before, if any */
+  uint64_t pax_size  = UINT64_MAX;
+  int64_t pax_mtime  = INT64_MIN;
+  int ret            = -1;
+  if (!blk)
+    return -1;
+
+  for (uint64_t off = 0; size - off >= 512;) {
+    ssize_t got = pread(fd, blk, 512 + META_HEAD, off);
+    if (got < 512 || !tar_header_ok(blk))
+      break;
+    char type    = blk[156];
+    uint64_t len = tar_number(blk + 124, 12);
+    if (type != 'x' && type != 'L' && pax_size != UINT64_MAX)
+      len = pax_size;
+    uint64_t data = off + 512;
+    if (len > size - data)
+      break;
+    off = data + (len + 511) / 512 * 512;
+
+    if ((type == 'L' || type == 'x') && len < (1 << 20)) {
+      char* rec = malloc(len + 1);
+      if (!rec || pread_full(fd, rec, len, data) != 0) {
+        free(rec);
+        goto out;
+      }
+      rec[len]     = '\0';
+      longname.len = 0;
+      if (type == 'L') {
+        buf_put(&longname, rec, strlen(rec) + 1);
+      } else {
+        /* "<length> <key>=<value>\n" records */
+        for (char* r = rec; r < rec + len;) {
+          char* sp;
+          unsigned long n = strtoul(r, &sp, 10);
+          if (*sp != ' ' || n <= (size_t)(sp - r) + 1 || n > (size_t)(rec + len - r))
+            break;
+          r[n - 1] = '\0';
+          char* key = sp + 1;
+          char* eq  = strchr(key, '=');
+          r += n;
+          if (!eq)
+            continue;
+          *eq = '\0';
+          if (strcmp(key, "path") == 0)
+            buf_put(&longname, eq + 1, strlen(eq + 1) + 1);
+          else if (strcmp(key, "size") == 0)
+            pax_size = strtoull(eq + 1, NULL, 10);
+          else if (strcmp(key, "mtime") == 0)
+            pax_mtime = strtoll(eq + 1, NULL, 10);
+        }
+      }
+      free(rec);
+      continue;
+    }
+
+    if (type == '0' || type == '\0' || type == '7') {
+      char name[256 + 1 + 100 + 1];
+      const char* prefix = (const char*)blk + 345;
+      if (longname.len)
+        snprintf(name, sizeof(name), "%s", (const char*)longname.data);
+      else if (memcmp(blk + 257, "ustar", 6) == 0 && prefix[0])
+        snprintf(name, sizeof(name), "%.155s/%.100s", prefix, (const char*)blk);
+      else
+        snprintf(name, sizeof(name), "%.100s", (const char*)blk);
+      const char* clean = longname.len ? archive_member_name((char*)longname.data)
+                                       : archive_member_name(name);
+      ArcEntry e        = {.off = data, .csize = len, .size = len};
+      e.mtime = pax_mtime != INT64_MIN ? pax_mtime : (int64_t)tar_number(blk + 136, 12);
+      size_t n = (size_t)got - 512 < len ? (size_t)got - 512 : len;
+      if (clean && archive_add(b, fd, e, clean, blk + 512, n) != 0)
+        goto out;
+    }
+    longname.len = 0;
+    pax_size     = UINT64_MAX;
+    pax_mtime    = INT64_MIN;
+  }
+  ret = 0;
+out:
+  free(longname.data);
+  free(blk);
+  return ret;
+}
+
+static void
+archive_index_path(char* out, size_t n, const struct stat* st, const char* suffix)
+{
+  snprintf(out, n, "%s/%s/%llx-%llx%s", cache_dir, ARCHIVE_DIR, (unsigned long long)st->st_dev,
+           (unsigned long long)st->st_ino, suffix);
+}
+
+// Point 'a' at its index, which is in a->index.
+static void
+archive_use_index(Archive* a)
+{
+  const ArcHeader* h = (const ArcHeader*)a->index.data;
+  a->entries         = (const ArcEntry*)(h + 1);
+  a->count           = h->count;
+  a->names           = (const char*)(a->entries + a->count);
+}
+
+// Take a's index from the cache. Fails if there is none or it is stale.
+static int
+archive_index_load(Archive* a)
+{
+  char path[sizeof(cache_dir) + 64];
+  archive_index_path(path, sizeof(path), &a->st, "");
+  Buf b = {0};
+  if (read_file(path, &b) != 0 || b.len < sizeof(ArcHeader)) {
+    free(b.data);
+    return -1;
+  }
+
+  /* Anything that does not add up is treated as no index at all. */
+  const ArcHeader* h = (const ArcHeader*)b.data;
+  size_t body        = b.len - sizeof(ArcHeader);
+  int ok = h->magic == ARCHIVE_MAGIC && h->dev == (uint64_t)a->st.st_dev &&
+           h->ino == (uint64_t)a->st.st_ino && h->size == (uint64_t)a->st.st_size &&
+           h->mtime_sec == a->st.st_mtim.tv_sec && h->mtime_nsec == a->st.st_mtim.tv_nsec &&
+           body / sizeof(ArcEntry) >= h->count &&
+           body - h->count * sizeof(ArcEntry) == h->names_len &&
+           (h->names_len ? b.data[b.len - 1] == '\0' : h->count == 0);
+  a->index = b;
+  archive_use_index(a);
+  for (size_t k = 0; ok && k < a->count; k++) {
+    const ArcEntry* e = &a->entries[k];
+    ok = e->name < h->names_len && e->off <= h->size && e->csize <= h->size - e->off &&
+         (e->method != 0 || e->size == e->csize);
+  }
+  if (!ok) {
+    free(b.data);
+    a->index = (Buf){0};
+    return -1;
+  }
+  return 0;
+}
+
+static int
+arc_entry_cmp(const void* a, const void* b, void* names)
+{
+  const ArcEntry *x = a, *y = b;
+  int cmp = strcmp((const char*)names + x->name, (const char*)names + y->name);
+  return cmp ? cmp : x->off < y->off ? -1 : x->off > y->off;
+}
+
+//
+// Index 'a', open on 'fd', and save the index in the cache, replacing the
+// old one in one rename. Of members with the same name, which a tar
+// appended to has, the last one counts.
+//
+static int
+archive_index_build(Archive* a, int fd, ArchiveKind kind)
+{
+  ArcBuild b = {0};
+  int rc     = kind == ARCHIVE_ZIP ? zip_index(fd, a->st.st_size, &b)
+                                   : tar_index(fd, a->st.st_size, &b);
+  size_t count = b.entries.len / sizeof(ArcEntry);
+  ArcEntry* e  = (ArcEntry*)b.entries.data;
+  if (rc != 0 || b.names.len > UINT32_MAX || count > UINT32_MAX) {
+    free(b.entries.data);
+    free(b.names.data);
+    return -1;
+  }
+  if (count)
+    qsort_r(e, count, sizeof(ArcEntry), arc_entry_cmp, b.names.data);
+  size_t kept = 0;
+  for (size_t k = 0; k < count; k++) {
+    if (k + 1 < count && strcmp((const char*)b.names.data + e[k].name,
+                                (const char*)b.names.data + e[k + 1].name) == 0)
+      continue;
+    e[kept++] = e[k];
+  }
+
+  ArcHeader h = {ARCHIVE_MAGIC,      (uint32_t)kept,          a->st.st_dev,
+                 a->st.st_ino,       (uint64_t)a->st.st_size, a->st.st_mtim.tv_sec,
+                 a->st.st_mtim.tv_nsec, b.names.len};
+  Buf* index  = &a->index;
+  rc = buf_put(index, &h, sizeof(h)) != 0 ||
+               (kept && buf_put(index, e, kept * sizeof(ArcEntry)) != 0) ||
+               (b.names.len && buf_put(index, b.names.data, b.names.len) != 0)
+           ? -1
+           : 0;
+  free(b.entries.data);
+  free(b.names.data);
+  if (rc != 0)
+    return -1;
+  archive_use_index(a);
+
+  char path[sizeof(cache_dir) + 64], tmp[sizeof(path) + 32], suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.%ld", (int)getpid(), (long)syscall(SYS_gettid));
+  archive_index_path(path, sizeof(path), &a->st, "");
+  archive_index_path(tmp, sizeof(tmp), &a->st, suffix);
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out < 0)
+    return 0;
+  FILE* f = fdopen(out, "w");
+  int ok  = f && fwrite(index->data, 1, index->len, f) == index->len;
+  if (f)
+    ok = fclose(f) == 0 && ok;
+  else
+    close(out);
+  if (!ok || rename(tmp, path) != 0)
+    remove(tmp);
+  return 0;
+}
+
+static void
+archive_free(Archive* a)
+{
+  if (a->fd >= 0)
+    close(a->fd);
+  free(a->index.data);
+  free(a->path);
+  free(a);
+}
+
+// The open archive at the first 'len' bytes of 'path', or NULL. Call with archives.lock held.
+static Archive*
+archive_lookup(const char* path, size_t len)
+{
+  for (size_t k = archives.count; k-- > 0;) {
+    Archive* a = archives.list[k];
+    if (a->len == len && memcmp(a->path, path, len) == 0)
+      return a;
+  }
+  return NULL;
+}
+
+//
+// Whether 'a' will do for the file at a->path: it is still the one 'a' was
+// indexed from, or has changed too recently to be worth indexing again.
+//
+static int
+archive_current(const Archive* a)
+{
+  struct stat st;
+  if (stat(a->path, &st) != 0)
+    return 0;
+  if (st.st_dev == a->st.st_dev && st.st_ino == a->st.st_ino && st.st_size == a->st.st_size &&
+      st.st_mtim.tv_sec == a->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == a->st.st_mtim.tv_nsec)
+    return 1;
+  return st.st_mtim.tv_sec > time(NULL) - ARCHIVE_SETTLE;
+}
+
+// Let go of an archive from archive_get(); a retired one is freed with its last user.
+static void
+archive_put(Archive* a)
+{
+  if (!a)
+    return;
+  pthread_mutex_lock(&archives.lock);
+  int last = --a->refs == 0 && a->retired;
+  pthread_mutex_unlock(&archives.lock);
+  if (last)
+    archive_free(a);
+}
+
+//
+// The archive at the first 'len' bytes of 'path', opened and indexed on
+// first use, and again once it has changed and settled. Unless 'any' is
+// set, one not open yet is only tried when its name says it is an archive.
+// Returns NULL if there is no archive there; otherwise the caller holds it
+// until archive_put().
+//
+static Archive*
+archive_get(const char* path, size_t len, int any)
+{
+  pthread_mutex_lock(&archives.lock);
+  Archive* a = archive_lookup(path, len);
+  if (a)
+    a->refs++;
+  pthread_mutex_unlock(&archives.lock);
+  if (a ? archive_current(a) : !any && !archive_name(path, len))
+    return a;
+  Archive* stale = a;
+
+  unsigned char head[512];
+  ArchiveKind kind = ARCHIVE_NONE;
+  if (!(a = calloc(1, sizeof(*a))))
+    goto fail;
+  a->fd = -1;
+  if (!(a->path = strndup(path, len)))
+    goto fail;
+  a->len = len;
+  a->fd  = open(a->path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (a->fd < 0 || fstat(a->fd, &a->st) != 0 || !S_ISREG(a->st.st_mode))
+    goto fail;
+  ssize_t n = pread(a->fd, head, sizeof(head), 0);
+  if (n > 0)
+    kind = archive_kind(head, n);
+  if (kind == ARCHIVE_NONE ||
+      (archive_index_load(a) != 0 && archive_index_build(a, a->fd, kind) != 0))
+    goto fail;
+
+  /* Another thread may have opened it meanwhile; a stale one is retired. */
+  pthread_mutex_lock(&archives.lock);
+  Archive* had = archive_lookup(path, len);
+  if (!had || had == stale) {
+    had = NULL;
+    for (size_t k = 0; stale && k < archives.count; k++)
+      if (archives.list[k] == stale) {
+        memmove(archives.list + k, archives.list + k + 1,
+                sizeof(Archive*) * (archives.count - k - 1));
+        archives.count--;
+        stale->retired = 1;
+        break;
+      }
+    if (archives.count == archives.cap) {
+      archives.cap  = archives.cap ? archives.cap * 2 : 16;
+      archives.list = realloc(archives.list, sizeof(Archive*) * archives.cap);
+      if (!archives.list) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    archives.list[archives.count++] = a;
+    a->refs = 1;
+  } else {
+    had->refs++;
+  }
+  pthread_mutex_unlock(&archives.lock);
+  archive_put(stale);
+  if (had) {
+    archive_free(a);
+    return had;
+  }
+  return a;
+
+fail:
+  if (a)
+    archive_free(a);
+  archive_put(stale);
+  return NULL;
+}
+
+//
+// The entry for 'path' if it names a member of an archive, which is left in
+// '*arc' for the caller to archive_put() once done with the entry.
+//
+static const ArcEntry*
+archive_member(const char* path, Archive** arc)
+{
+  for (const char* s = strchr(path, '/'); s; s = strchr(s + 1, '/')) {
+    Archive* a = s > path ? archive_get(path, s - path, 0) : NULL;
+    if (!a)
+      continue;
+    size_t lo = 0, hi = a->count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      int cmp    = strcmp(a->names + a->entries[mid].name, s + 1);
+      if (cmp == 0) {
+        *arc = a;
+        return &a->entries[mid];
+      }
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    archive_put(a);
+    return NULL;
+  }
+  return NULL;
+}
+
+//
+// Point '*d' at the 'n' bytes of archive member 'path', read (and inflated
+// if need be) into '*owned' for the caller to free. Fails if 'path' is no
+// member, claims more than ENGINE_MAX_BYTES, cannot be read in full or does
+// not inflate.
+//
+static int
+archive_read(const char* path, const unsigned char** d, size_t* n, unsigned char** owned)
+{
+  Archive* a        = NULL;
+  const ArcEntry* e = archive_member(path, &a);
+  unsigned char* in = NULL;
+  *owned            = NULL;
+  /* The sizes come from the archive; none the engine could decode is bigger. */
+  if (!e || e->size > ENGINE_MAX_BYTES || e->csize > ENGINE_MAX_BYTES ||
+      !(*owned = malloc(e->size + 1)))
+    goto fail;
+  if (e->method == 0) {
+    if (pread_full(a->fd, *owned, e->size, e->off) != 0)
+      goto fail;
+    *n = e->size;
+  } else if (!(in = malloc(e->csize ? e->csize : 1)) || pread_full(a->fd, in, e->csize, e->off) != 0 ||
+             inflate_raw(in, e->csize, *owned, e->size, n, 0) != 0 || *n != e->size) {
+    goto fail;
+  }
+  free(in);
+  archive_put(a);
+  *d = *owned;
+  return 0;
+
+fail:
+  free(in);
+  archive_put(a);
+  free(*owned);
+  *owned = NULL;
+  return -1;
+}
+
+static void
+list_set_meta(ImageList* list, size_t i, const ImageMeta* m)
+{
+  list->width[i]  = m->w;
+  list->height[i] = m->h;
+  list->orient[i] = (unsigned char)m->orient;
+  list->format[i] = (unsigned char)m->format;
+  list->taken[i]  = m->taken;
+  list->keys[i] |= KEY_META;
+}
+
+// The columns sorting in 'mode' goes by.
+static unsigned char
+sort_needs(int mode)
+{
+  return mode == SORT_MTIME || mode == SORT_SIZE ? KEY_STAT
+         : mode == SORT_TAKEN                    ? KEY_STAT | KEY_META
+                                                 : 0;
+}
+
+typedef struct {
+  ImageList* list;
+  const size_t* idx;
+  unsigned char want;
+} KeyLoad;
+
+// Read the 'need' keys of the file or archive member at 'path'.
+static void
+read_keys(const char* path, unsigned char need, int64_t* mtime, uint64_t* size, ImageMeta* m)
+{
+  Archive* a        = NULL;
+  const ArcEntry* e = NULL;
+  if (need & KEY_STAT) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      *mtime = st.st_mtim.tv_sec;
+      *size  = (uint64_t)st.st_size;
+    } else if ((e = archive_member(path, &a))) {
+      *mtime = e->mtime;
+      *size  = e->size;
+    } else {
+      *mtime = 0;
+      *size  = 0;
+    }
+  }
+  if (need & KEY_META) {
+    *m = (ImageMeta){INT64_MIN, 0, 0, 1, FMT_UNKNOWN};
+    if (read_image_head(AT_FDCWD, path, m) == FMT_UNKNOWN &&
+        (e || (e = archive_member(path, &a))))
+      *m = (ImageMeta){e->taken, e->width, e->height, e->orient, e->format};
+  }
+  archive_put(a);
+}
+
+static void
+load_keys_range(void* arg, size_t begin, size_t end)
+{
+  KeyLoad* kl     = arg;
+  ImageList* list = kl->list;
+  for (size_t k = begin; k < end; k++) {
+    size_t i           = kl->idx[k];
+    unsigned char need = kl->want & ~list->keys[i];
+    ImageMeta m;
+    read_keys(list->path[i], need, &list->mtime[i], &list->size[i], &m);
+    if (need & KEY_META)
+      list_set_meta(list, i, &m);
+    list->keys[i] |= need;
+  }
+}
+
+//
+// Read the 'want' columns of the 'n' entries in 'idx' that are not known
+// yet: mtime and size from stat, the rest from the head of the file. Blocks
+// until done; the reads are spread over IO_THREADS.
+//
+static void
+list_load_keys(ImageList* list, const size_t* idx, size_t n, unsigned char want)
+{
+  if (!want)
+    return;
+  size_t* todo = malloc(sizeof(*todo) * (n ? n : 1));
+  if (!todo) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t m = 0;
+  for (size_t k = 0; k < n; k++)
+    if (want & ~list->keys[idx[k]])
+      todo[m++] = idx[k];
+  KeyLoad kl = {list, todo, want};
+  io_parallel(m, load_keys_range, &kl);
+  free(todo);
+}
+
+//
+// Keys a filter or a new order needs that the scan did not read (with -0 it
+// reads only those the command line asks for) are read by a KeyLoader
+// thread, so the grid never waits on the file system for them. The main
+// thread hands it each entry's index, generation and path, and takes back
+// what was read, KEY_CHUNK entries at a time, into the list, of which it
+// remains the only writer. Until then the entry is pending: a filter leaves
+// it out, and the new order waits for it.
+//
+
+#define KEY_CHUNK 4096 /* entries read between hand-backs */
+
+typedef struct {
+  size_t index;
+  uint32_t gen;
+  unsigned char want;
+  const char* path;
+  int64_t mtime;
+  uint64_t size;
+  ImageMeta meta;
+} KeyJob;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* jobs queued or shutting down */
+  KeyJob* jobs;        /* in the order asked, from 'job_head' on */
+  size_t job_head, job_count, job_cap;
+  KeyJob* results;
+  size_t result_count, result_cap;
+  int wake_fd[2];
+  int stop;
+  pthread_t thread;
+  int started;
+} KeyLoader;
+
+static void
+key_jobs_range(void* arg, size_t begin, size_t end)
+{
+  KeyJob* jobs = arg;
+  for (size_t k = begin; k < end; k++)
+    read_keys(jobs[k].path, jobs[k].want, &jobs[k].mtime, &jobs[k].size, &jobs[k].meta);
+}
+
+static void*
+key_thread(void* arg)
+{
+  KeyLoader* kl = arg;
+  KeyJob* chunk = malloc(sizeof(KeyJob) * KEY_CHUNK);
+  if (!chunk) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&kl->lock);
+  for (;;) {
+    while (!kl->stop && kl->job_head == kl->job_count)
+      pthread_cond_wait(&kl->work, &kl->lock);
+    if (kl->stop)
+      break;
+    size_t n = kl->job_count - kl->job_head < KEY_CHUNK ? kl->job_count - kl->job_head : KEY_CHUNK;
+    memcpy(chunk, kl->jobs + kl->job_head, sizeof(KeyJob) * n);
+    kl->job_head += n;
+    if (kl->job_head == kl->job_count)
+      kl->job_head = kl->job_count = 0;
+    pthread_mutex_unlock(&kl->lock);
+
+    io_parallel(n, key_jobs_range, chunk);
+
+    pthread_mutex_lock(&kl->lock);
+    if (kl->result_count + n > kl->result_cap) {
+      size_t cap = kl->result_cap ? kl->result_cap : KEY_CHUNK;
+      while (cap < kl->result_count + n)
+        cap *= 2;
+      KeyJob* r = realloc(kl->results, sizeof(KeyJob) * cap);
+      if (!r) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+      kl->results    = r;
+      kl->result_cap = cap;
+    }
+    int wake = kl->result_count == 0;
+    memcpy(kl->results + kl->result_count, chunk, sizeof(KeyJob) * n);
+    kl->result_count += n;
+    if (wake && write(kl->wake_fd[1], "", 1) < 0 && errno != EAGAIN)
+      perror("write");
+  }
+  pthread_mutex_unlock(&kl->lock);
+  free(chunk);
+  return NULL;
+}
+
+static int
+keys_start(KeyLoader* kl)
+{
+  memset(kl, 0, sizeof(*kl));
+  pthread_mutex_init(&kl->lock, NULL);
+  pthread_cond_init(&kl->work, NULL);
+  kl->wake_fd[0] = kl->wake_fd[1] = -1;
+  if (pipe2(kl->wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+  kl->started = pthread_create(&kl->thread, NULL, key_thread, kl) == 0;
+  return kl->started ? 0 : -1;
+}
+
+//
+// Hand the loader the shown entries without the keys list->missing names,
+// unless they have been asked for them already.
+//
+static void
+keys_ask(KeyLoader* kl, ImageList* list)
+{
+  unsigned char want = list->missing;
+  list->missing      = 0;
+  pthread_mutex_lock(&kl->lock);
+  for (size_t p = 0; p < list->view_count; p++) {
+    size_t i           = list->view[p];
+    unsigned char need = want & ~list->keys[i] & ~list->asked[i];
+    if (!need)
+      continue;
+    if (kl->job_count == kl->job_cap) {
+      size_t cap = kl->job_cap ? kl->job_cap * 2 : KEY_CHUNK;
+      KeyJob* j  = realloc(kl->jobs, sizeof(KeyJob) * cap);
+      if (!j) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+      kl->jobs    = j;
+      kl->job_cap = cap;
+    }
+    kl->jobs[kl->job_count++] = (KeyJob){.index = i, .gen = list->gen[i], .want = need, .path = list->path[i]};
+    list->asked[i] |= need;
+    list->asking++;
+  }
+  pthread_cond_signal(&kl->work);
+  pthread_mutex_unlock(&kl->lock);
+}
+
+//
+// Move the keys read so far into the list, except those of files rewritten
+// since they were asked for. Returns how many entries came back; never
+// blocks on the loader.
+//
+static size_t
+keys_take(KeyLoader* kl, ImageList* list)
+{
+  char drain[64];
+  while (read(kl->wake_fd[0], drain, sizeof(drain)) > 0)
+    ;
+
+  pthread_mutex_lock(&kl->lock);
+  KeyJob* r          = kl->results;
+  size_t n           = kl->result_count;
+  kl->results        = NULL;
+  kl->result_count   = kl->result_cap = 0;
+  pthread_mutex_unlock(&kl->lock);
+
+  for (size_t k = 0; k < n; k++) {
+    size_t i = r[k].index;
+    list->asked[i] &= ~r[k].want;
+    list->asking--;
+    if (r[k].gen != list->gen[i])
+      continue; /* asked again once a filter finds it without */
+    if (r[k].want & KEY_STAT) {
+      list->mtime[i] = r[k].mtime;
+      list->size[i]  = r[k].size;
+    }
+    if (r[k].want & KEY_META)
+      list_set_meta(list, i, &r[k].meta);
+    list->keys[i] |= r[k].want;
+  }
+  free(r);
+  return n;
+}
+
+static void
+keys_stop(KeyLoader* kl)
+{
+  pthread_mutex_lock(&kl->lock);
+  kl->stop = 1;
+  pthread_cond_broadcast(&kl->work);
+  pthread_mutex_unlock(&kl->lock);
+  if (kl->started)
+    pthread_join(kl->thread, NULL);
+  if (kl->wake_fd[0] >= 0) {
+    close(kl->wake_fd[0]);
+    close(kl->wake_fd[1]);
+  }
+  free(kl->jobs);
+  free(kl->results);
+  pthread_cond_destroy(&kl->work);
+  pthread_mutex_destroy(&kl->lock);
+}
+
+typedef struct {
+  uint64_t key;
+  size_t idx;
+} SortItem;
+
+// Stable LSD radix sort of 'a' by key, a byte per pass; bytes every key shares are skipped.
+static void
+radix_sort(SortItem* a, SortItem* tmp, size_t n)
+{
+  uint64_t all = ~0ull, any = 0;
+  for (size_t k = 0; k < n; k++) {
+    all &= a[k].key;
+    any |= a[k].key;
+  }
+  SortItem *src = a, *dst = tmp;
+  for (int shift = 0; shift < 64; shift += 8) {
+    if (((all ^ any) >> shift & 0xFF) == 0)
+      continue;
+    size_t count[257] = {0};
+    for (size_t k = 0; k < n; k++)
+      count[(src[k].key >> shift & 0xFF) + 1]++;
+    for (int b = 0; b < 256; b++)
+      count[b + 1] += count[b];
+    for (size_t k = 0; k < n; k++)
+      dst[count[src[k].key >> shift & 0xFF]++] = src[k];
+    SortItem* t = src;
+    src         = dst;
+    dst         = t;
+  }
+  if (src != a)
+    memcpy(a, src, sizeof(*a) * n);
+}
+
+static int
+sort_name_cmp(const void* a, const void* b, void* list)
+{
+  const SortItem *x = a, *y = b;
+  int c             = natural_cmp(((ImageList*)list)->path[x->idx], ((ImageList*)list)->path[y->idx]);
+  return c ? c : x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+//
+// Put the shown entries in list_cmp() order, their keys all read. Names go
+// first: a radix pass on natural_key() past the prefix all paths share, then
+// the few runs with equal keys by natural_cmp(). The sort key and the group
+// follow as stable radix passes, so each one only breaks the ties of the
+// next.
+//
+static void
+list_sort(ImageList* list)
+{
+  size_t n = list->view_count;
+  if (n < 2)
+    return;
+  SortItem* a   = malloc(sizeof(*a) * n);
+  SortItem* tmp = malloc(sizeof(*tmp) * n);
+  if (!a || !tmp) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (list->sort == SORT_SCAN) {
+    for (size_t k = 0; k < n; k++)
+      a[k] = (SortItem){list->view[k], list->view[k]};
+    radix_sort(a, tmp, n);
+  } else {
+    /* Skip the shared prefix, backing off so no digit run is split. */
+    const char* first = list->path[list->view[0]];
+    size_t prefix     = strlen(first);
+    for (size_t k = 1; k < n && prefix; k++) {
+      const char* p = list->path[list->view[k]];
+      size_t m      = 0;
+      while (m < prefix && p[m] == first[m])
+        m++;
+      prefix = m;
+    }
+    while (prefix && isdigit((unsigned char)first[prefix - 1]))
+      prefix--;
+
+    for (size_t k = 0; k < n; k++)
+      a[k] = (SortItem){natural_key(list->path[list->view[k]] + prefix), list->view[k]};
+    radix_sort(a, tmp, n);
+    for (size_t k = 0, end; k < n; k = end) {
+      for (end = k + 1; end < n && a[end].key == a[k].key;)
+        end++;
+      if (end - k > 1)
+        qsort_r(a + k, end - k, sizeof(*a), sort_name_cmp, list);
+    }
+    if (list->sort != SORT_NAME) {
+      for (size_t k = 0; k < n; k++)
+        a[k].key = sort_key(list, a[k].idx);
+      radix_sort(a, tmp, n);
+    }
+  }
+  for (size_t k = 0; k < n; k++)
+    a[k].key = list->group[a[k].idx];
+  radix_sort(a, tmp, n);
+
+  for (size_t k = 0; k < n; k++) {
+    list->view[k]       = a[k].idx;
+    list->pos[a[k].idx] = k;
+  }
+  free(a);
+  free(tmp);
+}
+
+// list_show() for a sorted grid.
+static size_t
+list_show_sorted(ImageList* list, size_t first, size_t n)
+{
+  size_t* add = malloc(sizeof(*add) * n);
+  if (!add) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t k = 0; k < n; k++) {
+    add[k]    = first + k;
+    size_t* s = path_slot(list, list->path[first + k]);
+    if (!*s)
+      *s = first + k + 1;
+  }
+  list_load_keys(list, add, n, sort_needs(list->sort));
+  qsort_r(add, n, sizeof(*add), list_qsort_cmp, list);
+
+  /* Merge from the back, moving each block of old cells only once. */
+  size_t end = list->view_count, low = end;
+  for (size_t k = n; k-- > 0;) {
+    size_t lo = 0, hi = end;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (list_cmp(list, list->view[mid], add[k]) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    memmove(list->view + lo + k + 1, list->view + lo, sizeof(*list->view) * (end - lo));
+    list->view[lo + k] = add[k];
+    end                = lo;
+    low                = lo + k;
+  }
+  list->view_count += n;
+  for (size_t q = low; q < list->view_count; q++)
+    list->pos[list->view[q]] = q;
+  free(add);
+  return low;
+}
+
+//
+// Show the 'n' new entries from 'first' on, all of one group, in their
+// sorted place among the cells of that group. Found in scan order, they
+// simply follow the group, which is usually the end of the grid. Returns
+// the first cell that changed.
+//
+static size_t
+list_show(ImageList* list, size_t first, size_t n)
+{
+  if (list->by_path_cap < 2 * (list->view_count + n)) {
+    size_t cap = list->by_path_cap ? list->by_path_cap : 2048;
+    while (cap < 2 * (list->view_count + n))
+      cap *= 2;
+    path_rehash(list, cap);
+  }
+
+  if (list->sort != SORT_SCAN)
+    return list_show_sorted(list, first, n);
+
+  uint32_t g = list->group[first];
+  size_t lo = 0, hi = list->view_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (list->group[list->view[mid]] <= g)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  memmove(list->view + lo + n, list->view + lo, sizeof(*list->view) * (list->view_count - lo));
+  for (size_t k = 0; k < n; k++) {
+    size_t* s = path_slot(list, list->path[first + k]);
+    if (!*s) /* a path given twice stays findable once */
+      *s = first + k + 1;
+    list->view[lo + k] = first + k;
+  }
+  list->view_count += n;
+  for (size_t q = lo; q < list->view_count; q++)
+    list->pos[list->view[q]] = q;
+  return lo;
+}
+
+// Add 'path' to the grid in its place within its group, and return its cell.
+static size_t
+add_image_entry(ImageList* list, const char* path, uint32_t group)
+{
+  return list_show(list, new_image_entry(list, path, group), 1);
+}
+
+// Whether a filter narrows the grid.
+static int
+list_filtered(const ImageList* list)
+{
+  const Filter* f = &list->filter;
+  return f->name[0] || f->min_size || f->since != FILTER_ANY_TIME || f->min_width || f->format ||
+         f->shape;
+}
+
+// How many cells the grid has.
+static size_t
+grid_count(const ImageList* list)
+{
+  return list_filtered(list) ? list->match_count : list->view_count;
+}
+
+// The entry in grid cell p.
+static size_t
+grid_entry(const ImageList* list, size_t p)
+{
+  return list_filtered(list) ? list->match[p] : list->view[p];
+}
+
+// The grid cell of entry i, or NOT_SHOWN; the matches keep view order, so it is a binary search.
+static size_t
+grid_cell(const ImageList* list, size_t i)
+{
+  size_t v = list->pos[i];
+  if (v == NOT_SHOWN || !list_filtered(list))
+    return v;
+  size_t lo = 0, hi = list->match_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (list->pos[list->match[mid]] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < list->match_count && list->match[lo] == i ? lo : NOT_SHOWN;
+}
+
+// ASCII letters match in either case.
+static unsigned char
+fold_byte(unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// One of 64 symbols for a folded byte. Rare bytes share one, which costs the index only precision.
+static unsigned
+trigram_sym(unsigned char c)
+{
+  return c >= 'a' && c <= 'z' ? c - 'a' : c >= '0' && c <= '9' ? 26 + (c - '0') : 36 + c % 28;
+}
+
+static unsigned
+trigram(const char* s)
+{
+  return trigram_sym(s[0]) << 12 | trigram_sym(s[1]) << 6 | trigram_sym(s[2]);
+}
+
+//
+// Bring the name index up to every entry: each file name goes into 'folded'
+// and the entry onto the posting list of each trigram of it. Entries come
+// in index order, so a list stays sorted and holds an entry only once.
+//
+static void
+list_index_names(ImageList* list)
+{
+  if (!list->trigrams)
+    list->trigrams = calloc((size_t)1 << TRIGRAM_BITS, sizeof(*list->trigrams));
+  list->folded_at = realloc(list->folded_at, sizeof(*list->folded_at) * (list->cap ? list->cap : 1));
+  if (!list->trigrams || !list->folded_at) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = list->indexed; i < list->count; i++) {
+    const char* slash = strrchr(list->path[i], '/');
+    const char* name  = slash ? slash + 1 : list->path[i];
+    size_t len        = strlen(name);
+    if (list->folded_len + len + 1 > list->folded_cap) {
+      size_t cap = list->folded_cap ? list->folded_cap * 2 : 1 << 16;
+      while (cap < list->folded_len + len + 1)
+        cap *= 2;
+      char* f = realloc(list->folded, cap);
+      if (!f) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+      list->folded     = f;
+      list->folded_cap = cap;
+    }
+    char* f = list->folded + list->folded_len;
+    for (size_t k = 0; k < len; k++)
+      f[k] = (char)fold_byte((unsigned char)name[k]);
+    f[len]             = '\0';
+    list->folded_at[i] = list->folded_len;
+    list->folded_len += len + 1;
+
+    for (size_t k = 0; k + 3 <= len; k++) {
+      Posting* p = &list->trigrams[trigram(f + k)];
+      if (p->count && p->ids[p->count - 1] == i)
+        continue;
+      if (p->count == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 4;
+        uint32_t* ids = realloc(p->ids, sizeof(*ids) * cap);
+        if (!ids) {
+          fprintf(stderr, "Out of memory.\n");
+          exit(EXIT_FAILURE);
+        }
+        p->ids = ids;
+        p->cap = cap;
+      }
+      p->ids[p->count++] = (uint32_t)i;
+    }
+  }
+  list->indexed = list->count;
+}
+
+// Parse a byte count with an optional K, M or G suffix.
+static int
+parse_size(const char* s, uint64_t* out)
+{
+  char* end;
+  /* strtoull() would take "-1" for UINT64_MAX. */
+  if (!isdigit((unsigned char)*s))
+    return -1;
+  errno                = 0;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (errno || end == s)
+    return -1;
+  int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'G': shift += 10; /* fall through */
+  case 'M': shift += 10; /* fall through */
+  case 'K': shift += 10; end++; break;
+  }
+  if (*end || v > UINT64_MAX >> shift)
+    return -1;
+  v <<= shift;
+  *out = v;
+  return 0;
+}
+
+// Parse a date as "2021", "2021-06", "2021-06-01" or "2021-06-01T12:30", in UTC like EXIF times.
+static int
+parse_date(const char* s, int64_t* out)
+{
+  static const char* const forms[] = {"%Y-%m-%dT%H:%M", "%Y-%m-%d", "%Y-%m", "%Y"};
+  for (size_t k = 0; k < sizeof(forms) / sizeof(*forms); k++) {
+    struct tm tm    = {.tm_mday = 1};
+    const char* end = strptime(s, forms[k], &tm);
+    if (end && !*end) {
+      *out = (int64_t)timegm(&tm);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+//
+// Add the predicate 'key' with 'value' to 'f'. A size, date or width bound
+// only ever gets tighter, so the command line's stays when a filter word
+// asks for less; a format or orientation replaces the one before. Returns
+// -1 for a value that does not parse, leaving 'f' as it was.
+//
+static int
+filter_set(Filter* f, PredKey key, const char* value)
+{
+  uint64_t v;
+  int64_t t;
+  char* end;
+  switch (key) {
+  case PRED_SIZE:
+    if (parse_size(value, &v) != 0)
+      return -1;
+    if (v > f->min_size)
+      f->min_size = v;
+    return 0;
+  case PRED_SINCE:
+    if (parse_date(value, &t) != 0)
+      return -1;
+    if (t > f->since)
+      f->since = t;
+    return 0;
+  case PRED_WIDTH:
+    errno = 0;
+    v     = strtoull(value, &end, 10);
+    if (errno || end == value || *end || v > UINT32_MAX)
+      return -1;
+    if (v > f->min_width)
+      f->min_width = (uint32_t)v;
+    return 0;
+  case PRED_FORMAT:
+    for (int k = 1; k < FMT_COUNT; k++)
+      if (strcasecmp(value, format_names[k]) == 0 || (k == FMT_JPEG && strcasecmp(value, "jpg") == 0)) {
+        f->format = (unsigned char)k;
+        return 0;
+      }
+    return -1;
+  case PRED_ORIENTATION:
+    if (strcasecmp(value, "landscape") == 0)
+      f->shape = SHAPE_LANDSCAPE;
+    else if (strcasecmp(value, "portrait") == 0)
+      f->shape = SHAPE_PORTRAIT;
+    else
+      return -1;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+//
+// Split the words of 'f' into 'buf': "key:value" words go into 'q', a copy
+// of 'f' with their predicates added, and the others are folded into
+// 'word'. A predicate still being typed is left out. Returns the number of
+// words.
+//
+static int
+filter_parse(const Filter* f, Filter* q, char* buf, char** word)
+{
+  int words = 0;
+  *q        = *f;
+  memcpy(buf, f->name, sizeof(f->name));
+  for (char *save, *w = strtok_r(buf, " ", &save); w && words < FILTER_WORDS;
+       w = strtok_r(NULL, " ", &save)) {
+    const char* colon = strchr(w, ':');
+    int key           = 0;
+    while (colon && key < PRED_COUNT &&
+           !(strlen(pred_words[key]) == (size_t)(colon - w) && strncasecmp(w, pred_words[key], colon - w) == 0))
+      key++;
+    if (colon && key < PRED_COUNT) {
+      filter_set(q, key, colon + 1);
+      continue;
+    }
+    for (char* c = w; *c; c++)
+      *c = (char)fold_byte((unsigned char)*c);
+    word[words++] = w;
+  }
+  return words;
+}
+
+// Whether all that 'q' lets through, 'o' did too, so only its matches need checking again.
+static int
+filter_narrows(const Filter* o, char* const* ow, int on, const Filter* q, char* const* qw, int qn)
+{
+  if (q->min_size < o->min_size || q->since < o->since || q->min_width < o->min_width ||
+      (o->format && q->format != o->format) || (o->shape && q->shape != o->shape))
+    return 0;
+  for (int i = 0; i < on; i++) {
+    int j = 0;
+    while (j < qn && !strstr(qw[j], ow[i]))
+      j++;
+    if (j == qn)
+      return 0;
+  }
+  return 1;
+}
+
+// The columns the predicates of 'q' read.
+static unsigned char
+filter_needs(const Filter* q)
+{
+  return (q->min_size ? KEY_STAT : 0) | (q->since != FILTER_ANY_TIME ? KEY_STAT | KEY_META : 0) |
+         (q->min_width || q->format || q->shape ? KEY_META : 0);
+}
+
+//
+// Set keep[i] for each shown entry i that passes the predicates of 'q'.
+// Each predicate is a branch-free pass down its columns, which the compiler
+// turns into vector code; no file is read here, and an entry whose columns
+// have not been read yet is left out.
+//
+static void
+list_keep(const ImageList* list, const Filter* q, unsigned char* restrict keep)
+{
+  size_t n                              = list->count;
+  const size_t* restrict pos            = list->pos;
+  const unsigned char* restrict keys    = list->keys;
+  const uint64_t* restrict size         = list->size;
+  const int64_t* restrict mtime         = list->mtime;
+  const int64_t* restrict taken         = list->taken;
+  const uint32_t* restrict width        = list->width;
+  const uint32_t* restrict height       = list->height;
+  const unsigned char* restrict orient  = list->orient;
+  const unsigned char* restrict format  = list->format;
+  uint64_t min_size = q->min_size;
+  int64_t since     = q->since;
+  uint32_t min_w    = q->min_width;
+  unsigned char fmt = q->format;
+  unsigned char need = filter_needs(q);
+
+  for (size_t k = 0; k < n; k++)
+    keep[k] = (pos[k] != NOT_SHOWN) & ((keys[k] & need) == need);
+  if (min_size)
+    for (size_t k = 0; k < n; k++)
+      keep[k] &= size[k] >= min_size;
+  if (since != FILTER_ANY_TIME)
+    for (size_t k = 0; k < n; k++) {
+      int64_t t = taken[k], m = mtime[k];
+      keep[k] &= (t != INT64_MIN ? t : m) >= since;
+    }
+  /* Orientations 5 to 8 turn the image on its side. */
+  if (min_w)
+    for (size_t k = 0; k < n; k++) {
+      uint32_t w = width[k], h = height[k];
+      keep[k] &= (orient[k] >= 5 ? h : w) >= min_w;
+    }
+  if (fmt)
+    for (size_t k = 0; k < n; k++)
+      keep[k] &= format[k] == fmt;
+  if (q->shape) {
+    unsigned char tall = q->shape == SHAPE_PORTRAIT;
+    for (size_t k = 0; k < n; k++) {
+      unsigned char wide = width[k] > height[k], high = height[k] > width[k];
+      unsigned char turn = (orient[k] >= 5) ^ tall;
+      keep[k] &= (turn & high) | ((turn ^ 1) & wide);
+    }
+  }
+}
+
+// Whether entry i's name has every word in it.
+static int
+name_matches(const ImageList* list, size_t i, char* const* word, int words)
+{
+  const char* name = list->folded + list->folded_at[i];
+  for (int w = 0; w < words; w++)
+    if (!strstr(name, word[w]))
+      return 0;
+  return 1;
+}
+
+//
+// Fill 'match' with the shown entries the filter lets through. The shortest
+// posting list among the trigrams of the words holds every candidate; with
+// only words shorter than that, every entry is one. Predicates are settled
+// first for all entries at once by list_keep(). Candidates go into view
+// order by a radix sort on their cell when they are few, otherwise by a walk
+// over the view. With 'within' set the filter has only narrowed, so the
+// matches themselves are checked again in place when there are fewer of
+// them. Entries whose columns are still being read are left out until the
+// KeyLoader brings them in. Returns the first cell that changed.
+//
+static size_t
+list_match(ImageList* list, int within)
+{
+  if (!list_filtered(list)) {
+    list->match_count = 0;
+    return 0;
+  }
+  list_index_names(list);
+
+  Filter q;
+  char buf[sizeof(list->filter.name)], *word[FILTER_WORDS];
+  int words = filter_parse(&list->filter, &q, buf, word);
+
+  const Posting* best = NULL;
+  for (int w = 0; w < words; w++)
+    for (size_t k = 0; k + 3 <= strlen(word[w]); k++) {
+      const Posting* p = &list->trigrams[trigram(word[w] + k)];
+      if (!best || p->count < best->count)
+        best = p;
+    }
+
+  unsigned char* keep = NULL;
+  if (filter_needs(&q)) {
+    /* Entries without the columns wait for the KeyLoader. */
+    unsigned char lack = 0;
+    for (size_t p = 0; p < list->view_count; p++)
+      lack |= filter_needs(&q) & ~list->keys[list->view[p]];
+    list->missing |= lack;
+    if (!(keep = malloc(list->count ? list->count : 1))) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    list_keep(list, &q, keep);
+  }
+
+  if (within && (!best || list->match_count <= best->count)) {
+    size_t n = 0, first = SIZE_MAX;
+    for (size_t c = 0; c < list->match_count; c++) {
+      size_t i = list->match[c];
+      if ((keep && !keep[i]) || !name_matches(list, i, word, words))
+        continue;
+      if (n != c && first == SIZE_MAX)
+        first = n;
+      list->match[n++] = i;
+    }
+    list->match_count = n;
+    free(keep);
+    return first == SIZE_MAX ? n : first;
+  }
+
+  size_t cand = best ? best->count : list->count, k = 0;
+  size_t* hit = malloc(sizeof(*hit) * (cand ? cand : 1));
+  if (!hit) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t c = 0; c < cand; c++) {
+    size_t i = best ? best->ids[c] : c;
+    if ((keep ? keep[i] : list->pos[i] != NOT_SHOWN) && name_matches(list, i, word, words))
+      hit[k++] = i;
+  }
+  free(keep);
+
+  if (k < list->view_count / 16) {
+    SortItem* a   = malloc(sizeof(*a) * (k ? k : 1));
+    SortItem* tmp = malloc(sizeof(*tmp) * (k ? k : 1));
+    if (!a || !tmp) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t c = 0; c < k; c++)
+      a[c] = (SortItem){list->pos[hit[c]], hit[c]};
+    radix_sort(a, tmp, k);
+    for (size_t c = 0; c < k; c++)
+      hit[c] = a[c].idx;
+    free(a);
+    free(tmp);
+  } else {
+    uint64_t* mark = calloc(list->count / 64 + 1, sizeof(*mark));
+    if (!mark) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t c = 0; c < k; c++)
+      mark[hit[c] / 64] |= 1ull << (hit[c] % 64);
+    k = 0;
+    for (size_t p = 0; p < list->view_count; p++)
+      if (mark[list->view[p] / 64] >> (list->view[p] % 64) & 1)
+        hit[k++] = list->view[p];
+    free(mark);
+  }
+
+  size_t first = 0;
+  while (first < k && first < list->match_count && hit[first] == list->match[first])
+    first++;
+  free(list->match);
+  list->match       = hit;
+  list->match_count = k;
+  return first;
+}
+
+//
+// Narrow the grid to what 'f' lets through, or show all of it again when
+// 'f' asks for nothing. Typing on mostly narrows. Returns the first cell
+// that changed.
+//
+static size_t
+list_filter(ImageList* list, const Filter* f)
+{
+  Filter o, q;
+  char ob[sizeof(f->name)], qb[sizeof(f->name)], *ow[FILTER_WORDS], *qw[FILTER_WORDS];
+  int within = 0;
+  if (list_filtered(list)) {
+    int on = filter_parse(&list->filter, &o, ob, ow);
+    int qn = filter_parse(f, &q, qb, qw);
+    within = filter_narrows(&o, ow, on, &q, qw, qn);
+  }
+  list->filter = *f;
+  return list_match(list, within);
+}
+
+//
+// Put the view in 'sort_next' order once every shown entry has the keys it
+// goes by, and match the filter again. Until then the view keeps its order
+// and the entries without them are marked for the KeyLoader. Returns
+// nonzero if the order changed.
+//
+static int
+list_resort(ImageList* list)
+{
+  unsigned char need = sort_needs(list->sort_next);
+  for (size_t p = 0; p < list->view_count; p++)
+    if (need & ~list->keys[list->view[p]]) {
+      list->missing |= need;
+      return 0;
+    }
+  list->sort = list->sort_next;
+  list_sort(list);
+  list_match(list, 0);
+  return 1;
+}
+
+//
+// Take entry i off the grid; the cells after it move back by one. The entry
+// itself stays, so jobs and results naming it are simply ignored.
+//
+static void
+list_remove(ImageList* list, size_t i)
+{
+  size_t p = list->pos[i], c = grid_cell(list, i);
+  if (list_filtered(list) && c != NOT_SHOWN) {
+    list->match_count--;
+    memmove(list->match + c, list->match + c + 1, sizeof(*list->match) * (list->match_count - c));
+  }
+  list->view_count--;
+  memmove(list->view + p, list->view + p + 1, sizeof(*list->view) * (list->view_count - p));
+  for (size_t q = p; q < list->view_count; q++)
+    list->pos[list->view[q]] = q;
+  list->pos[i] = NOT_SHOWN;
+
+  size_t* s = path_slot(list, list->path[i]);
+  if (*s != i + 1)
+    return;
+
+  /* Backward-shift deletion keeps every probe chain unbroken. */
+  size_t mask         = list->by_path_cap - 1;
+  size_t hole         = s - list->by_path;
+  list->by_path[hole] = 0;
+  for (size_t h = (hole + 1) & mask; list->by_path[h]; h = (h + 1) & mask) {
+    size_t home = path_hash(list->path[list->by_path[h] - 1]) & mask;
+    if (((h - home) & mask) >= ((h - hole) & mask)) {
+      list->by_path[hole] = list->by_path[h];
+      list->by_path[h]    = 0;
+      hole                = h;
+    }
+  }
+}
+
+//
+// Forget what was known of entry i, whose file has been rewritten, so its
+// thumbnail is made and its header read again. It keeps its cell, unless
+// the grid is sorted and watch_apply() moves it to its new place. Bumping
+// its generation drops the thumbnails still being made of the old file.
+//
+static void
+list_reset(ImageList* list, size_t i)
+{
+  list->thumb_off[i]   = 0;
+  list->thumb_len[i]   = 0;
+  list->thumb_state[i] = THUMB_NONE;
+  list->gen[i]++;
+  list->keys[i]   = 0;
+  list->mtime[i]  = 0;
+  list->size[i]   = 0;
+  list->width[i]  = 0;
+  list->height[i] = 0;
+  list->orient[i] = 1;
+  list->format[i] = FMT_UNKNOWN;
+  list->taken[i]  = INT64_MIN;
+}
+
+//
+// Files on a spinning disk are read in inode order wherever there is a
+// choice, which on most filesystems keeps the head moving one way: the
+// scanner sniffs a rotational directory's files sorted by inode, and the
+// thumbnail pool takes a disk's jobs the same way while running at most
+// HDD_JOBS of them at once (see pool_next_job). Devices are numbered from 1
+// as they are first seen; 0 is one not known, treated like an SSD.
+//
+
+#define IO_MAX_DEVICES 64
+#define HDD_JOBS       2 /* one reading while the other decodes */
+
+static struct {
+  pthread_mutex_t lock;
+  dev_t dev[IO_MAX_DEVICES];
+  unsigned char rotational[IO_MAX_DEVICES]; /* fixed once the number is handed out */
+  uint32_t count;
+} io_devices = {.lock = PTHREAD_MUTEX_INITIALIZER, .count = 1};
+
+// Ask sysfs whether 'dev' spins; a partition's answer is its disk's.
+static int
+device_rotational(dev_t dev)
+{
+  static const char* const fmt[] = {"/sys/dev/block/%u:%u/queue/rotational",
+                                    "/sys/dev/block/%u:%u/../queue/rotational"};
+  for (int i = 0; i < 2; i++) {
+    char p[80];
+    snprintf(p, sizeof(p), fmt[i], major(dev), minor(dev));
+    FILE* f = fopen(p, "re");
+    if (f) {
+      int c = fgetc(f);
+      fclose(f);
+      return c == '1';
+    }
+  }
+  return 0; /* NFS, tmpfs and the like */
+}
+
+// The number for 'dev', assigned on first sight.
+static uint32_t
+io_device(dev_t dev)
+{
+  pthread_mutex_lock(&io_devices.lock);
+  uint32_t id = 1;
+  while (id < io_devices.count && io_devices.dev[id] != dev)
+    id++;
+  if (id == io_devices.count) {
+    if (id == IO_MAX_DEVICES) {
+      id = 0;
+    } else {
+      io_devices.dev[id]        = dev;
+      io_devices.rotational[id] = device_rotational(dev);
+      io_devices.count++;
+    }
+  }
+  pthread_mutex_unlock(&io_devices.lock);
+  return id;
+}
+
+// The dev_t numbered 'id' by io_device(); 0 for the number the devices past IO_MAX_DEVICES share.
+static dev_t
+io_device_dev(uint32_t id)
+{
+  pthread_mutex_lock(&io_devices.lock);
+  dev_t dev = io_devices.dev[id];
+  pthread_mutex_unlock(&io_devices.lock);
+  return dev;
+}
+
+//
+// The directories given on the command line, and with -r every directory
+// below them, are watched with inotify so files that appear, change or go
+// away later are reflected in the grid without a rescan. Each watch is added
+// before its directory is listed, so nothing created in between is missed;
+// a file reported by both is only added once. Directories created after the
+// scan are not followed.
+//
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+typedef struct {
+  char* path; /* spelled as the scanner does */
+  uint32_t group;
+} WatchDir;
+
+typedef struct {
+  int fd;               /* inotify, non-blocking; -1 when not watching */
+  pthread_mutex_t lock; /* walkers add watches concurrently */
+  WatchDir* dirs;       /* indexed by watch descriptor */
+  int ndirs;
+} Watcher;
+
+static void
+watch_open(Watcher* w)
+{
+  memset(w, 0, sizeof(*w));
+  pthread_mutex_init(&w->lock, NULL);
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+// Watch 'dir_path'. Failure (e.g. hitting max_user_watches) only means its
+// changes go unnoticed.
+static void
+watch_add(Watcher* w, const char* dir_path, uint32_t group)
+{
+  if (!w || w->fd < 0)
+    return;
+  int wd = inotify_add_watch(w->fd, dir_path, WATCH_MASK);
+  if (wd < 0)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  if (wd >= w->ndirs) {
+    int n          = wd + 1 > w->ndirs * 2 ? wd + 1 : w->ndirs * 2;
+    WatchDir* dirs = realloc(w->dirs, sizeof(*dirs) * n);
+    if (!dirs) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    memset(dirs + w->ndirs, 0, sizeof(*dirs) * (n - w->ndirs));
+    w->dirs  = dirs;
+    w->ndirs = n;
+  }
+  /* The same directory reached twice (bind mounts) keeps its first name. */
+  if (!w->dirs[wd].path)
+    w->dirs[wd] = (WatchDir){strdup(dir_path), group};
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void
+watch_close(Watcher* w)
+{
+  if (w->fd >= 0)
+    close(w->fd);
+  for (int i = 0; i < w->ndirs; i++)
+    free(w->dirs[i].path);
+  free(w->dirs);
+  pthread_mutex_destroy(&w->lock);
+}
+
+//
+// Directories are listed by a Scanner thread so the grid can come up at once.
+// Paths it finds collect in 'batch' until the main thread takes them and
+// appends them to the ImageList, which it remains the only writer of. The
+// scanner writes to wake_fd whenever it adds to an empty batch, so the batch
+// size adapts to how quickly the main thread keeps up.
+//
+// The directories given are listed concurrently by up to SCAN_WALKERS
+// threads, one directory per task. Each path is tagged with the group (the
+// command-line argument) it came from, and the main thread slots it in
+// after the rest of that group, so the grid keeps the arguments in order.
+//
+// With -r the walkers go on through the whole tree. Each walker pushes the
+// subdirectories it finds onto its own deque and works from the back of it,
+// depth first; a walker that runs dry steals from the front of another's,
+// taking the shallow directories that fan out the most.
+//
+// An archive given, or with -r found by its name, is a task like a
+// directory, listed from its index instead (see load_images_from_archive).
+//
+
+typedef struct {
+  char* dir;
+  uint32_t group;
+} WalkTask;
+
+typedef struct {
+  pthread_mutex_t lock;
+  WalkTask* tasks; /* ring of directories to list */
+  size_t head, count, cap;
+} WalkDeque;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int started;
+  WalkTask* roots; /* the directories given */
+  int nroots;
+  int list_fd; /* or with -0, where the paths come from */
+  unsigned char want; /* keys read for each listed path, so the main thread need not; locked */
+  int recursive;
+  WalkDeque* deques; /* one per walker */
+  int nwalkers;
+  size_t walk_queued;  /* directories sitting in deques */
+  size_t walk_pending; /* ... plus those being listed; 0 => walk complete */
+  pthread_cond_t walk_cond;
+  char* batch; /* ScanItem, then NUL-terminated path, for each not yet taken */
+  size_t batch_len, batch_cap;
+  int done;     /* the scan has finished (or was never needed) */
+  int finished; /* the main thread has taken everything; main thread only */
+  int stop;     /* asked to give up early */
+  int wake_fd[2];
+  Watcher* watch; /* told about every directory listed; may be NULL */
+} Scanner;
+
+typedef struct {
+  uint32_t group;
+  uint32_t dev; /* see io_device() */
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+  ImageMeta meta;
+  uint32_t keys; /* which of the above are known, see SortKey */
+} ScanItem;
+
+static int
+scan_stopping(Scanner* sc)
+{
+  pthread_mutex_lock(&sc->lock);
+  int stop = sc->stop;
+  pthread_mutex_unlock(&sc->lock);
+  return stop;
+}
+
+// Hand one path to the main thread. Returns -1 once the scan should stop.
+static int
+scan_emit(Scanner* sc, const ScanItem* item, const char* path, size_t len)
+{
+  pthread_mutex_lock(&sc->lock);
+  int wake    = sc->batch_len == 0;
+  size_t need = sc->batch_len + sizeof(*item) + len + 1;
+  if (need > sc->batch_cap) {
+    size_t cap = sc->batch_cap ? sc->batch_cap * 2 : 64 * 1024;
+    while (cap < need)
+      cap *= 2;
+    char* b = realloc(sc->batch, cap);
+    if (!b) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    sc->batch     = b;
+    sc->batch_cap = cap;
+  }
+  memcpy(sc->batch + sc->batch_len, item, sizeof(*item));
+  memcpy(sc->batch + sc->batch_len + sizeof(*item), path, len + 1);
+  sc->batch_len = need;
+  int stop = sc->stop;
+  pthread_mutex_unlock(&sc->lock);
+
+  if (wake && write(sc->wake_fd[1], "", 1) < 0 && errno != EAGAIN)
+    perror("write");
+  return stop ? -1 : 0;
+}
+
+// Queue a directory on 'walker's own deque.
+static void
+walk_push(Scanner* sc, int walker, const char* path, uint32_t group)
+{
+  char* dir = strdup(path);
+  if (!dir)
+    return;
+  WalkDeque* q = &sc->deques[walker];
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->cap) {
+    size_t cap  = q->cap ? q->cap * 2 : 64;
+    WalkTask* t = malloc(sizeof(WalkTask) * cap);
+    if (!t) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < q->count; i++)
+      t[i] = q->tasks[(q->head + i) % q->cap];
+    free(q->tasks);
+    q->tasks = t;
+    q->head  = 0;
+    q->cap   = cap;
+  }
+  q->tasks[(q->head + q->count++) % q->cap] = (WalkTask){dir, group};
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_mutex_lock(&sc->lock);
+  sc->walk_queued++;
+  sc->walk_pending++;
+  pthread_cond_signal(&sc->walk_cond);
+  pthread_mutex_unlock(&sc->lock);
+}
+
+// Take the newest directory from our own deque, or steal the oldest from another.
+static WalkTask
+walk_take(Scanner* sc, int walker)
+{
+  WalkTask t = {NULL, 0};
+  for (int k = 0; k < sc->nwalkers && !t.dir; k++) {
+    WalkDeque* q = &sc->deques[(walker + k) % sc->nwalkers];
+    pthread_mutex_lock(&q->lock);
+    if (q->count && k == 0) {
+      t = q->tasks[(q->head + --q->count) % q->cap];
+    } else if (q->count) {
+      t       = q->tasks[q->head];
+      q->head = (q->head + 1) % q->cap;
+      q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  if (t.dir) {
+    pthread_mutex_lock(&sc->lock);
+    sc->walk_queued--;
+    pthread_mutex_unlock(&sc->lock);
+  }
+  return t;
+}
+
+//
+// Read the first few bytes of 'name' in 'dirfd' to see whether it is an
+// image at all. Returns its format, FMT_UNKNOWN if it is not one.
+//
+static ImageFormat
+looks_like_image(int dirfd, const char* name)
+{
+  unsigned char head[SNIFF_BYTES];
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return FMT_UNKNOWN;
+  ssize_t n = read(fd, head, sizeof(head));
+  close(fd);
+  return n > 0 ? sniff_format(head, n) : FMT_UNKNOWN;
+}
+
+typedef struct {
+  uint64_t ino;
+  uint32_t dev;
+  unsigned char type;   /* DT_REG, or DT_UNKNOWN / DT_LNK until stat-ed */
+  unsigned char format; /* ImageFormat once sniffed */
+  uint64_t size;        /* once stat-ed */
+  int64_t mtime_ns;
+  ImageMeta meta; /* once sniffed */
+  const char* name; /* in the getdents buffer */
+} DirFile;
+
+//
+// The files of a getdents batch are stat-ed (where d_type is not enough)
+// and sniffed together. With io_uring each walker keeps a ring and issues
+// the statx, openat, read and close calls IO_DEPTH at a time, one
+// io_uring_enter() per round instead of a syscall each, which is what a
+// cold NFS or NVMe directory is limited by. Where io_uring is missing or
+// refused (old kernels, the io_uring_disabled sysctl, seccomp) the batch is
+// split across IO_THREADS helper threads making the plain calls instead.
+//
+
+typedef struct {
+  int fd; /* -1 when falling back to threads */
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* ring_map;
+  size_t ring_len;
+  size_t sqe_len;
+  unsigned tail, queued;
+} IoRing;
+
+static void
+ring_close(IoRing* r)
+{
+  if (r->fd < 0)
+    return;
+  munmap(r->ring_map, r->ring_len);
+  munmap(r->sqes, r->sqe_len);
+  close(r->fd);
+  r->fd = -1;
+}
+
+static void
+ring_open(IoRing* r)
+{
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params p = {0};
+  r->fd = syscall(__NR_io_uring_setup, IO_DEPTH, &p);
+  if (r->fd < 0)
+    return;
+  /* Both features date from 5.7, which has every opcode used here. */
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+    close(r->fd);
+    r->fd = -1;
+    return;
+  }
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->ring_len   = sq_len > cq_len ? sq_len : cq_len;
+  r->sqe_len    = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->ring_map   = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                       IORING_OFF_SQ_RING);
+  r->sqes = mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->ring_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->ring_map != MAP_FAILED)
+      munmap(r->ring_map, r->ring_len);
+    if (r->sqes != MAP_FAILED)
+      munmap(r->sqes, r->sqe_len);
+    close(r->fd);
+    r->fd = -1;
+    return;
+  }
+
+  char* m     = r->ring_map;
+  r->sq_tail  = (unsigned*)(m + p.sq_off.tail);
+  r->sq_mask  = (unsigned*)(m + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(m + p.sq_off.array);
+  r->cq_head  = (unsigned*)(m + p.cq_off.head);
+  r->cq_tail  = (unsigned*)(m + p.cq_off.tail);
+  r->cq_mask  = (unsigned*)(m + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe*)(m + p.cq_off.cqes);
+  r->tail     = *r->sq_tail;
+}
+
+// The next free SQE, cleared and tagged with 'tag'. At most IO_DEPTH per round.
+static struct io_uring_sqe*
+ring_sqe(IoRing* r, size_t tag)
+{
+  unsigned idx             = r->tail++ & *r->sq_mask;
+  struct io_uring_sqe* sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data   = tag;
+  r->sq_array[idx] = idx;
+  r->queued++;
+  return sqe;
+}
+
+//
+// Submit the queued SQEs and wait for all of them, storing each result in
+// res[tag]. Returns -1 if the ring failed with nothing left in flight; the
+// caller then closes it and redoes the round without.
+//
+static int
+ring_wait(IoRing* r, int32_t* res)
+{
+  unsigned n = r->queued, submitted = 0, done = 0;
+  int broken = 0;
+  r->queued  = 0;
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+
+  while (done < n) {
+    unsigned submit = broken ? 0 : n - submitted;
+    int k = syscall(__NR_io_uring_enter, r->fd, submit, broken ? 1 : n - done, IORING_ENTER_GETEVENTS,
+                    NULL, 0);
+    if (k < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      if (done == submitted)
+        return -1;
+      broken = 1; /* drain what is in flight, submit nothing more */
+    }
+    if (k > 0)
+      submitted += k;
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, done++) {
+      const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+      res[cqe->user_data]            = cqe->res;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    if (broken && done == submitted)
+      return -1;
+  }
+  return 0;
+}
+
+static unsigned char
+mode_type(mode_t mode)
+{
+  return S_ISDIR(mode) ? DT_DIR : S_ISLNK(mode) ? DT_LNK : S_ISREG(mode) ? DT_REG : DT_UNKNOWN;
+}
+
+typedef struct {
+  int dfd;
+  DirFile** files;
+  int follow;
+} StatBatch;
+
+static void
+stat_range(void* arg, size_t begin, size_t end)
+{
+  StatBatch* b = arg;
+  for (size_t k = begin; k < end; k++) {
+    DirFile* f = b->files[k];
+    struct stat st;
+    if (fstatat(b->dfd, f->name, &st, b->follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+      f->type = DT_UNKNOWN;
+      f->ino  = 0;
+      continue;
+    }
+    f->type     = mode_type(st.st_mode);
+    f->ino      = st.st_ino;
+    f->dev      = io_device(st.st_dev);
+    f->size     = (uint64_t)st.st_size;
+    f->mtime_ns = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+  }
+}
+
+static int
+stat_ring(IoRing* r, const StatBatch* b, size_t n)
+{
+  struct statx* stx = malloc(sizeof(struct statx) * IO_DEPTH);
+  int32_t res[IO_DEPTH];
+  if (!stx)
+    return -1;
+  for (size_t base = 0; base < n; base += IO_DEPTH) {
+    size_t m = n - base < IO_DEPTH ? n - base : IO_DEPTH;
+    for (size_t k = 0; k < m; k++) {
+      struct io_uring_sqe* sqe = ring_sqe(r, k);
+      sqe->opcode              = IORING_OP_STATX;
+      sqe->fd                  = b->dfd;
+      sqe->addr                = (uintptr_t)b->files[base + k]->name;
+      sqe->len                 = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME;
+      sqe->off                 = (uintptr_t)&stx[k];
+      sqe->statx_flags         = b->follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    }
+    if (ring_wait(r, res) != 0) {
+      free(stx);
+      return -1;
+    }
+    for (size_t k = 0; k < m; k++) {
+      DirFile* f = b->files[base + k];
+      f->type    = res[k] == 0 ? mode_type(stx[k].stx_mode) : DT_UNKNOWN;
+      f->ino     = 0;
+      if (res[k] == 0) {
+        f->ino      = stx[k].stx_ino;
+        f->dev      = io_device(makedev(stx[k].stx_dev_major, stx[k].stx_dev_minor));
+        f->size     = stx[k].stx_size;
+        f->mtime_ns = stx[k].stx_mtime.tv_sec * 1000000000ll + stx[k].stx_mtime.tv_nsec;
+      }
+    }
+  }
+  free(stx);
+  return 0;
+}
+
+//
+// Stat the entries of 'files' whose type is 'which', following symlinks if
+// 'follow', and leave pointers to them in 'sel'. Afterwards their type is
+// what they turned out to be, or DT_UNKNOWN if they could not be stat-ed.
+// Returns how many there were.
+//
+static size_t
+stat_files(IoRing* r, int dfd, DirFile* files, size_t n, unsigned char which, int follow,
+           DirFile** sel)
+{
+  size_t m = 0;
+  for (size_t k = 0; k < n; k++)
+    if (files[k].type == which)
+      sel[m++] = &files[k];
+  if (!m)
+    return 0;
+
+  StatBatch b = {dfd, sel, follow};
+  if (r->fd >= 0 && stat_ring(r, &b, m) == 0)
+    return m;
+  ring_close(r);
+  io_parallel(m, stat_range, &b);
+  return m;
+}
+
+typedef struct {
+  int dfd;
+  DirFile* files;
+} SniffBatch;
+
+static void
+sniff_range(void* arg, size_t begin, size_t end)
+{
+  SniffBatch* b = arg;
+  for (size_t k = begin; k < end; k++)
+    b->files[k].format = read_image_head(b->dfd, b->files[k].name, &b->files[k].meta);
+}
+
+//
+// Open, read and close IO_DEPTH files a round, with up to META_HOPS more
+// reads for JPEGs whose frame header lies past the head (see
+// read_image_head). A round the ring cannot finish leaves the files it did
+// open closed, for the caller to redo.
+//
+static int
+sniff_ring(IoRing* r, const SniffBatch* b, size_t n)
+{
+  unsigned char(*head)[META_HEAD] = malloc(IO_DEPTH * META_HEAD);
+  int32_t fds[IO_DEPTH], got[IO_DEPTH], closed[IO_DEPTH];
+  size_t next[IO_DEPTH];
+  if (!head)
+    return -1;
+  for (size_t base = 0; base < n; base += IO_DEPTH) {
+    size_t m = n - base < IO_DEPTH ? n - base : IO_DEPTH;
+    for (size_t k = 0; k < m; k++) {
+      struct io_uring_sqe* sqe = ring_sqe(r, k);
+      sqe->opcode              = IORING_OP_OPENAT;
+      sqe->fd                  = b->dfd;
+      sqe->addr                = (uintptr_t)b->files[base + k].name;
+      sqe->open_flags          = O_RDONLY | O_CLOEXEC | O_NOCTTY;
+      fds[k]                   = -1;
+    }
+    int ok = ring_wait(r, fds) == 0;
+
+    for (size_t k = 0; ok && k < m; k++) {
+      got[k] = -1;
+      if (fds[k] < 0)
+        continue;
+      struct io_uring_sqe* sqe = ring_sqe(r, k);
+      sqe->opcode              = IORING_OP_READ;
+      sqe->fd                  = fds[k];
+      sqe->addr                = (uintptr_t)head[k];
+      sqe->len                 = META_HEAD;
+    }
+    ok = ok && ring_wait(r, got) == 0;
+
+    for (size_t k = 0; ok && k < m; k++) {
+      DirFile* f = &b->files[base + k];
+      f->format  = fds[k] >= 0 && got[k] > 0 ? sniff_format(head[k], got[k]) : FMT_UNKNOWN;
+      next[k]    = f->format != FMT_UNKNOWN ? image_meta(head[k], got[k], f->format, &f->meta) : 0;
+    }
+    for (int hop = 0, more = 1; ok && more && hop < META_HOPS; hop++) {
+      more = 0;
+      for (size_t k = 0; k < m; k++) {
+        got[k] = -1;
+        if (!next[k])
+          continue;
+        struct io_uring_sqe* sqe = ring_sqe(r, k);
+        sqe->opcode              = IORING_OP_READ;
+        sqe->fd                  = fds[k];
+        sqe->addr                = (uintptr_t)head[k];
+        sqe->len                 = META_HEAD;
+        sqe->off                 = next[k];
+        more                     = 1;
+      }
+      ok = !more || ring_wait(r, got) == 0;
+      for (size_t k = 0; ok && k < m; k++) {
+        if (!next[k])
+          continue;
+        size_t rel = got[k] > 0 ? jpeg_meta(head[k], got[k], 0, &b->files[base + k].meta) : 0;
+        next[k]    = rel ? next[k] + rel : 0;
+      }
+    }
+
+    /* 1 marks a close that never went out, so nothing is closed twice. */
+    for (size_t k = 0; k < m; k++) {
+      closed[k] = 1;
+      if (ok && fds[k] >= 0) {
+        struct io_uring_sqe* sqe = ring_sqe(r, k);
+        sqe->opcode              = IORING_OP_CLOSE;
+        sqe->fd                  = fds[k];
+      }
+    }
+    ok = ok && ring_wait(r, closed) == 0;
+    if (!ok) {
+      for (size_t k = 0; k < m; k++)
+        if (fds[k] >= 0 && closed[k] == 1)
+          close(fds[k]);
+      free(head);
+      return -1;
+    }
+  }
+  free(head);
+  return 0;
+}
+
+// Sniff each of 'files', setting its format and header metadata.
+static void
+sniff_files(IoRing* r, int dfd, DirFile* files, size_t n)
+{
+  SniffBatch b = {dfd, files};
+  if (r->fd >= 0 && sniff_ring(r, &b, n) == 0)
+    return;
+  ring_close(r);
+  io_parallel(n, sniff_range, &b);
+}
+
+//
+// Each directory listed is remembered in a catalog under
+// $XDG_CACHE_HOME/iv/catalog, named for the directory's device and inode: a
+// CatHeader, the CatEntry records sorted by name, then the names. While the
+// directory's mtime is what the header says, nothing in it can have been
+// added, removed or renamed, so the scanner takes the images and
+// subdirectories straight from the mapped catalog, without listing the
+// directory or reading a single image in it. A file rewritten in place
+// leaves the directory alone, though, so the files that were not images are
+// stat-ed again, one statx each, and any change in one has the directory
+// listed as below. (An image rewritten in place while iv was not watching
+// keeps its old size, mtime and header metadata, and with them its old
+// cached thumbnail, until the directory next changes.)
+//
+// Once the mtime differs the directory is listed and stat-ed again, and only
+// the files whose inode, size or mtime changed are sniffed; the rest keep
+// the format the old catalog gives them. A directory changed within the
+// last CATALOG_SETTLE seconds is not cataloged, since another change in
+// the same clock tick would leave its mtime as it is; nor is one holding an
+// empty file or one changed that recently, which may still be being written.
+//
+
+#define CATALOG_DIR    "catalog"
+#define CATALOG_MAGIC  0x33435649u /* "IVC3" */
+#define CATALOG_SETTLE 2           /* seconds */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;    /* CatEntry records that follow */
+  uint64_t dev, ino; /* the directory's */
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t names_len; /* NUL-terminated names after the records */
+} CatHeader;
+
+typedef struct {
+  uint64_t dev, ino;    /* the file's; through a link, dev may not be the directory's */
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t taken;        /* the image's ImageMeta */
+  uint32_t width, height;
+  uint32_t name;        /* offset into the names */
+  unsigned char type;   /* DT_DIR or DT_REG */
+  unsigned char format; /* ImageFormat; FMT_UNKNOWN for other files */
+  unsigned char orient;
+  unsigned char pad;
+} CatEntry;
+
+typedef struct {
+  void* map; /* NULL if there is no catalog */
+  size_t len;
+  const CatEntry* entries;
+  size_t count;
+  const char* names;
+} Catalog;
+
+// A catalog being written; its entries are sorted when it is saved.
+typedef struct {
+  CatEntry* entries;
+  size_t count, cap;
+  char* names;
+  size_t names_len, names_cap;
+} CatBuild;
+
+static void
+catalog_path(char* out, size_t n, const struct stat* dir, const char* suffix)
+{
+  snprintf(out, n, "%s/%s/%llx-%llx%s", cache_dir, CATALOG_DIR, (unsigned long long)dir->st_dev,
+           (unsigned long long)dir->st_ino, suffix);
+}
+
+//
+// Map the catalog of 'dir'. Returns 1 if it is up to date, 0 if it is only
+// good for looking up files that did not change, and -1 if there is none.
+//
+static int
+catalog_open(Catalog* c, const struct stat* dir)
+{
+  char path[sizeof(cache_dir) + 64];
+  memset(c, 0, sizeof(*c));
+  catalog_path(path, sizeof(path), dir, "");
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CatHeader)) {
+    close(fd);
+    return -1;
+  }
+  c->len = st.st_size;
+  c->map = mmap(NULL, c->len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (c->map == MAP_FAILED) {
+    c->map = NULL;
+    return -1;
+  }
+
+  /* Anything that does not add up is treated as no catalog at all. */
+  const CatHeader* h = c->map;
+  c->entries         = (const CatEntry*)(h + 1);
+  c->count           = h->count;
+  c->names           = (const char*)(c->entries + c->count);
+  int ok = h->magic == CATALOG_MAGIC && h->dev == (uint64_t)dir->st_dev &&
+           h->ino == (uint64_t)dir->st_ino && h->names_len &&
+           (c->len - sizeof(CatHeader)) / sizeof(CatEntry) >= c->count &&
+           c->len - sizeof(CatHeader) - c->count * sizeof(CatEntry) == h->names_len &&
+           c->names[h->names_len - 1] == '\0';
+  for (size_t k = 0; ok && k < c->count; k++)
+    ok = c->entries[k].name < h->names_len;
+  if (!ok) {
+    munmap(c->map, c->len);
+    c->map = NULL;
+    return -1;
+  }
+  return h->mtime_sec == dir->st_mtim.tv_sec && h->mtime_nsec == dir->st_mtim.tv_nsec;
+}
+
+static void
+catalog_close(Catalog* c)
+{
+  if (c->map)
+    munmap(c->map, c->len);
+}
+
+// The entry for 'name', or NULL.
+static const CatEntry*
+catalog_find(const Catalog* c, const char* name)
+{
+  size_t lo = 0, hi = c->map ? c->count : 0;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp    = strcmp(c->names + c->entries[mid].name, name);
+    if (cmp == 0)
+      return &c->entries[mid];
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+static void
+catalog_add(CatBuild* b, const char* name, unsigned char type, const DirFile* f)
+{
+  size_t len = strlen(name) + 1;
+  if (b->count == b->cap) {
+    b->cap     = b->cap ? b->cap * 2 : 256;
+    b->entries = realloc(b->entries, sizeof(CatEntry) * b->cap);
+  }
+  if (b->names_len + len > b->names_cap) {
+    b->names_cap = (b->names_len + len) * 2;
+    b->names     = realloc(b->names, b->names_cap);
+  }
+  if (!b->entries || !b->names) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  CatEntry* e = &b->entries[b->count++];
+  *e          = (CatEntry){0};
+  e->name     = (uint32_t)b->names_len;
+  e->type     = type;
+  if (f) {
+    e->dev      = io_device_dev(f->dev);
+    e->ino      = f->ino;
+    e->size     = f->size;
+    e->mtime_ns = f->mtime_ns;
+    e->format   = f->format;
+    e->taken    = f->meta.taken;
+    e->width    = f->meta.w;
+    e->height   = f->meta.h;
+    e->orient   = (unsigned char)f->meta.orient;
+  }
+  memcpy(b->names + b->names_len, name, len);
+  b->names_len += len;
+}
+
+static int
+catalog_entry_cmp(const void* a, const void* b, void* names)
+{
+  return strcmp((const char*)names + ((const CatEntry*)a)->name,
+                (const char*)names + ((const CatEntry*)b)->name);
+}
+
+// Save 'b' as the catalog of 'dir', replacing the old one in one rename.
+static void
+catalog_save(CatBuild* b, const struct stat* dir)
+{
+  time_t settled = time(NULL) - CATALOG_SETTLE;
+  if (dir->st_mtim.tv_sec > settled || !b->names_len || b->names_len > UINT32_MAX ||
+      b->count > UINT32_MAX)
+    return;
+  for (size_t k = 0; k < b->count; k++)
+    if (b->entries[k].type == DT_REG &&
+        (!b->entries[k].size || b->entries[k].mtime_ns / 1000000000 > settled))
+      return;
+  qsort_r(b->entries, b->count, sizeof(CatEntry), catalog_entry_cmp, b->names);
+
+  char path[sizeof(cache_dir) + 64], tmp[sizeof(path) + 32], suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.%ld", (int)getpid(), (long)syscall(SYS_gettid));
+  catalog_path(path, sizeof(path), dir, "");
+  catalog_path(tmp, sizeof(tmp), dir, suffix);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+  CatHeader h = {CATALOG_MAGIC, (uint32_t)b->count, dir->st_dev, dir->st_ino,
+                 dir->st_mtim.tv_sec, dir->st_mtim.tv_nsec, b->names_len};
+  FILE* f     = fdopen(fd, "w");
+  int ok      = f && fwrite(&h, sizeof(h), 1, f) == 1 &&
+           fwrite(b->entries, sizeof(CatEntry), b->count, f) == b->count &&
+           fwrite(b->names, 1, b->names_len, f) == b->names_len;
+  if (f)
+    ok = fclose(f) == 0 && ok;
+  else
+    close(fd);
+  if (!ok || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
+// Whether the files an up-to-date catalog holds to be no image are still as it says.
+static int
+catalog_settled(const Catalog* c, int dfd)
+{
+  for (size_t k = 0; k < c->count; k++) {
+    const CatEntry* e = &c->entries[k];
+    const char* name  = c->names + e->name;
+    if (e->type != DT_REG || e->format != FMT_UNKNOWN || archive_name(name, strlen(name)))
+      continue;
+    struct stat st;
+    if (fstatat(dfd, name, &st, 0) != 0 || (uint64_t)st.st_ino != e->ino ||
+        (uint64_t)st.st_size != e->size ||
+        st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec != e->mtime_ns)
+      return 0;
+  }
+  return 1;
+}
+
+// Queue the subdirectories and emit the images an up-to-date catalog lists; 'dev' is the directory's.
+static int
+catalog_emit(const Catalog* c, char* fullpath, size_t plen, size_t cap, uint32_t group,
+             dev_t dev, Scanner* sc, int walker)
+{
+  uint32_t id = io_device(dev);
+  for (size_t k = 0; k < c->count; k++) {
+    const CatEntry* e = &c->entries[k];
+    const char* name  = c->names + e->name;
+    size_t nlen       = strlen(name);
+    if (plen + nlen >= cap)
+      continue;
+    memcpy(fullpath + plen, name, nlen + 1);
+    if (e->type == DT_DIR || (e->format == FMT_UNKNOWN && archive_name(name, nlen))) {
+      if (walker >= 0)
+        walk_push(sc, walker, fullpath, group);
+    } else if (e->format != FMT_UNKNOWN) {
+      uint32_t edev = e->dev == dev ? id : e->dev ? io_device(e->dev) : 0;
+      ScanItem item = {group, edev, e->ino, e->size, e->mtime_ns / 1000000000,
+                       {e->taken, e->width, e->height, e->orient, e->format}, KEY_STAT | KEY_META};
+      if (scan_emit(sc, &item, fullpath, plen + nlen) != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+//
+// Load all image files from a directory (skip hidden and non-images).
+//
+// An up-to-date catalog answers without reading the directory at all, once
+// the files it holds to be no image are found unchanged.
+// Otherwise entries are read straight from getdents64() in DIRENT_BUF
+// batches, and d_type decides what is a regular file. The files of each
+// batch are stat-ed relative to the directory, so the kernel does not walk
+// the full path again, with symlinks followed to what they point at. Those
+// the old catalog does not know unchanged are then sniffed, in inode order
+// on a spinning disk, and the images passed to the scanner tagged with
+// 'group'; subdirectories, and files named like archives, are queued for
+// 'walker' unless it is -1.
+//
+
+static int
+dirfile_cmp(const void* a, const void* b)
+{
+  const DirFile *x = a, *y = b;
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int
+load_images_from_dir(int dfd, const char* dir_path, uint32_t group, Scanner* sc, int walker,
+                     IoRing* ring)
+{
+  char* buf = malloc(DIRENT_BUF);
+  /* A dirent64 takes at least 24 bytes, which bounds the files per batch. */
+  DirFile* files = malloc(sizeof(DirFile) * (DIRENT_BUF / 24));
+  DirFile** sel  = malloc(sizeof(DirFile*) * (DIRENT_BUF / 24));
+  struct stat dst;
+  Catalog cat    = {0};
+  CatBuild fresh = {0};
+  int ret        = -1;
+  if (!buf || !files || !sel || fstat(dfd, &dst) != 0)
+    goto out;
+  uint32_t dev = io_device(dst.st_dev);
+
+  char fullpath[4096];
+  size_t plen = strlen(dir_path);
+  const char* fmt = plen && dir_path[plen - 1] == '/' ? "%s" : "%s/";
+  plen            = snprintf(fullpath, sizeof(fullpath), fmt, dir_path);
+  if (plen >= sizeof(fullpath))
+    goto out;
+
+  if (catalog_open(&cat, &dst) == 1 && catalog_settled(&cat, dfd)) {
+    catalog_emit(&cat, fullpath, plen, sizeof(fullpath), group, dst.st_dev, sc, walker);
+    ret = 0;
+    goto out;
+  }
+
+  ssize_t n = 0;
+  while (!scan_stopping(sc) && (n = getdents64(dfd, buf, DIRENT_BUF)) > 0) {
+    size_t nfiles = 0;
+    for (ssize_t off = 0; off < n;) {
+      struct dirent64* de = (struct dirent64*)(buf + off);
+      off += de->d_reclen;
+      if (de->d_name[0] == '.') {
+        /* skip hidden, ., .. */
+        continue;
+      }
+      size_t nlen = strlen(de->d_name);
+      if (plen + nlen >= sizeof(fullpath))
+        continue;
+
+      if (de->d_type == DT_DIR) {
+        catalog_add(&fresh, de->d_name, DT_DIR, NULL);
+        if (walker >= 0) {
+          memcpy(fullpath + plen, de->d_name, nlen + 1);
+          walk_push(sc, walker, fullpath, group);
+        }
+      } else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+        files[nfiles++] =
+            (DirFile){.ino = de->d_ino, .dev = dev, .type = de->d_type, .name = de->d_name};
+      }
+    }
+
+    /* Settle what d_type left open, then follow links to files, but never into directories. */
+    stat_files(ring, dfd, files, nfiles, DT_REG, 0, sel);
+    size_t m = stat_files(ring, dfd, files, nfiles, DT_UNKNOWN, 0, sel);
+    for (size_t k = 0; k < m; k++) {
+      if (sel[k]->type == DT_DIR) {
+        catalog_add(&fresh, sel[k]->name, DT_DIR, NULL);
+        if (walker >= 0) {
+          memcpy(fullpath + plen, sel[k]->name, strlen(sel[k]->name) + 1);
+          walk_push(sc, walker, fullpath, group);
+        }
+      }
+    }
+    stat_files(ring, dfd, files, nfiles, DT_LNK, 1, sel);
+
+    /* Files the old catalog knows unchanged go to the back, the rest to the front. */
+    size_t todo = 0;
+    m           = 0;
+    for (size_t k = 0; k < nfiles; k++) {
+      if (files[k].type != DT_REG)
+        continue;
+      DirFile f         = files[k];
+      const CatEntry* e = catalog_find(&cat, f.name);
+      if (e && e->type == DT_REG && e->ino == f.ino && e->size == f.size &&
+          e->mtime_ns == f.mtime_ns) {
+        f.format   = e->format;
+        f.meta     = (ImageMeta){e->taken, e->width, e->height, e->orient, e->format};
+        files[m++] = f;
+      } else {
+        files[m++]     = files[todo];
+        files[todo++] = f;
+      }
+    }
+    if (io_devices.rotational[dev])
+      qsort(files, todo, sizeof(DirFile), dirfile_cmp);
+    sniff_files(ring, dfd, files, todo);
+
+    for (size_t k = 0; k < m; k++) {
+      catalog_add(&fresh, files[k].name, DT_REG, &files[k]);
+      size_t nlen = strlen(files[k].name);
+      if (files[k].format == FMT_UNKNOWN) {
+        if (walker >= 0 && archive_name(files[k].name, nlen)) {
+          memcpy(fullpath + plen, files[k].name, nlen + 1);
+          walk_push(sc, walker, fullpath, group);
+        }
+        continue;
+      }
+      memcpy(fullpath + plen, files[k].name, nlen + 1);
+      ScanItem item = {group, files[k].dev, files[k].ino, files[k].size,
+                       files[k].mtime_ns / 1000000000, files[k].meta, KEY_STAT | KEY_META};
+      if (scan_emit(sc, &item, fullpath, plen + nlen) != 0) {
+        ret = 0;
+        goto out;
+      }
+    }
+  }
+  ret = n < 0 ? -1 : 0;
+  if (n == 0 && !scan_stopping(sc))
+    catalog_save(&fresh, &dst);
+out:
+  catalog_close(&cat);
+  free(fresh.entries);
+  free(fresh.names);
+  free(buf);
+  free(files);
+  free(sel);
+  return ret;
+}
+
+//
+// Emit the images an archive holds as if it were a directory, from its
+// index. The offset of a member stands in for its inode, so a spinning
+// disk reads them front to back.
+//
+static int
+load_images_from_archive(const char* path, uint32_t group, Scanner* sc)
+{
+  Archive* a = archive_get(path, strlen(path), 1);
+  if (!a)
+    return -1;
+  char fullpath[4096];
+  size_t plen = snprintf(fullpath, sizeof(fullpath), "%s/", path);
+  if (plen >= sizeof(fullpath)) {
+    archive_put(a);
+    return -1;
+  }
+  uint32_t dev = io_device(a->st.st_dev);
+  for (size_t k = 0; k < a->count; k++) {
+    const ArcEntry* e = &a->entries[k];
+    const char* name  = a->names + e->name;
+    size_t nlen       = strlen(name);
+    if (plen + nlen >= sizeof(fullpath))
+      continue;
+    memcpy(fullpath + plen, name, nlen + 1);
+    ScanItem item = {group, dev, e->off, e->size, e->mtime,
+                     {e->taken, e->width, e->height, e->orient, e->format}, KEY_STAT | KEY_META};
+    if (scan_emit(sc, &item, fullpath, plen + nlen) != 0)
+      break;
+  }
+  archive_put(a);
+  return 0;
+}
+
+typedef struct {
+  Scanner* sc;
+  int index;
+} Walker;
+
+static void*
+walk_thread(void* arg)
+{
+  Scanner* sc = ((Walker*)arg)->sc;
+  int self    = ((Walker*)arg)->index;
+  IoRing ring;
+  ring_open(&ring);
+
+  for (;;) {
+    WalkTask t = walk_take(sc, self);
+    if (!t.dir) {
+      /* Idle until someone queues more, or every walker is idle. */
+      pthread_mutex_lock(&sc->lock);
+      while (!sc->stop && sc->walk_pending && !sc->walk_queued)
+        pthread_cond_wait(&sc->walk_cond, &sc->lock);
+      int over = sc->stop || !sc->walk_pending;
+      pthread_mutex_unlock(&sc->lock);
+      if (over)
+        break;
+      continue;
+    }
+
+    int dfd = open(t.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+      watch_add(sc->watch, t.dir, t.group);
+      load_images_from_dir(dfd, t.dir, t.group, sc, sc->recursive ? self : -1, &ring);
+      close(dfd);
+    } else if (errno == ENOTDIR) {
+      load_images_from_archive(t.dir, t.group, sc);
+    }
+    free(t.dir);
+
+    pthread_mutex_lock(&sc->lock);
+    if (--sc->walk_pending == 0)
+      pthread_cond_broadcast(&sc->walk_cond);
+    pthread_mutex_unlock(&sc->lock);
+  }
+  ring_close(&ring);
+  return NULL;
+}
+
+// List sc->roots, and with -r the trees below them, with up to SCAN_WALKERS threads.
+static void
+walk_tree(Scanner* sc)
+{
+  sc->nwalkers = sc->recursive || sc->nroots > SCAN_WALKERS ? SCAN_WALKERS : sc->nroots;
+  sc->deques   = calloc(sc->nwalkers, sizeof(WalkDeque));
+  pthread_t* threads = calloc(sc->nwalkers, sizeof(pthread_t));
+  Walker* walkers    = calloc(sc->nwalkers, sizeof(Walker));
+  if (!sc->deques || !threads || !walkers) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < sc->nwalkers; i++)
+    pthread_mutex_init(&sc->deques[i].lock, NULL);
+
+  for (int i = 0; i < sc->nroots; i++)
+    walk_push(sc, i % sc->nwalkers, sc->roots[i].dir, sc->roots[i].group);
+  int started = 0;
+  for (; started < sc->nwalkers; started++) {
+    walkers[started] = (Walker){sc, started};
+    if (pthread_create(&threads[started], NULL, walk_thread, &walkers[started]) != 0)
+      break;
+  }
+  if (started == 0)
+    walk_thread(&walkers[0]);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Anything left over was abandoned by a stop. */
+  for (int i = 0; i < sc->nwalkers; i++) {
+    WalkDeque* q = &sc->deques[i];
+    for (size_t k = 0; k < q->count; k++)
+      free(q->tasks[(q->head + k) % q->cap].dir);
+    free(q->tasks);
+    pthread_mutex_destroy(&q->lock);
+  }
+  free(sc->deques);
+  free(threads);
+  free(walkers);
+}
+
+typedef struct {
+  const char* buf;
+  const size_t* off; /* of each path in buf */
+  ScanItem* items;
+  unsigned char want;
+} PathKeys;
+
+static void
+path_keys_range(void* arg, size_t begin, size_t end)
+{
+  PathKeys* pk = arg;
+  for (size_t k = begin; k < end; k++) {
+    ScanItem* it = &pk->items[k];
+    read_keys(pk->buf + pk->off[k], pk->want, &it->mtime, &it->size, &it->meta);
+    it->keys = pk->want;
+  }
+}
+
+//
+// Pass on the non-empty NUL-terminated paths in buf[0, len), with the keys
+// sc->want reads first. Returns -1 once the scan should stop.
+//
+static int
+scan_paths(Scanner* sc, const char* buf, size_t len)
+{
+  size_t n = 0;
+  for (size_t k = 0; k < len; k++)
+    n += buf[k] == '\0' && (k == 0 || buf[k - 1] != '\0');
+  size_t* off     = malloc(sizeof(*off) * (n ? n : 1));
+  ScanItem* items = calloc(n ? n : 1, sizeof(*items));
+  if (!off || !items) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  n = 0;
+  for (size_t start = 0, end; start < len; start = end + 1) {
+    end = start + strlen(buf + start);
+    if (end > start)
+      off[n++] = start;
+  }
+  pthread_mutex_lock(&sc->lock);
+  unsigned char want = sc->want;
+  pthread_mutex_unlock(&sc->lock);
+  if (want) {
+    PathKeys pk = {buf, off, items, want};
+    io_parallel(n, path_keys_range, &pk);
+  }
+  int ret = 0;
+  for (size_t k = 0; k < n && ret == 0; k++)
+    ret = scan_emit(sc, &items[k], buf + off[k], strlen(buf + off[k]));
+  free(off);
+  free(items);
+  return ret;
+}
+
+//
+// Pass on each NUL-terminated path read from sc->list_fd, as find -print0
+// writes them; a last path without a terminator counts too. Only the keys
+// the order and the filters need are read here, so with none a million
+// paths arrive as fast as they can be read; see scan_want().
+//
+static void
+read_path_list(Scanner* sc)
+{
+  size_t cap = DIRENT_BUF, len = 0;
+  char* buf  = malloc(cap);
+  if (!buf)
+    return;
+
+  while (!scan_stopping(sc)) {
+    /* Never block for long, or a quiet producer would hold up scan_stop(). */
+    struct pollfd pfd = {sc->list_fd, POLLIN, 0};
+    int r             = poll(&pfd, 1, LIST_POLL_MS);
+    if (r < 0 && errno != EINTR)
+      break;
+    if (r <= 0)
+      continue;
+
+    /* Keep a byte spare to terminate the last path. */
+    if (len + 1 == cap) {
+      char* b = realloc(buf, cap * 2);
+      if (!b)
+        break;
+      buf = b;
+      cap *= 2;
+    }
+    ssize_t n = read(sc->list_fd, buf + len, cap - len - 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n <= 0) {
+      if (len) {
+        buf[len] = '\0';
+        scan_paths(sc, buf, len + 1);
+      }
+      break;
+    }
+
+    /* Everything up to the last terminator goes in one batch. */
+    len += n;
+    char* z      = memrchr(buf, '\0', len);
+    size_t start = z ? (size_t)(z - buf) + 1 : 0;
+    if (start && scan_paths(sc, buf, start) != 0)
+      break;
+    memmove(buf, buf + start, len - start);
+    len -= start;
+  }
+  free(buf);
+}
+
+static void*
+scan_thread(void* arg)
+{
+  Scanner* sc = arg;
+  if (sc->list_fd >= 0)
+    read_path_list(sc);
+  else
+    walk_tree(sc);
+
+  pthread_mutex_lock(&sc->lock);
+  sc->done = 1;
+  pthread_mutex_unlock(&sc->lock);
+  if (write(sc->wake_fd[1], "", 1) < 0 && errno != EAGAIN)
+    perror("write");
+  return NULL;
+}
+
+//
+// Start listing the 'nroots' directories (or archives) in 'roots', and with
+// 'recursive' everything below them, in the background, adding each
+// directory to 'watch' first; no roots gives a scanner that is already
+// done. The scanner takes over the roots' paths. Fails if a root cannot be
+// opened, and then leaves the name of the first one that could not in 'bad'.
+//
+static int
+scan_start(Scanner* sc, WalkTask* roots, int nroots, int recursive, Watcher* watch,
+           const char** bad)
+{
+  memset(sc, 0, sizeof(*sc));
+  pthread_mutex_init(&sc->lock, NULL);
+  pthread_cond_init(&sc->walk_cond, NULL);
+  sc->recursive = recursive;
+  sc->list_fd   = -1;
+  sc->wake_fd[0] = sc->wake_fd[1] = -1;
+  sc->done = sc->finished = 1;
+  sc->roots  = roots;
+  sc->nroots = nroots;
+  if (!nroots)
+    return 0;
+
+  for (int i = 0; i < nroots; i++) {
+    int dfd = open(roots[i].dir, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (dfd < 0) {
+      *bad = roots[i].dir;
+      return -1;
+    }
+    close(dfd);
+  }
+  if (pipe2(sc->wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+  sc->watch = watch;
+  sc->done = sc->finished = 0;
+  sc->started = pthread_create(&sc->thread, NULL, scan_thread, sc) == 0;
+  return sc->started ? 0 : -1;
+}
+
+//
+// Start reading a -0 path list from 'fd' in the background, with the 'want'
+// keys of each path; the scanner owns 'fd'.
+//
+static int
+scan_start_list(Scanner* sc, int fd, unsigned char want)
+{
+  scan_start(sc, NULL, 0, 0, NULL, NULL);
+  sc->list_fd = fd;
+  sc->want    = want;
+  if (pipe2(sc->wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+  sc->done = sc->finished = 0;
+  sc->started = pthread_create(&sc->thread, NULL, scan_thread, sc) == 0;
+  return sc->started ? 0 : -1;
+}
+
+// Have a -0 scanner read the 'want' keys too for the paths still to come.
+static void
+scan_want(Scanner* sc, unsigned char want)
+{
+  pthread_mutex_lock(&sc->lock);
+  sc->want |= want;
+  pthread_mutex_unlock(&sc->lock);
+}
+
+typedef struct {
+  ScanItem item;
+  size_t off; /* of the path in the batch */
+} Taken;
+
+static int
+taken_cmp(const void* a, const void* b)
+{
+  const Taken *x = a, *y = b;
+  if (x->item.group != y->item.group)
+    return x->item.group < y->item.group ? -1 : 1;
+  return x->off < y->off ? -1 : x->off > y->off;
+}
+
+//
+// Add everything found since the last call to the list, each path in its
+// place within its group, and return the first cell that changed. Sets
+// 'finished' once the scan is over and nothing more will arrive.
+//
+static size_t
+scan_take(Scanner* sc, ImageList* list)
+{
+  char drain[64];
+  while (sc->wake_fd[0] >= 0 && read(sc->wake_fd[0], drain, sizeof(drain)) > 0)
+    ;
+
+  pthread_mutex_lock(&sc->lock);
+  char* batch   = sc->batch;
+  size_t len    = sc->batch_len;
+  int done      = sc->done;
+  sc->batch     = NULL;
+  sc->batch_len = sc->batch_cap = 0;
+  pthread_mutex_unlock(&sc->lock);
+
+  /* Sort the batch by group so each group's share moves the grid once. */
+  size_t n = 0, cap = 0, from = list->view_count;
+  Taken* taken = NULL;
+  for (size_t off = 0; off < len; off += sizeof(ScanItem) + strlen(batch + off + sizeof(ScanItem)) + 1) {
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      taken = realloc(taken, sizeof(*taken) * cap);
+      if (!taken) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(&taken[n].item, batch + off, sizeof(ScanItem));
+    taken[n++].off = off + sizeof(ScanItem);
+  }
+  if (n)
+    qsort(taken, n, sizeof(*taken), taken_cmp);
+
+  for (size_t k = 0; k < n;) {
+    size_t first = list->count;
+    uint32_t g   = taken[k].item.group;
+    for (; k < n && taken[k].item.group == g; k++) {
+      /* The directory watch may have reported some of these already. */
+      if (list_find(list, batch + taken[k].off) != NOT_SHOWN)
+        continue;
+      size_t i       = new_image_entry(list, batch + taken[k].off, g);
+      list->dev[i]   = taken[k].item.dev;
+      list->ino[i]   = taken[k].item.ino;
+      list->size[i]  = taken[k].item.size;
+      list->mtime[i] = taken[k].item.mtime;
+      list_set_meta(list, i, &taken[k].item.meta);
+      list->keys[i] = taken[k].item.keys;
+    }
+    if (list->count > first) {
+      size_t p = list_show(list, first, list->count - first);
+      if (p < from)
+        from = p;
+    }
+  }
+  free(taken);
+  free(batch);
+  sc->finished = done;
+  return from;
+}
+
+static void
+scan_stop(Scanner* sc)
+{
+  pthread_mutex_lock(&sc->lock);
+  sc->stop = 1;
+  pthread_cond_broadcast(&sc->walk_cond);
+  pthread_mutex_unlock(&sc->lock);
+  if (sc->started)
+    pthread_join(sc->thread, NULL);
+  if (sc->list_fd >= 0)
+    close(sc->list_fd);
+  if (sc->wake_fd[0] >= 0) {
+    close(sc->wake_fd[0]);
+    close(sc->wake_fd[1]);
+  }
+  for (int i = 0; i < sc->nroots; i++)
+    free(sc->roots[i].dir);
+  free(sc->roots);
+  free(sc->batch);
+  pthread_cond_destroy(&sc->walk_cond);
+  pthread_mutex_destroy(&sc->lock);
+}
+
+//
+// Add the files among 'paths' to the list, and return the directories and
+// archives for the scanner in 'roots'. Each argument is a group of its own,
+// so the grid shows them in the order given. Returns the number of roots.
+//
+static int
+load_images_from_argv(int count, char** paths, ImageList* list, WalkTask** roots)
+{
+  int nroots = 0;
+  *roots     = NULL;
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    int root = stat(paths[i], &st) == 0 &&
+               (S_ISDIR(st.st_mode) || (S_ISREG(st.st_mode) && is_archive(paths[i])));
+    if (!root) {
+      add_image_entry(list, paths[i], i);
+      continue;
+    }
+    WalkTask* r = realloc(*roots, sizeof(WalkTask) * (nroots + 1));
+    if (!r || !(r[nroots].dir = strdup(paths[i]))) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    r[nroots++].group = i;
+    *roots            = r;
+  }
+  return nroots;
+}
+
+
+/* -------------------- THUMBNAIL CACHE -------------------- */
+
+//
+// Rendered images are kept across runs in one append-only pack file in the
+// cache directory. Each record is a PNG behind a header naming what it was
+// made from: a hash of the original's absolute path and the rendered size,
+// plus the original's size and mtime at the time. The pack is mmap'd and
+// indexed once at startup, after which a lookup is a hash probe. Kitty reads
+// the PNGs straight out of the pack (t=f with O= and S=), so nothing is ever
+// extracted.
+//
+// When an image changes, its new rendering supersedes the old record. Dead
+// records are dropped by compacting the pack at startup once they outweigh
+// the live ones, but only if no other iv is running: each process holds a
+// shared flock() on PACK_LOCK, and compaction needs it exclusively.
+//
+// The live records are kept under a byte cap by a background thread (see
+// pack_gc) that evicts the least recently used ones. Each header records
+// when its image was last shown, but that is only written back at exit, so
+// another iv running at the same time may be showing a record this one
+// takes for unused. Evicted and superseded records are therefore only
+// marked dead, which later scans heed and indexes already built ignore;
+// their data is punched out of the file, freeing the disk space, only
+// while no other iv has the pack open. Each process holds an OFD read lock
+// on the first byte of PACK_LOCK for that; punching takes it for writing,
+// which, unlike a flock() upgrade, keeps the read lock when it fails. Until
+// then the pack may outgrow its cap on disk.
+//
+// Images that cannot be rendered get an empty PACK_FAIL record under the same
+// key, so sidecar files and corrupt images are not retried on every launch;
+// touching the file changes its key and gives it another try.
+//
+
+#define PACK_FILE        "thumbs.pack"
+#define PACK_LOCK        "thumbs.lock"
+#define PACK_MAGIC       0x32545649u /* "IVT2" */
+#define PACK_FAIL        0x46545649u /* "IVTF" */
+#define PACK_DEAD        0x44545649u /* "IVTD" */
+#define PACK_COMPACT_MIN (8u << 20)  /* dead bytes worth a rewrite */
+#define PACK_GC_LOW      90          /* evict down to this % of the cap */
+#define PACK_GC_RETRY    30          /* seconds between tries to punch out dead records */
+
+typedef struct {
+  uint64_t off; /* of the PNG within the pack */
+  uint32_t len;
+} PackRef;
+
+typedef struct {
+  uint64_t h1, h2; /* hash of the original's absolute path and the rendered size */
+  int64_t size;    /* the original's size and mtime when it was rendered */
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} PackKey;
+
+typedef struct {
+  uint32_t magic; /* PACK_MAGIC or PACK_FAIL; PACK_DEAD once superseded or evicted */
+  uint32_t len;   /* PNG bytes that follow, before padding to 8; 0 for PACK_FAIL */
+  PackKey key;
+  int64_t last_used; /* time() when last displayed */
+} PackRecord;
+
+typedef struct {
+  PackKey key;
+  PackRef ref; /* off == 0 => empty slot; len == 0 => known failure */
+  int64_t last_used;
+  int touched; /* used this run; written back by cache_close() */
+} PackSlot;
+
+static char fdo_dir[4096]; /* freedesktop.org thumbnails, see fdo_render() */
+
+static struct {
+  pthread_mutex_t lock; /* index and appends; workers share the pack */
+  char path[4096 + 32];
+  char* b64path; /* for the kitty escapes */
+  int fd, lock_fd;
+  unsigned char* map;
+  size_t map_len;
+  PackSlot* slots; /* open addressing on key.h1 */
+  size_t nslots, used;
+  uint64_t live, dead; /* bytes, headers included */
+  int64_t now;         /* time() at startup, stamped on everything used */
+
+  /* Background eviction, see pack_gc(). */
+  uint64_t cap;
+  PackRef* doomed; /* records to mark dead and punch out; off is the header's */
+  size_t doomed_count, doomed_cap;
+  pthread_cond_t gc_wake;
+  pthread_t gc_thread;
+  int gc_running, gc_stop, gc_pending;
+} pack = {.lock = PTHREAD_MUTEX_INITIALIZER, .gc_wake = PTHREAD_COND_INITIALIZER,
+          .fd = -1, .lock_fd = -1};
+
+static char* b64encode_path(const char* path);
+
+static size_t
+record_size(uint32_t len)
+{
+  return sizeof(PackRecord) + ((len + 7) & ~(size_t)7);
+}
+
+static PackSlot*
+pack_find(uint64_t h1, uint64_t h2)
+{
+  size_t mask = pack.nslots - 1;
+  for (size_t i = h1 & mask;; i = (i + 1) & mask) {
+    PackSlot* s = &pack.slots[i];
+    if (s->ref.off == 0 || (s->key.h1 == h1 && s->key.h2 == h2))
+      return s;
+  }
+}
+
+// Delete a slot, shifting later members of its probe run back into the gap.
+static void
+pack_remove(PackSlot* s)
+{
+  size_t mask = pack.nslots - 1;
+  size_t i    = s - pack.slots;
+  pack.live -= record_size(s->ref.len);
+  pack.used--;
+  for (size_t j = (i + 1) & mask; pack.slots[j].ref.off; j = (j + 1) & mask) {
+    size_t home = pack.slots[j].key.h1 & mask;
+    /* Move j back to i unless its home lies cyclically in (i, j]. */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      pack.slots[i] = pack.slots[j];
+      i             = j;
+    }
+  }
+  memset(&pack.slots[i], 0, sizeof(PackSlot));
+}
+
+// Queue a record for pack_gc() to mark dead and punch out.
+static void
+pack_doom(PackRef ref)
+{
+  if (pack.doomed_count == pack.doomed_cap) {
+    size_t cap = pack.doomed_cap ? pack.doomed_cap * 2 : 64;
+    PackRef* d = realloc(pack.doomed, sizeof(PackRef) * cap);
+    if (!d)
+      return; /* the next compaction reclaims it anyway */
+    pack.doomed     = d;
+    pack.doomed_cap = cap;
+  }
+  pack.doomed[pack.doomed_count++] = (PackRef){ref.off - sizeof(PackRecord), ref.len};
+}
+
+// Index a record, superseding any older one for the same image and size.
+static void
+pack_insert(const PackKey* key, PackRef ref, int64_t last_used)
+{
+  if ((pack.used + 1) * 10 >= pack.nslots * 7) {
+    size_t old_n   = pack.nslots;
+    PackSlot* old  = pack.slots;
+    pack.nslots    = old_n ? old_n * 2 : 1024;
+    pack.slots     = calloc(pack.nslots, sizeof(PackSlot));
+    if (!pack.slots) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_n; i++)
+      if (old[i].ref.off)
+        *pack_find(old[i].key.h1, old[i].key.h2) = old[i];
+    free(old);
+  }
+
+  PackSlot* s = pack_find(key->h1, key->h2);
+  if (s->ref.off) {
+    pack.live -= record_size(s->ref.len);
+    pack.dead += record_size(s->ref.len);
+    pack_doom(s->ref);
+  } else {
+    pack.used++;
+  }
+  s->key       = *key;
+  s->ref       = ref;
+  s->last_used = last_used;
+  s->touched   = 0;
+  pack.live += record_size(ref.len);
+}
+
+// Index every record in the mapping; returns where the intact ones end.
+static size_t
+pack_scan(void)
+{
+  size_t off = 0;
+  while (off + sizeof(PackRecord) <= pack.map_len) {
+    PackRecord rec;
+    memcpy(&rec, pack.map + off, sizeof(rec));
+    int known = rec.magic == PACK_MAGIC || rec.magic == PACK_FAIL || rec.magic == PACK_DEAD;
+    if (!known || (rec.magic == PACK_MAGIC && rec.len == 0) ||
+        record_size(rec.len) > pack.map_len - off)
+      break;
+    if (rec.magic != PACK_DEAD)
+      pack_insert(&rec.key, (PackRef){off + sizeof(PackRecord), rec.len}, rec.last_used);
+    else
+      pack.dead += record_size(rec.len);
+    off += record_size(rec.len);
+  }
+  return off;
+}
+
+static int
+pack_map(void)
+{
+  struct stat st;
+  if (fstat(pack.fd, &st) != 0)
+    return -1;
+  pack.map_len = st.st_size;
+  pack.map     = NULL;
+  if (pack.map_len) {
+    pack.map = mmap(NULL, pack.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, pack.fd, 0);
+    if (pack.map == MAP_FAILED)
+      return -1;
+  }
+  return 0;
+}
+
+//
+// Rewrite the pack with only the live records. The caller holds PACK_LOCK
+// exclusively, so nobody else has offsets into the old file.
+//
+static int
+pack_compact(void)
+{
+  char tmp[sizeof(pack.path) + 8];
+  snprintf(tmp, sizeof(tmp), "%s.new", pack.path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+
+  FILE* f    = fdopen(fd, "w");
+  uint64_t o = 0;
+  for (size_t i = 0; f && i < pack.nslots; i++) {
+    PackSlot* s = &pack.slots[i];
+    if (!s->ref.off)
+      continue;
+    size_t n = record_size(s->ref.len);
+    if (fwrite(pack.map + s->ref.off - sizeof(PackRecord), 1, n, f) != n)
+      break;
+    s->ref.off = o + sizeof(PackRecord);
+    o += n;
+  }
+  if (!f || o != pack.live || fflush(f) != 0 || fsync(fd) != 0 || rename(tmp, pack.path) != 0) {
+    /* The slots may already point into the new file; rebuild from the old. */
+    if (f)
+      fclose(f);
+    else
+      close(fd);
+    remove(tmp);
+    memset(pack.slots, 0, pack.nslots * sizeof(PackSlot));
+    pack.used = pack.live = pack.dead = pack.doomed_count = 0;
+    pack_scan();
+    return -1;
+  }
+
+  munmap(pack.map, pack.map_len);
+  close(pack.fd);
+  pack.fd   = dup(fd);
+  pack.dead = pack.doomed_count = 0;
+  fclose(f);
+  return pack.fd < 0 ? -1 : pack_map();
+}
+
+// Hold (or go back to) the read lock of a process using the pack, waiting out one punching holes.
+static void
+pack_share(void)
+{
+  struct flock fl = {.l_type = F_RDLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+  while (fcntl(pack.lock_fd, F_OFD_SETLKW, &fl) != 0 && errno == EINTR)
+    ;
+}
+
+static void
+pack_open(void)
+{
+  char lock_path[sizeof(pack.path)];
+  snprintf(pack.path, sizeof(pack.path), "%s/%s", cache_dir, PACK_FILE);
+  snprintf(lock_path, sizeof(lock_path), "%s/%s", cache_dir, PACK_LOCK);
+
+  pack.lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (pack.lock_fd < 0) {
+    fprintf(stderr, "Cannot open %s: %s\n", lock_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Only the sole user of the pack may truncate or compact it. The pack is
+   * opened once the lock is held: opened before, it could be the old file a
+   * compaction is just renaming a new one over.
+   */
+  int exclusive = flock(pack.lock_fd, LOCK_EX | LOCK_NB) == 0;
+  if (!exclusive)
+    flock(pack.lock_fd, LOCK_SH);
+  pack_share();
+  pack.fd = open(pack.path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (pack.fd < 0) {
+    fprintf(stderr, "Cannot open %s: %s\n", pack.path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (pack_map() != 0) {
+    fprintf(stderr, "Cannot map %s: %s\n", pack.path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  size_t end = pack_scan();
+  if (exclusive) {
+    /* Drop a record torn by a crash, or later appends would be unreachable. */
+    if (end < pack.map_len && ftruncate(pack.fd, end) == 0) {
+      munmap(pack.map, pack.map_len);
+      pack_map();
+    }
+    if (pack.dead > pack.live && pack.dead >= PACK_COMPACT_MIN && pack_compact() != 0)
+      fprintf(stderr, "Could not compact %s\n", pack.path);
+    flock(pack.lock_fd, LOCK_SH);
+  }
+
+  pack.b64path = b64encode_path(pack.path);
+  if (!pack.b64path) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Returns 0 if the image is in the pack, 1 if it is known not to render, -1 if unknown.
+static int
+pack_lookup(const PackKey* key, PackRef* out)
+{
+  pthread_mutex_lock(&pack.lock);
+  PackSlot* s = pack.nslots ? pack_find(key->h1, key->h2) : NULL;
+  int hit     = s && s->ref.off && s->key.size == key->size &&
+            s->key.mtime_sec == key->mtime_sec && s->key.mtime_nsec == key->mtime_nsec;
+  if (hit) {
+    *out         = s->ref;
+    s->last_used = pack.now;
+    s->touched   = 1;
+  }
+  pthread_mutex_unlock(&pack.lock);
+  return hit ? (out->len ? 0 : 1) : -1;
+}
+
+//
+// Append a record to the pack and index it; len == 0 records a failure. The
+// flock() keeps records from other iv processes appending at the same time
+// from interleaving.
+//
+static int
+pack_append(const PackKey* key, const void* data, uint32_t len, PackRef* out)
+{
+  size_t n = record_size(len);
+  unsigned char* rec = calloc(1, n);
+  if (!rec)
+    return -1;
+  PackRecord hdr = {len ? PACK_MAGIC : PACK_FAIL, len, *key, pack.now};
+  memcpy(rec, &hdr, sizeof(hdr));
+  if (len)
+    memcpy(rec + sizeof(hdr), data, len);
+
+  pthread_mutex_lock(&pack.lock);
+  flock(pack.fd, LOCK_EX);
+  off_t off = lseek(pack.fd, 0, SEEK_END);
+  size_t done = 0;
+  while (off >= 0 && done < n) {
+    ssize_t w = pwrite(pack.fd, rec + done, n - done, off + done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    done += w;
+  }
+  if (off >= 0 && done < n && ftruncate(pack.fd, off) != 0)
+    perror("ftruncate");
+  flock(pack.fd, LOCK_UN);
+
+  int rc = off >= 0 && done == n ? 0 : -1;
+  if (rc == 0) {
+    *out = (PackRef){off + sizeof(PackRecord), len};
+    pack_insert(key, *out, pack.now);
+    if (pack.doomed_count || pack.live > pack.cap) {
+      pack.gc_pending = 1;
+      pthread_cond_signal(&pack.gc_wake);
+    }
+  }
+  pthread_mutex_unlock(&pack.lock);
+  free(rec);
+  return rc;
+}
+
+//
+// Whether no other iv has the pack open, and if so keep it that way until
+// pack_share(); see the OFD lock above. Never waits.
+//
+static int
+pack_try_alone(void)
+{
+  struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+  return fcntl(pack.lock_fd, F_OFD_SETLK, &fl) == 0;
+}
+
+static int
+lru_cmp(const void* a, const void* b)
+{
+  const PackSlot* x = a;
+  const PackSlot* y = b;
+  return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+//
+// Pick least recently used records until the live ones fit in PACK_GC_LOW
+// percent of the cap. Nothing used during this run is evicted, since the
+// grid may be showing it. Called with the lock held; drops it while sorting.
+//
+static void
+pack_pick_victims(void)
+{
+  size_t n = 0;
+  PackSlot* lru = malloc(sizeof(PackSlot) * (pack.used ? pack.used : 1));
+  if (!lru)
+    return;
+  for (size_t i = 0; i < pack.nslots; i++)
+    if (pack.slots[i].ref.off && !pack.slots[i].touched && pack.slots[i].last_used < pack.now)
+      lru[n++] = pack.slots[i];
+
+  pthread_mutex_unlock(&pack.lock);
+  qsort(lru, n, sizeof(PackSlot), lru_cmp);
+  pthread_mutex_lock(&pack.lock);
+
+  uint64_t low = pack.cap / 100 * PACK_GC_LOW;
+  for (size_t i = 0; i < n && pack.live > low; i++) {
+    PackSlot* s = pack_find(lru[i].key.h1, lru[i].key.h2);
+    if (s->ref.off != lru[i].ref.off || s->touched)
+      continue; /* superseded or used while we were sorting */
+    pack.dead += record_size(s->ref.len);
+    pack_doom(s->ref);
+    pack_remove(s);
+  }
+  free(lru);
+}
+
+// Free whole blocks of a dead record's data; the header stays so scans can skip it.
+static void
+pack_punch(PackRef rec)
+{
+  off_t start = (rec.off + sizeof(PackRecord) + 4095) & ~(off_t)4095;
+  off_t end   = (rec.off + record_size(rec.len)) & ~(off_t)4095;
+  if (end > start)
+    fallocate(pack.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+}
+
+//
+// Background eviction. Waits for the pack to outgrow its cap or for records
+// to be superseded, then marks the victims dead. Their data is punched out
+// once no other iv has the pack open, tried again every PACK_GC_RETRY
+// seconds and on the way out. The index is only locked while choosing
+// victims.
+//
+static void*
+pack_gc(void* arg)
+{
+  (void)arg;
+  PackRef* holes = NULL; /* dead records whose data is still there */
+  size_t nholes = 0, holes_cap = 0;
+  pthread_mutex_lock(&pack.lock);
+  for (;;) {
+    while (!pack.gc_stop && !pack.gc_pending) {
+      if (!nholes) {
+        pthread_cond_wait(&pack.gc_wake, &pack.lock);
+        continue;
+      }
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += PACK_GC_RETRY;
+      if (pthread_cond_timedwait(&pack.gc_wake, &pack.lock, &until) == ETIMEDOUT)
+        break;
+    }
+    int stop        = pack.gc_stop;
+    pack.gc_pending = 0;
+    if (!stop && pack.live > pack.cap)
+      pack_pick_victims();
+
+    PackRef* doomed = pack.doomed;
+    size_t count    = pack.doomed_count;
+    pack.doomed     = NULL;
+    pack.doomed_count = pack.doomed_cap = 0;
+    pthread_mutex_unlock(&pack.lock);
+
+    for (size_t i = 0; i < count; i++) {
+      uint32_t magic = PACK_DEAD;
+      if (pwrite(pack.fd, &magic, sizeof(magic), doomed[i].off) != sizeof(magic))
+        continue;
+      if (nholes == holes_cap) {
+        size_t cap = holes_cap ? holes_cap * 2 : 64;
+        PackRef* h = realloc(holes, sizeof(PackRef) * cap);
+        if (!h)
+          continue; /* the next compaction reclaims it anyway */
+        holes     = h;
+        holes_cap = cap;
+      }
+      holes[nholes++] = doomed[i];
+    }
+    free(doomed);
+    if (nholes && pack_try_alone()) {
+      for (size_t i = 0; i < nholes; i++)
+        pack_punch(holes[i]);
+      nholes = 0;
+      pack_share();
+    }
+
+    pthread_mutex_lock(&pack.lock);
+    if (stop)
+      break;
+  }
+  pthread_mutex_unlock(&pack.lock);
+  free(holes);
+  return NULL;
+}
+
+// Create 'path' and any missing parents.
+static int
+mkdir_p(const char* path)
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s", path);
+  for (char* p = tmp + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir(tmp, 0700) != 0 && errno != EEXIST)
+      return -1;
+    *p = '/';
+  }
+  return mkdir(tmp, 0700) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+static void
+cache_init(uint64_t cap)
+{
+  const char* xdg  = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg && xdg[0] == '/') {
+    snprintf(cache_dir, sizeof(cache_dir), "%s/%s", xdg, CACHE_SUBDIR);
+    snprintf(fdo_dir, sizeof(fdo_dir), "%s/thumbnails", xdg);
+  } else if (home && home[0]) {
+    snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/%s", home, CACHE_SUBDIR);
+    snprintf(fdo_dir, sizeof(fdo_dir), "%s/.cache/thumbnails", home);
+  } else
+    snprintf(cache_dir, sizeof(cache_dir), "%s/%s-%d", TMP_DIR, CACHE_SUBDIR, (int)getuid());
+
+  if (mkdir_p(cache_dir) != 0) {
+    fprintf(stderr, "Cannot create cache directory %s: %s\n", cache_dir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  /* Without them directories are simply listed, and archives indexed, every time. */
+  char sub[sizeof(cache_dir) + 16];
+  snprintf(sub, sizeof(sub), "%s/%s", cache_dir, CATALOG_DIR);
+  mkdir(sub, 0700);
+  snprintf(sub, sizeof(sub), "%s/%s", cache_dir, ARCHIVE_DIR);
+  mkdir(sub, 0700);
+  pack.now = time(NULL);
+  pack.cap = cap;
+  pack_open();
+  pack.gc_pending = 1; /* whatever the scan found */
+  pack.gc_running = pthread_create(&pack.gc_thread, NULL, pack_gc, NULL) == 0;
+}
+
+//
+// Stop the eviction thread and record which images this run displayed, so
+// they count as recently used next time.
+//
+static void
+cache_close(void)
+{
+  pthread_mutex_lock(&pack.lock);
+  pack.gc_stop = 1;
+  pthread_cond_signal(&pack.gc_wake);
+  pthread_mutex_unlock(&pack.lock);
+  if (pack.gc_running)
+    pthread_join(pack.gc_thread, NULL);
+
+  for (size_t i = 0; i < pack.nslots; i++) {
+    PackSlot* s = &pack.slots[i];
+    if (!s->touched)
+      continue;
+    off_t at = s->ref.off - sizeof(PackRecord) + offsetof(PackRecord, last_used);
+    if (at + sizeof(int64_t) <= pack.map_len)
+      memcpy(pack.map + at, &pack.now, sizeof(int64_t));
+    else if (pwrite(pack.fd, &pack.now, sizeof(int64_t), at) != sizeof(int64_t))
+      break;
+  }
+}
+
+static uint64_t
+fnv1a64(const char* s, uint64_t h)
+{
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  return h;
+}
+
+// An image to render, with what the ImageList knows of it.
+typedef struct {
+  const char* path; /* as listed */
+  uint32_t group;   /* the command-line argument it came from */
+  int stat;         /* size and mtime are known, see KEY_STAT */
+  uint64_t size;
+  int64_t mtime;
+} Source;
+
+//
+// The real path of each command-line argument, taken once at startup, so
+// the absolute path of anything found under one is a matter of strings.
+// 'given' is the argument as typed, the prefix of every path listed from it.
+//
+static struct {
+  const char** given;
+  char** real; /* NULL where realpath() failed */
+  size_t count;
+  char cwd[4096];
+} abs_roots;
+
+static void
+abs_roots_init(int count, char** paths)
+{
+  if (!getcwd(abs_roots.cwd, sizeof(abs_roots.cwd)))
+    abs_roots.cwd[0] = '\0';
+  abs_roots.given = calloc(count ? count : 1, sizeof(*abs_roots.given));
+  abs_roots.real  = calloc(count ? count : 1, sizeof(*abs_roots.real));
+  if (!abs_roots.given || !abs_roots.real) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++) {
+    abs_roots.given[i] = paths[i];
+    abs_roots.real[i]  = realpath(paths[i], NULL);
+  }
+  abs_roots.count = count;
+}
+
+// Leave the absolute path of 'src' in 'abs' (4096 bytes), without a syscall. Fails if it is longer.
+static int
+abs_path(const Source* src, char* abs)
+{
+  const char* path = src->path;
+  if (src->group < abs_roots.count && abs_roots.real[src->group]) {
+    const char* given = abs_roots.given[src->group];
+    size_t n          = strlen(given);
+    const char* rest  = path + n;
+    if (strncmp(path, given, n) == 0 && (!*rest || *rest == '/' || (n && given[n - 1] == '/'))) {
+      const char* real = abs_roots.real[src->group];
+      while (*rest == '/')
+        rest++;
+      return snprintf(abs, 4096, "%s%s%s", real, *rest && real[1] ? "/" : "", rest) < 4096 ? 0 : -1;
+    }
+  }
+  if (path[0] == '/')
+    return snprintf(abs, 4096, "%s", path) < 4096 ? 0 : -1;
+  return snprintf(abs, 4096, "%s/%s", abs_roots.cwd, path) < 4096 ? 0 : -1;
+}
+
+//
+// Build the pack key for the w x h rendering of 'src', leaving its absolute
+// path in 'abs' (4096 bytes). The size and mtime are the list's, down to
+// the second; only where the scan did not read them is the file stat-ed,
+// or for an archive member its archive's index asked. Fails if neither
+// knows 'src'.
+//
+static int
+cache_key(const Source* src, int w, int h, PackKey* key, char* abs)
+{
+  uint64_t size = src->size;
+  int64_t mtime = src->mtime;
+  if (!src->stat) {
+    struct stat st;
+    Archive* a;
+    const ArcEntry* e;
+    if (stat(src->path, &st) == 0) {
+      size  = (uint64_t)st.st_size;
+      mtime = st.st_mtim.tv_sec;
+    } else if ((e = archive_member(src->path, &a))) {
+      size  = e->size;
+      mtime = e->mtime;
+      archive_put(a);
+    } else {
+      return -1;
+    }
+  }
+  if (abs_path(src, abs) != 0)
+    return -1;
+
+  char name[4096 + 32];
+  snprintf(name, sizeof(name), "%s\n%dx%d", abs, w, h);
+
+  /* Two differently seeded FNV-1a hashes make a 128-bit name. */
+  key->h1         = fnv1a64(name, 0xcbf29ce484222325ULL);
+  key->h2         = fnv1a64(name, 0x84222325cbf29ce4ULL);
+  key->size       = (int64_t)size;
+  key->mtime_sec  = mtime;
+  key->mtime_nsec = 0; /* the list keeps whole seconds */
+  return 0;
+}
+
+
+/* -------------------- FREEDESKTOP THUMBNAILS -------------------- */
+
+//
+// File managers keep thumbnails in ~/.cache/thumbnails/<size>/ named after
+// the MD5 of the original's file:// URI, with the original's mtime in a
+// Thumb::MTime text chunk (freedesktop.org Thumbnail Managing Standard).
+// When one is current and big enough, rendering from it instead of the
+// original makes a first look at such a folder almost free.
+//
+
+static const struct {
+  const char* dir;
+  int size; /* longest side a thumbnail in 'dir' is scaled to */
+} fdo_sizes[] = {{"normal", 128}, {"large", 256}, {"x-large", 512}, {"xx-large", 1024}};
+
+static void
+md5(const unsigned char* msg, size_t len, unsigned char digest[16])
+{
+  static const uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+  static const unsigned char R[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+  uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  size_t total  = (len + 8) / 64 * 64 + 64;
+  for (size_t base = 0; base < total; base += 64) {
+    /* Build each block on the fly: message, 0x80, zeros, bit length. */
+    unsigned char blk[64];
+    for (int i = 0; i < 64; i++) {
+      size_t p = base + i;
+      blk[i]   = p < len ? msg[p] : p == len ? 0x80 : 0;
+    }
+    if (base + 64 == total)
+      for (int i = 0; i < 8; i++)
+        blk[56 + i] = (unsigned char)((uint64_t)len * 8 >> (8 * i));
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (int i = 0; i < 64; i++) {
+      uint32_t f;
+      int g;
+      switch (i / 16) {
+      case 0: f = (b & c) | (~b & d); g = i; break;
+      case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+      case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+      default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+      }
+      f += a + K[i] + rd_le32(blk + 4 * g);
+      int s = R[(i / 16) * 4 + i % 4];
+      a     = d;
+      d     = c;
+      c     = b;
+      b += (f << s) | (f >> (32 - s));
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+  }
+  for (int i = 0; i < 16; i++)
+    digest[i] = (unsigned char)(h[i / 4] >> (8 * (i % 4)));
+}
+
+// The file:// URI for an absolute path, escaped the way GLib does it.
+static void
+file_uri(const char* abs, char* out, size_t outsz)
+{
+  static const char keep[] = "-._~!$&'()*+,;=:@/";
+  size_t j = snprintf(out, outsz, "file://");
+  for (const unsigned char* p = (const unsigned char*)abs; *p && j + 4 < outsz; p++) {
+    if (isalnum(*p) || strchr(keep, *p))
+      out[j++] = *p;
+    else
+      j += snprintf(out + j, outsz - j, "%%%02X", *p);
+  }
+  out[j] = '\0';
+}
+
+//
+// Check a freedesktop thumbnail: it must be a PNG whose Thumb::MTime matches
+// the original's mtime. Its dimensions are returned in *w, *h.
+//
+static int
+fdo_valid(const unsigned char* d, size_t n, int64_t mtime, int* w, int* h)
+{
+  static const unsigned char sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  if (n < 33 || memcmp(d, sig, 8) != 0 || memcmp(d + 12, "IHDR", 4) != 0)
+    return -1;
+  *w = (int)rd_be32(d + 16);
+  *h = (int)rd_be32(d + 20);
+
+  static const char key[] = "Thumb::MTime";
+  for (size_t p = 8; p + 12 <= n;) {
+    uint32_t len = rd_be32(d + p);
+    if (len > n - p - 12)
+      break;
+    const unsigned char* data = d + p + 8;
+    if (memcmp(d + p + 4, "tEXt", 4) == 0 && len > sizeof(key) &&
+        memcmp(data, key, sizeof(key)) == 0) {
+      char val[32];
+      size_t vlen = len - sizeof(key) < sizeof(val) - 1 ? len - sizeof(key) : sizeof(val) - 1;
+      memcpy(val, data + sizeof(key), vlen);
+      val[vlen] = '\0';
+      return strtoll(val, NULL, 10) == mtime ? 0 : -1;
+    }
+    if (memcmp(d + p + 4, "IEND", 4) == 0)
+      break;
+    p += 12 + len;
+  }
+  return -1; /* the spec requires Thumb::MTime */
+}
+
+//
+// Render the w x h image for 'abs' from a current freedesktop thumbnail, using
+// the smallest one that is not smaller than what we are after.
+//
+static int
+fdo_render(const char* abs, int64_t mtime, int w, int h, Buf* out)
+{
+  if (!fdo_dir[0])
+    return -1;
+
+  char uri[3 * 4096 + 8];
+  unsigned char sum[16];
+  file_uri(abs, uri, sizeof(uri));
+  md5((const unsigned char*)uri, strlen(uri), sum);
+
+  for (size_t i = 0; i < sizeof(fdo_sizes) / sizeof(fdo_sizes[0]); i++) {
+    char path[sizeof(fdo_dir) + 64];
+    int n = snprintf(path, sizeof(path), "%s/%s/", fdo_dir, fdo_sizes[i].dir);
+    for (int k = 0; k < 16; k++)
+      n += snprintf(path + n, sizeof(path) - n, "%02x", sum[k]);
+    snprintf(path + n, sizeof(path) - n, ".png");
+
+    Buf png = {0};
+    int tw, th, rc = -1;
+    if (read_file(path, &png) == 0 && fdo_valid(png.data, png.len, mtime, &tw, &th) == 0) {
+      /* Big enough if it fills the box, or if the original was too small
+         to be scaled down to this directory's size in the first place. */
+      int fills = tw >= w || th >= h;
+      int whole = tw < fdo_sizes[i].size && th < fdo_sizes[i].size;
+      if (fills || whole) {
+        out->len = 0;
+        rc       = engine_render_mem(png.data, png.len, w, h, out) == ENGINE_OK ? 0 : -1;
+      }
+    }
+    free(png.data);
+    if (rc == 0)
+      return 0;
+  }
+  return -1;
+}
+
+
+/* -------------------- THUMBNAIL & FOCUS GENERATION -------------------- */
+
+#define MAGICK_FD 3 /* where magick finds an image handed to it in memory */
+
+//
+// ImageMagick fallback for formats the engine does not handle, reading
+// 'orig', or with 'orig_fd' >= 0 the image in that descriptor, which only
+// this child gets, as MAGICK_FD. Its complaints would land on the grid, so
+// they go to /dev/null. Returns 0 on success, 1 if magick ran and could not
+// read the image either, and -1 if it did not run to the end (no magick, no
+// process, killed).
+//
+static int
+magick_run(const char* orig, int orig_fd, int max_w, int max_h, const char* out_path)
+{
+  char size[32], src[32];
+  snprintf(size, sizeof(size), "%dx%d", max_w, max_h);
+  if (orig_fd >= 0) {
+    snprintf(src, sizeof(src), "/dev/fd/%d", MAGICK_FD);
+    orig = src;
+  }
+  char* const args[] = {"magick", "convert", (char*)orig, "-resize", size, "-auto-orient",
+                        "-filter", "Lanczos", (char*)out_path, NULL};
+
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+  if (posix_spawn_file_actions_init(&fa) != 0)
+    return -1;
+  /* A dup2 onto itself clears close-on-exec too, should the memfd be MAGICK_FD already. */
+  int err = posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  if (!err && orig_fd >= 0)
+    err = posix_spawn_file_actions_adddup2(&fa, orig_fd, MAGICK_FD);
+  if (!err)
+    err = posix_spawnp(&pid, "magick", &fa, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (err)
+    return -1;
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -1;
+  if (!WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+// The same for an image in memory, which magick reads from a memfd rather than a file on disk.
+static int
+magick_render_mem(const unsigned char* d, size_t n, int max_w, int max_h, const char* out_path)
+{
+  int fd = memfd_create("iv-magick", MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int rc = -1;
+  size_t done = 0;
+  while (done < n) {
+    ssize_t w = write(fd, d + done, n - done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    done += w;
+  }
+  if (done == n)
+    rc = magick_run(NULL, fd, max_w, max_h, out_path);
+  close(fd);
+  return rc;
+}
+
+//
+// Render with the built-in engine, or with magick when it cannot decode
+// 'orig'. An archive member, which is no file, is decoded from the
+// archive's bytes. Returns 0 on success, 1 if neither can decode the image,
+// and -1 for a failure that may pass (no memory, a read error, no magick).
+//
+static int
+render_image(const char* orig, int max_w, int max_h, Buf* out)
+{
+  struct stat st;
+  const unsigned char* d;
+  size_t n;
+  unsigned char* owned = NULL;
+  int member           = stat(orig, &st) != 0 && archive_read(orig, &d, &n, &owned) == 0;
+  int rc     = member ? engine_render_mem(d, n, max_w, max_h, out)
+                      : engine_render_file(orig, max_w, max_h, out);
+  if (rc == ENGINE_UNSUPPORTED) {
+    static unsigned serial;
+    char tmp[sizeof(cache_dir) + 64];
+    snprintf(tmp, sizeof(tmp), "%s/magick.%d-%u.png", cache_dir, (int)getpid(),
+             __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+    out->len = 0;
+    int made = member ? magick_render_mem(d, n, max_w, max_h, tmp)
+                      : magick_run(orig, -1, max_w, max_h, tmp);
+    rc = made == 0 && read_file(tmp, out) == 0 ? ENGINE_OK : made == 1 ? 1 : ENGINE_ERROR;
+    remove(tmp);
+  }
+  free(owned);
+  return rc == ENGINE_OK ? 0 : rc == 1 ? 1 : -1;
+}
+
+//
+// Find the w x h rendering of 'orig' in the pack. If it is missing or stale,
+// render it, from a freedesktop thumbnail when there is a usable one, and
+// append it, or append a failure record if it cannot be decoded. A failure
+// that may pass is not recorded, so the image is tried again next time.
+//
+static int
+render_cached(const Source* src, int w, int h, PackRef* out)
+{
+  PackKey key;
+  char abs[4096];
+  if (cache_key(src, w, h, &key, abs) != 0)
+    return -1;
+  int known = pack_lookup(&key, out);
+  if (known >= 0)
+    return known == 0 ? 0 : -1;
+
+  Buf png = {0};
+  int rc  = fdo_render(abs, key.mtime_sec, w, h, &png);
+  if (rc != 0)
+    rc = render_image(src->path, w, h, &png);
+  if (rc == 0) {
+    rc = pack_append(&key, png.data, png.len, out);
+  } else if (rc == 1) {
+    PackRef failed;
+    pack_append(&key, NULL, 0, &failed); /* don't try this one again */
+    rc = -1;
+  }
+  free(png.data);
+  return rc;
+}
+
+//
+// Generate (or find in the cache) a thumbnail for 'src'. Nothing is
+// printed on failure: the grid is on screen, and the cell shows it.
+//
+static int
+generate_thumbnail(const Source* src, PackRef* thumb_out)
+{
+  return render_cached(src, THUMB_PIXEL_WIDTH, THUMB_PIXEL_HEIGHT, thumb_out);
+}
+
+// Generate (or find in the cache) a focus image of size FOCUS_WIDTH x FOCUS_HEIGHT.
+static int
+generate_focus(const Source* src, PackRef* focus_out)
+{
+  return render_cached(src, FOCUS_WIDTH, FOCUS_HEIGHT, focus_out);
+}
+
+// The Source for entry i.
+static Source
+list_source(const ImageList* list, size_t i)
 {
-  unsigned char ch;
-  int n = read(STDIN_FILENO, &ch, 1);
-  if (n == 1)
-    return ch;
-  return EOF;
+  return (Source){list->path[i], list->group[i], (list->keys[i] & KEY_STAT) != 0, list->size[i],
+                  list->mtime[i]};
 }
 
 
+/* -------------------- THUMBNAIL WORKER POOL -------------------- */
+
 //
-/* -------------------- IMAGE LOADING -------------------- */
+// Worker threads take jobs off a queue and post results back; only the main
+// thread ever writes to the ImageList, when it drains the results. Each result
+// also writes a byte to wake_fd so the UI can poll() for it next to stdin.
+//
+// The queue is not FIFO. Workers always take the job closest to the rows on
+// screen (see pool_set_view), so scrolling quickly does not leave them busy
+// with cells the user has already passed. Every JOB_AGE_STEP jobs started
+// while a job waits count as one row closer, so offscreen work still gets
+// done eventually. Jobs more than CANCEL_SCREENS screens away are dropped and
+// queued again if their row comes back into view.
+//
+// A spinning disk gets at most HDD_JOBS workers at a time, and among its
+// equally urgent jobs the next is the one at the lowest inode past the last
+// one taken, wrapping around: an elevator sweep rather than random seeks.
 //
 
-static void
-add_image_entry(ImageList* list, const char* path)
-{
-  list->entries = realloc(list->entries, sizeof(ImageEntry) * (list->count + 1));
-  if (!list->entries) {
-    fprintf(stderr, "Out of memory.\n");
-    exit(EXIT_FAILURE);
-  }
-  list->entries[list->count].original_path = strdup(path);
-  list->entries[list->count].thumb_path    = NULL;
-  list->entries[list->count].generated     = 0;
-  list->count++;
-}
+#define JOB_AGE_STEP   8
+#define CANCEL_SCREENS 3
 
-static int
-is_directory(const char* path)
+typedef struct {
+  size_t index;     /* entry in the ImageList */
+  uint32_t gen;     /* its generation when queued */
+  size_t pos;       /* its grid position, as of the last pool_set_view() */
+  Source src;       /* its path is interned in the ImageList and outlives the job */
+  uint32_t dev;     /* see io_device() */
+  uint64_t ino;
+  size_t stamp;     /* pool->started when the job was queued */
+} ThumbJob;
+
+typedef struct {
+  size_t index;
+  uint32_t gen;
+  int ok;
+  PackRef thumb;
+} ThumbResult;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* jobs queued or shutting down */
+  ThumbJob* jobs;      /* unordered; see pool_next_job() */
+  size_t job_count, job_cap;
+  size_t started;   /* jobs handed to a worker so far */
+  size_t cancelled; /* jobs dropped by pool_set_view() */
+  size_t view_first, view_last, view_selected; /* visible cells [first, last) */
+  int view_cols;
+  int dev_active[IO_MAX_DEVICES];          /* jobs running per device */
+  uint64_t dev_last_ino[IO_MAX_DEVICES];   /* inode of the latest job taken */
+  ThumbResult* results;
+  size_t result_count, result_cap;
+  int wake_fd[2];
+  int stop;
+  pthread_t* threads;
+  int nthreads;
+} ThumbPool;
+
+// How many rows grid position 'pos' lies outside the visible ones.
+static size_t
+job_distance(const ThumbPool* pool, size_t pos)
 {
-  struct stat st;
-  if (stat(path, &st) != 0)
-    return 0;
-  return S_ISDIR(st.st_mode);
+  size_t cols = pool->view_cols;
+  if (pos < pool->view_first)
+    return (pool->view_first - pos + cols - 1) / cols;
+  if (pos >= pool->view_last)
+    return (pos - pool->view_last) / cols + 1;
+  return 0;
 }
 
-// Load all regular files from a directory (skip hidden).
+//
+// Remove the most urgent job that its device has room for and return it in
+// 'job'. Returns 0 if there is none. Called with the lock held.
+//
 static int
-load_images_from_dir(const char* dir_path, ImageList* list)
+pool_next_job(ThumbPool* pool, ThumbJob* job)
 {
-  DIR* d = opendir(dir_path);
-  if (!d) {
-    perror("opendir");
-    return -1;
-  }
-  struct dirent* de;
-  while ((de = readdir(d)) != NULL) {
-    if (de->d_name[0] == '.') {
-      /* skip hidden, ., .. */
+  size_t best = SIZE_MAX, best_rank = SIZE_MAX;
+  uint64_t best_near = UINT64_MAX;
+  for (size_t i = 0; i < pool->job_count; i++) {
+    const ThumbJob* j = &pool->jobs[i];
+    int hdd           = io_devices.rotational[j->dev];
+    if (hdd && pool->dev_active[j->dev] >= HDD_JOBS)
       continue;
+    size_t dist = job_distance(pool, j->pos);
+    size_t age  = (pool->started - j->stamp) / JOB_AGE_STEP;
+    size_t rank = dist > age ? dist - age : 0;
+    /*
+     * Among equals, prefer cells near the selection, or on a spinning disk
+     * the next inode up (the subtraction wraps), then older jobs.
+     */
+    uint64_t near = hdd                          ? j->ino - pool->dev_last_ino[j->dev]
+                    : j->pos > pool->view_selected ? j->pos - pool->view_selected
+                                                   : pool->view_selected - j->pos;
+    if (rank < best_rank || (rank == best_rank && near < best_near) ||
+        (rank == best_rank && near == best_near && j->stamp < pool->jobs[best].stamp)) {
+      best      = i;
+      best_rank = rank;
+      best_near = near;
     }
-    char fullpath[4096];
-    snprintf(fullpath, sizeof(fullpath), "%s/%s", dir_path, de->d_name);
-
-    struct stat st;
-    if (stat(fullpath, &st) == 0 && S_ISREG(st.st_mode))
-      add_image_entry(list, fullpath);
   }
-  closedir(d);
-  return 0;
+
+  if (best == SIZE_MAX)
+    return 0;
+  *job             = pool->jobs[best];
+  pool->jobs[best] = pool->jobs[--pool->job_count];
+  pool->started++;
+  pool->dev_active[job->dev]++;
+  pool->dev_last_ino[job->dev] = job->ino;
+  return 1;
 }
 
-static void
-load_images_from_argv(int count, char** paths, ImageList* list)
+static void*
+thumb_worker(void* arg)
 {
-  for (int i = 0; i < count; i++)
-    add_image_entry(list, paths[i]);
-}
+  ThumbPool* pool = arg;
 
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    ThumbJob job;
+    while (!pool->stop && !pool_next_job(pool, &job))
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stop)
+      break;
+    pthread_mutex_unlock(&pool->lock);
 
-/* -------------------- THUMBNAIL & FOCUS GENERATION -------------------- */
+    ThumbResult res = {job.index, job.gen, 0, {0, 0}};
+    res.ok          = generate_thumbnail(&job.src, &res.thumb) == 0;
+
+    pthread_mutex_lock(&pool->lock);
+    /* A disk that was full may have room for a waiting worker now. */
+    if (--pool->dev_active[job.dev] == HDD_JOBS - 1 && io_devices.rotational[job.dev])
+      pthread_cond_broadcast(&pool->work);
+    if (pool->result_count == pool->result_cap) {
+      size_t cap     = pool->result_cap ? pool->result_cap * 2 : 64;
+      ThumbResult* r = realloc(pool->results, sizeof(ThumbResult) * cap);
+      if (!r) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+      pool->results    = r;
+      pool->result_cap = cap;
+    }
+    pool->results[pool->result_count++] = res;
+    if (write(pool->wake_fd[1], "", 1) < 0 && errno != EAGAIN)
+      perror("write");
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
 
-// 
-// Generate a thumbnail for 'orig' into /tmp/ with name "iv_<orig>.thumb.png".
-//
 static int
-generate_thumbnail(const char* orig, char** thumb_out)
+pool_start(ThumbPool* pool, int nthreads)
 {
-  const char* fname = strrchr(orig, '/');
-  if (!fname)
-    fname = orig;
-  else
-    fname++;
-
-  char tmp[4096];
-  snprintf(tmp, sizeof(tmp), "%s/iv_%s.thumb.png", TMP_DIR, fname);
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pool->view_cols = 1;
 
-  char cmd[8192];
-  snprintf(cmd, sizeof(cmd),
-           "magick convert \"%s\" -resize %dx%d -auto-orient -filter Lanczos \"%s\"", orig,
-           THUMB_PIXEL_WIDTH, THUMB_PIXEL_HEIGHT, tmp);
-
-  if (system(cmd) != 0) {
-    fprintf(stderr, "Failed to create thumbnail for %s\n", orig);
+  if (pipe2(pool->wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  if (!pool->threads)
     return -1;
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, thumb_worker, pool) != 0)
+      break;
+    pool->nthreads++;
   }
+  return pool->nthreads > 0 ? 0 : -1;
+}
 
-  *thumb_out = strdup(tmp);
-  if (!*thumb_out) {
-    fprintf(stderr, "Out of memory duplicating thumb path.\n");
-    return -1;
+// Queue a thumbnail for entry 'index', shown at grid position 'pos'.
+static void
+pool_submit(ThumbPool* pool, const ImageList* list, size_t index, size_t pos)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (pool->job_count == pool->job_cap) {
+    size_t cap  = pool->job_cap ? pool->job_cap * 2 : 64;
+    ThumbJob* j = realloc(pool->jobs, sizeof(ThumbJob) * cap);
+    if (!j) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    pool->jobs    = j;
+    pool->job_cap = cap;
   }
-  return 0;
+  pool->jobs[pool->job_count++] = (ThumbJob){index, list->gen[index], pos, list_source(list, index), list->dev[index], list->ino[index], pool->started};
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
 }
 
-// Generate a focus image of size FOCUS_WIDTH x FOCUS_HEIGHT.
-static int
-generate_focus(const char* orig, char** focus_out)
+//
+// Tell the workers which cells are on screen and which one is selected, and
+// cancel queued jobs that are now far out of view or whose entry has left
+// the grid. Cancelled entries go back to THUMB_NONE so they are queued again
+// when they scroll back in.
+//
+static void
+pool_set_view(ThumbPool* pool, ImageList* list, size_t first, size_t last, size_t selected, int cols)
 {
-  const char* fname = strrchr(orig, '/');
-  if (!fname)
-    fname = orig;
-  else
-    fname++;
+  pthread_mutex_lock(&pool->lock);
+  pool->view_first    = first;
+  pool->view_last     = last;
+  pool->view_selected = selected;
+  pool->view_cols     = cols > 0 ? cols : 1;
 
-  char tmp[4096];
-  snprintf(tmp, sizeof(tmp), "%s/iv_%s.focus.png", TMP_DIR, fname);
+  size_t rows  = (last - first + pool->view_cols - 1) / pool->view_cols;
+  size_t limit = (rows ? rows : 1) * CANCEL_SCREENS;
+  for (size_t i = 0; i < pool->job_count;) {
+    ThumbJob* j = &pool->jobs[i];
+    j->pos      = grid_cell(list, j->index);
+    if (j->gen != list->gen[j->index]) {
+      /* Its file was rewritten; the entry is queued afresh. */
+      *j = pool->jobs[--pool->job_count];
+    } else if (j->pos == NOT_SHOWN || job_distance(pool, j->pos) > limit) {
+      list->thumb_state[j->index] = THUMB_NONE;
+      *j = pool->jobs[--pool->job_count];
+      pool->cancelled++;
+    } else {
+      i++;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
 
-  char cmd[8192];
-  snprintf(cmd, sizeof(cmd),
-           "magick convert \"%s\" -resize %dx%d -auto-orient -filter Lanczos \"%s\"", orig,
-           FOCUS_WIDTH, FOCUS_HEIGHT, tmp);
+static void
+pool_stats(ThumbPool* pool, size_t* queued, size_t* cancelled)
+{
+  pthread_mutex_lock(&pool->lock);
+  *queued    = pool->job_count;
+  *cancelled = pool->cancelled;
+  pthread_mutex_unlock(&pool->lock);
+}
 
-  if (system(cmd) != 0) {
-    fprintf(stderr, "Failed to create focus image for %s\n", orig);
-    return -1;
-  }
+//
+// Move up to 'max' finished thumbnails into the list and store their indices
+// in 'done'. Returns how many were moved; never blocks on the workers.
+//
+static size_t
+pool_collect(ThumbPool* pool, ImageList* list, size_t* done, size_t max)
+{
+  char drain[64];
+  while (read(pool->wake_fd[0], drain, sizeof(drain)) > 0)
+    ;
 
-  *focus_out = strdup(tmp);
-  if (!*focus_out) {
-    fprintf(stderr, "Out of memory for focus path.\n");
-    return -1;
+  pthread_mutex_lock(&pool->lock);
+  size_t n = pool->result_count < max ? pool->result_count : max;
+  for (size_t i = 0; i < n; i++) {
+    size_t k = pool->results[i].index;
+    done[i]  = k;
+    if (pool->results[i].gen != list->gen[k])
+      continue; /* of a file since rewritten */
+    list->thumb_off[k]   = pool->results[i].thumb.off;
+    list->thumb_len[k]   = pool->results[i].thumb.len;
+    list->thumb_state[k] = pool->results[i].ok ? THUMB_READY : THUMB_FAILED;
   }
-  return 0;
+  pool->result_count -= n;
+  memmove(pool->results, pool->results + n, sizeof(ThumbResult) * pool->result_count);
+  pthread_mutex_unlock(&pool->lock);
+  return n;
+}
+
+static void
+pool_stop(ThumbPool* pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  close(pool->wake_fd[0]);
+  close(pool->wake_fd[1]);
+  free(pool->threads);
+  free(pool->jobs);
+  free(pool->results);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
 }
 
 
@@ -269,47 +7973,36 @@ b64encode_path(const char* path)
 }
 
 // 
-// Display a PNG in THUMB_ROWS x THUMB_COLS at the *current cursor position*,
-// telling kitty not to move the cursor afterwards (C=1).
+// Display a PNG from the pack in THUMB_ROWS x THUMB_COLS at the *current cursor
+// position*, telling kitty not to move the cursor afterwards (C=1).
 //
 static void
-display_thumbnail_kitty(const char* thumb_path)
+display_thumbnail_kitty(const PackRef* thumb)
 {
-  if (!thumb_path) {
+  if (!thumb) {
     printf("[?]");
     return;
   }
-  char* b64 = b64encode_path(thumb_path);
-  if (!b64) {
-    printf("[b64-fail]");
-    return;
-  }
 
   /* a=T => transmit+display
        f=100 => PNG
        t=f => the data is a path
+       O=, S= => the PNG's offset and size within that file
        c=THUMB_COLS, r=THUMB_ROWS => how many text cells
        C=1 => do not move cursor
     */
-  printf("\x1b_Ga=T,f=100,t=f,c=%d,r=%d,C=1;%s\x1b\\", THUMB_COLS, THUMB_ROWS, b64);
-  free(b64);
+  printf("\x1b_Ga=T,f=100,t=f,O=%llu,S=%u,c=%d,r=%d,C=1;%s\x1b\\",
+         (unsigned long long)thumb->off, thumb->len, THUMB_COLS, THUMB_ROWS, pack.b64path);
 }
 
 static void
-display_focus_kitty(const char* focus_path)
+display_focus_kitty(const PackRef* focus)
 {
-  if (!focus_path)
-    return;
-
   // For focus, do a naive 80x24.
   int c = 80, r = 24; 
 
-  char* b64 = b64encode_path(focus_path);
-  if (!b64)
-    return;
-
-  printf("\x1b_Ga=T,f=100,t=f,c=%d,r=%d,C=1;%s\x1b\\", c, r, b64);
-  free(b64);
+  printf("\x1b_Ga=T,f=100,t=f,O=%llu,S=%u,c=%d,r=%d,C=1;%s\x1b\\",
+         (unsigned long long)focus->off, focus->len, c, r, pack.b64path);
 }
 
 static void
@@ -324,10 +8017,23 @@ kitty_delete_all(void)
 /* -------------------- VERTICAL SCROLLING & GRID RENDER -------------------- */
 
 static int scroll_offset = 0;
+static int filter_typing = 0; /* '/' was pressed; keys edit the filter until Enter or Esc */
+
+// How many thumbnail rows fit on the screen.
+static int
+grid_visible_rows(void)
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0)
+    ws.ws_row = 24;
+
+  int visible_rows = ws.ws_row / (THUMB_ROWS + SPACING_ROWS);
+  return visible_rows < 1 ? 1 : visible_rows;
+}
 
 //
 // Makes sure the selected image is visible. If not, adjust scroll_offset.
-// Pass the entire list so we can see list->count.
+// Pass the entire list so we can see how many cells the grid has.
 //
 static void
 adjust_scroll_for_selection(const ImageList* list, int selected, int grid_cols)
@@ -345,7 +8051,7 @@ adjust_scroll_for_selection(const ImageList* list, int selected, int grid_cols)
   if (visible_rows < 1)
     visible_rows = 1;
 
-  int total_rows = (list->count + grid_cols - 1) / grid_cols;
+  int total_rows = (grid_count(list) + grid_cols - 1) / grid_cols;
   int sel_row    = selected / grid_cols;
 
   if (sel_row < scroll_offset) {
@@ -364,13 +8070,168 @@ adjust_scroll_for_selection(const ImageList* list, int selected, int grid_cols)
     scroll_offset = 0;
 }
 
+//
+// Queue thumbnails for the rows render_grid() is about to show. Everything
+// else is generated only once it scrolls into view.
+//
+static void
+request_visible_thumbnails(ImageList* list, ThumbPool* pool, int grid_cols, int selected)
+{
+  size_t first = (size_t)scroll_offset * grid_cols;
+  size_t last  = first + (size_t)grid_visible_rows() * grid_cols;
+  if (last > grid_count(list))
+    last = grid_count(list);
+
+  pool_set_view(pool, list, first, last, selected, grid_cols);
+  for (size_t p = first; p < last; p++) {
+    size_t i = grid_entry(list, p);
+    if (list->thumb_state[i] == THUMB_NONE) {
+      list->thumb_state[i] = THUMB_QUEUED;
+      pool_submit(pool, list, i, p);
+    }
+  }
+}
+
+// Draw entry i at the cursor: its thumbnail, or a placeholder until it exists.
+static void
+draw_cell(const ImageList* list, size_t i)
+{
+  if (list->thumb_state[i] == THUMB_READY) {
+    PackRef thumb = {list->thumb_off[i], list->thumb_len[i]};
+    display_thumbnail_kitty(&thumb);
+  } else if (list->thumb_state[i] == THUMB_FAILED) {
+    display_thumbnail_kitty(NULL);
+  } else {
+    printf("[...]");
+  }
+}
+
+// Find grid position p on screen. Returns 0 if it is scrolled out of view.
+static int
+cell_origin(size_t p, int grid_cols, int* screen_row, int* screen_col)
+{
+  int row = (int)(p / grid_cols);
+  if (row < scroll_offset || row >= scroll_offset + grid_visible_rows())
+    return 0;
+  *screen_row = (row - scroll_offset) * (THUMB_ROWS + SPACING_ROWS) + 1;
+  *screen_col = (int)(p % grid_cols) * (THUMB_COLS + SPACING_COLS) + 1;
+  return 1;
+}
+
+// Empty grid position p: its image, its placeholder and its star.
+static void
+clear_cell(size_t p, int grid_cols)
+{
+  int r, c;
+  if (!cell_origin(p, grid_cols, &r, &c))
+    return;
+  /* d=C deletes the images under the cursor and frees their data. */
+  printf("\x1b[%d;%dH\x1b_Ga=d,d=C\x1b\\%*s", r, c, THUMB_COLS, "");
+  printf("\x1b[%d;%dH ", r + THUMB_ROWS, c + THUMB_COLS / 2);
+}
+
+// Draw (or with ' ', erase) the selection star under grid position p.
+static void
+draw_mark(size_t p, int grid_cols, char mark)
+{
+  int r, c;
+  if (cell_origin(p, grid_cols, &r, &c))
+    printf("\x1b[%d;%dH%c", r + THUMB_ROWS, c + THUMB_COLS / 2, mark);
+}
+
+//
+// Redraw entry i's cell in place, e.g. once its thumbnail is ready, the scan
+// has just found it or it moved. Entries that are scrolled off screen or no
+// longer on the grid are left alone.
+//
+static void
+redraw_cell(const ImageList* list, size_t i, int grid_cols, int selected)
+{
+  size_t p = grid_cell(list, i);
+  int r, c;
+  if (p == NOT_SHOWN || !cell_origin(p, grid_cols, &r, &c))
+    return;
+
+  /* Wipe whatever was there, then draw over the same cell. */
+  clear_cell(p, grid_cols);
+  printf("\x1b[%d;%dH", r, c);
+  draw_cell(list, i);
+  if ((int)p == selected)
+    draw_mark(p, grid_cols, '*');
+}
+
+//
+// Draw the selected image's name and the help line below the grid, with a
+// live image count while the directory is still being scanned.
+//
+static void
+draw_status(const ImageList* list, ThumbPool* pool, int selected, int scanning)
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0) {
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+  }
+
+  /* Now place the selected image name at the *bottom* of the screen. */
+  int bottom_line = grid_visible_rows() * (THUMB_ROWS + SPACING_ROWS) + 1;
+  if (bottom_line < (int)ws.ws_row) {
+    /* Move cursor down there. */
+    printf("\x1b[%d;1H", bottom_line);
+  } else {
+    /* If our grid exactly fills the screen, we do one more line. */
+    printf("\x1b[%d;1H", ws.ws_row);
+  }
+
+  if (selected >= 0 && selected < (int)grid_count(list)) {
+    size_t i = grid_entry(list, selected);
+    printf("\x1b[KSelected: %s", list->path[i]);
+    /* Its size as shown, upright, and when it was taken (EXIF keeps local time). */
+    if ((list->keys[i] & KEY_META) && list->width[i]) {
+      int turned = list->orient[i] >= 5;
+      printf("  %ux%u", turned ? list->height[i] : list->width[i],
+             turned ? list->width[i] : list->height[i]);
+    }
+    struct tm tm;
+    time_t when = (time_t)list->taken[i];
+    char date[32];
+    if ((list->keys[i] & KEY_META) && list->taken[i] != INT64_MIN && gmtime_r(&when, &tm) &&
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm))
+      printf("  %s", date);
+    printf("\n");
+  } else {
+    printf("\x1b[K\n");
+  }
+  /* Next line for help or other info. */
+  size_t queued, cancelled;
+  pool_stats(pool, &queued, &cancelled);
+  if (filter_typing)
+    printf("\x1b[K/%s_  [Enter=keep | Esc=clear]", list->filter.name);
+  else
+    printf("\x1b[K[h/l/j/k: move | Enter=focus | s=sort | /=filter | q=quit]");
+  printf("  ");
+  if (list_filtered(list))
+    printf("%zu of ", list->match_count);
+  printf("%zu images%s  by %s", list->view_count, scanning ? " (scanning)" : "",
+         sort_names[list->sort]);
+  if (list->sort_next != list->sort)
+    printf(" (then %s)", sort_names[list->sort_next]);
+  printf("  queued: %zu  cancelled: %zu", queued, cancelled);
+  if (list->filter.name[0] && !filter_typing)
+    printf("  /%s", list->filter.name);
+  if (list->asking)
+    printf("  reading: %zu", list->asking);
+  printf("\n");
+  fflush(stdout);
+}
+
 //
 // Render only the thumbnails that are within the visible rows. 
 // Place them with horizontal spacing, vertical spacing. 
 // Draw a star under the selected image in the spacing row. 
 //
 static void
-render_grid(const ImageList* list, int grid_cols, int selected)
+render_grid(const ImageList* list, ThumbPool* pool, int grid_cols, int selected, int scanning)
 {
   struct winsize ws;
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0) {
@@ -384,7 +8245,7 @@ render_grid(const ImageList* list, int grid_cols, int selected)
   if (visible_rows < 1)
     visible_rows = 1;
 
-  int total_rows = (list->count + grid_cols - 1) / grid_cols;
+  int total_rows = (grid_count(list) + grid_cols - 1) / grid_cols;
   if (scroll_offset < 0)
     scroll_offset = 0;
 
@@ -406,7 +8267,7 @@ render_grid(const ImageList* list, int grid_cols, int selected)
   for (int row = start_row; row < end_row; row++) {
     for (int col = 0; col < grid_cols; col++) {
       int i = row * grid_cols + col;
-      if (i >= (int)list->count)
+      if (i >= (int)grid_count(list))
         break;
 
       // Compute the top-left cell in the terminal.
@@ -414,7 +8275,7 @@ render_grid(const ImageList* list, int grid_cols, int selected)
       int screen_col = col * col_width + 1;
       printf("\x1b[%d;%dH", screen_row, screen_col);
 
-      display_thumbnail_kitty(list->entries[i].thumb_path);
+      draw_cell(list, grid_entry(list, i));
 
       /* If this is the selected image, place a star below the thumbnail in the "spacing" row. */
       if (i == selected) {
@@ -426,39 +8287,224 @@ render_grid(const ImageList* list, int grid_cols, int selected)
     }
   }
 
-  /* Now place the selected image name at the *bottom* of the screen. */
-  int bottom_line = visible_rows * row_height + 1;
-  if (bottom_line < (int)ws.ws_row) {
-    /* Move cursor down there. */
-    printf("\x1b[%d;1H", bottom_line);
-  } else {
-    /* If our grid exactly fills the screen, we do one more line. */
-    printf("\x1b[%d;1H", ws.ws_row);
+  draw_status(list, pool, selected, scanning);
+}
+
+
+//
+// Apply what the directory watch has reported to the grid. New images go on
+// the end, rewritten ones get a fresh entry in the same cell (or, in a
+// sorted grid, at the place their new keys give them), and removed ones
+// close up the grid behind them; only the cells that changed are
+// redrawn, and the selection stays on the same image where it can. A
+// filtered grid is matched again once everything is in. Returns
+// nonzero if the grid has to scroll and must be drawn again in full.
+//
+static int
+watch_apply(Watcher* w, ImageList* list, ThumbPool* pool, int grid_cols, int* selected)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[4096];
+  size_t old_count = grid_count(list), dirty = SIZE_MAX;
+  size_t keep      = (size_t)*selected < old_count ? grid_entry(list, *selected) : NOT_SHOWN;
+  int old_selected = *selected, old_scroll = scroll_offset;
+  ssize_t n;
+
+  while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+    for (char* e = buf; e < buf + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len) {
+      const struct inotify_event* ev = (const struct inotify_event*)e;
+      if (!ev->len || ev->name[0] == '.' || (ev->mask & IN_ISDIR))
+        continue;
+
+      pthread_mutex_lock(&w->lock);
+      const char* dir = ev->wd >= 0 && ev->wd < w->ndirs ? w->dirs[ev->wd].path : NULL;
+      uint32_t group  = dir ? w->dirs[ev->wd].group : 0;
+      size_t dlen     = dir ? strlen(dir) : 0;
+      int len = dir ? snprintf(path, sizeof(path), dlen && dir[dlen - 1] == '/' ? "%s%s" : "%s/%s",
+                               dir, ev->name)
+                    : -1;
+      pthread_mutex_unlock(&w->lock);
+      if (len < 0 || (size_t)len >= sizeof(path))
+        continue;
+
+      size_t i = list_find(list, path);
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (i == NOT_SHOWN)
+          continue;
+        size_t p = grid_cell(list, i);
+        list_remove(list, i);
+        if (p == NOT_SHOWN)
+          continue;
+        if (p < dirty)
+          dirty = p;
+        if ((int)p < *selected)
+          (*selected)--;
+      } else if (i != NOT_SHOWN && list->sort != SORT_SCAN) {
+        /* Its sort key may have changed, so it goes back in at its new place. */
+        size_t p = list->pos[i];
+        list_remove(list, i);
+        list_reset(list, i);
+        size_t q = list_show(list, i, 1);
+        if (list_filtered(list))
+          continue;
+        if ((p < q ? p : q) < dirty)
+          dirty = p < q ? p : q;
+        if ((int)p == *selected)
+          *selected = (int)q;
+        else if ((int)p < *selected && *selected <= (int)q)
+          (*selected)--;
+        else if ((int)q <= *selected && *selected < (int)p)
+          (*selected)++;
+      } else if (i != NOT_SHOWN) {
+        list_reset(list, i);
+        redraw_cell(list, i, grid_cols, *selected);
+      } else {
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && looks_like_image(AT_FDCWD, path)) {
+          size_t p = add_image_entry(list, path, group);
+          if (list_filtered(list))
+            continue;
+          if (p < dirty)
+            dirty = p;
+          if ((int)p <= *selected && *selected < (int)list->view_count - 1)
+            (*selected)++;
+        }
+      }
+    }
   }
 
-  if (selected >= 0 && selected < (int)list->count) {
-    printf("Selected: %s\n", list->entries[selected].original_path);
-  } else {
-    printf("\n");
+  if (list_filtered(list)) {
+    size_t p = list_match(list, 0);
+    if (p < dirty)
+      dirty = p;
+    if (keep != NOT_SHOWN && grid_cell(list, keep) != NOT_SHOWN)
+      *selected = (int)grid_cell(list, keep);
+  }
+  if (*selected >= (int)grid_count(list))
+    *selected = grid_count(list) ? (int)grid_count(list) - 1 : 0;
+  adjust_scroll_for_selection(list, *selected, grid_cols);
+  if (scroll_offset != old_scroll)
+    return 1;
+
+  size_t end = grid_count(list) > old_count ? grid_count(list) : old_count;
+  for (size_t p = dirty; p < end; p++) {
+    if (p < grid_count(list))
+      redraw_cell(list, grid_entry(list, p), grid_cols, *selected);
+    else
+      clear_cell(p, grid_cols);
+  }
+  if (*selected != old_selected) {
+    draw_mark(old_selected, grid_cols, ' ');
+    draw_mark(*selected, grid_cols, '*');
+  }
+  request_visible_thumbnails(list, pool, grid_cols, *selected);
+  return 0;
+}
+
+//
+// Block until a key is pressed, drawing thumbnails into their cells as the
+// workers finish them and new cells as the scanner finds them or the
+// KeyLoader lets them through the filter, and keeping the grid in step with
+// the directory watch. Returns 0 when the whole grid needs drawing again,
+// and EOF if the scan ends without finding anything to show.
+//
+static int
+wait_keypress(ThumbPool* pool, Scanner* sc, Watcher* watch, KeyLoader* kl, ImageList* list,
+              int grid_cols, int* selected)
+{
+  for (;;) {
+    /* Keys found missing are read in the background, and by the scanner from now on. */
+    if (list->missing) {
+      scan_want(sc, list->missing);
+      keys_ask(kl, list);
+      draw_status(list, pool, *selected, !sc->finished);
+    }
+
+    struct pollfd fds[5] = {{STDIN_FILENO, POLLIN, 0},
+                            {pool->wake_fd[0], POLLIN, 0},
+                            {sc->finished ? -1 : sc->wake_fd[0], POLLIN, 0},
+                            {watch->fd, POLLIN, 0},
+                            {kl->wake_fd[0], POLLIN, 0}};
+    if (poll(fds, 5, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return EOF;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      size_t done[64], n;
+      while ((n = pool_collect(pool, list, done, 64)) > 0)
+        for (size_t i = 0; i < n; i++)
+          redraw_cell(list, done[i], grid_cols, *selected);
+      fflush(stdout);
+    }
+    if ((fds[2].revents | fds[4].revents) & POLLIN) {
+      int old_selected = *selected, old_scroll = scroll_offset;
+      size_t entry = *selected > 0 && (size_t)*selected < grid_count(list) ? grid_entry(list, *selected)
+                                                                           : NOT_SHOWN;
+      size_t from  = SIZE_MAX;
+      if (fds[2].revents & POLLIN) {
+        from = scan_take(sc, list);
+        if (sc->finished && list->view_count == 0)
+          return EOF;
+      }
+      if (fds[4].revents & POLLIN) {
+        keys_take(kl, list);
+        /* A new order waits for its last key, then moves the whole grid, selection and all. */
+        if (list->sort_next != list->sort && !list->asking) {
+          size_t sel = grid_count(list) ? grid_entry(list, *selected) : NOT_SHOWN;
+          if (list_resort(list)) {
+            size_t c  = sel != NOT_SHOWN ? grid_cell(list, sel) : NOT_SHOWN;
+            *selected = c != NOT_SHOWN ? (int)c : 0;
+            return 0;
+          }
+        }
+      }
+      if (list_filtered(list))
+        from = list_match(list, 0);
+
+      /*
+       * In a sorted grid cells may land ahead of the selection, which stays
+       * on its image once moved; until then it stays on the first cell.
+       */
+      if (entry != NOT_SHOWN)
+        *selected = (int)grid_cell(list, entry);
+      adjust_scroll_for_selection(list, *selected, grid_cols);
+      if (scroll_offset != old_scroll)
+        return 0;
+
+      /* Only cells that landed on screen need drawing. */
+      size_t last = (size_t)(scroll_offset + grid_visible_rows()) * grid_cols;
+      request_visible_thumbnails(list, pool, grid_cols, *selected);
+      for (size_t p = from; p < grid_count(list) && p < last; p++)
+        redraw_cell(list, grid_entry(list, p), grid_cols, *selected);
+      if (*selected != old_selected)
+        draw_mark(old_selected, grid_cols, ' ');
+      draw_status(list, pool, *selected, !sc->finished);
+    }
+    if (fds[3].revents & POLLIN) {
+      if (watch_apply(watch, list, pool, grid_cols, selected))
+        return 0;
+      draw_status(list, pool, *selected, !sc->finished);
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      return read_keypress();
   }
-  /* Next line for help or other info. */
-  printf("[h/l/j/k: move | Enter=focus | q=quit]\n");
-  fflush(stdout);
 }
 
 
 /* -------------------- FOCUS VIEW -------------------- */
 
 static void
-focus_view(const char* orig_path)
+focus_view(const Source* src)
 {
-  char* focus_path = NULL;
-  if (generate_focus(orig_path, &focus_path) != 0) {
+  PackRef focus;
+  if (generate_focus(src, &focus) != 0) {
     return; /* if focus gen fails, just return to the grid */
   }
   /* Clear and display focus. */
   printf("\x1b[2J\x1b[H");
-  display_focus_kitty(focus_path);
+  display_focus_kitty(&focus);
   fflush(stdout);
 
   /* Wait for ESC or 'q' or EOF. */
@@ -468,11 +8514,6 @@ focus_view(const char* orig_path)
       break;
     }
   }
-
-  if (focus_path) {
-    remove(focus_path);
-    free(focus_path);
-  }
 }
 
 
@@ -481,86 +8522,180 @@ focus_view(const char* orig_path)
 static void
 free_imagelist(ImageList* list)
 {
-  if (!list || !list->entries)
+  if (!list)
     return;
-  for (size_t i = 0; i < list->count; i++) {
-    free(list->entries[i].original_path);
-    free(list->entries[i].thumb_path);
+  while (list->names) {
+    ArenaBlock* next = list->names->next;
+    free(list->names);
+    list->names = next;
   }
-  free(list->entries);
-  list->entries = NULL;
-  list->count   = 0;
-}
-
-/* Remove any thumbnails we generated. */
-static void
-remove_thumbnails(ImageList* list)
-{
-  if (!list || !list->entries)
-    return;
-
-  for (size_t i = 0; i < list->count; i++) {
-    if (list->entries[i].generated && list->entries[i].thumb_path) {
-      remove(list->entries[i].thumb_path);
-    }
+  free(list->path);
+  free(list->thumb_off);
+  free(list->thumb_len);
+  free(list->thumb_state);
+  free(list->gen);
+  free(list->group);
+  free(list->dev);
+  free(list->ino);
+  free(list->keys);
+  free(list->asked);
+  free(list->mtime);
+  free(list->size);
+  free(list->width);
+  free(list->height);
+  free(list->orient);
+  free(list->format);
+  free(list->taken);
+  free(list->pos);
+  free(list->view);
+  free(list->by_path);
+  free(list->match);
+  free(list->folded);
+  free(list->folded_at);
+  if (list->trigrams) {
+    for (size_t t = 0; t < (size_t)1 << TRIGRAM_BITS; t++)
+      free(list->trigrams[t].ids);
+    free(list->trigrams);
   }
+  memset(list, 0, sizeof(*list));
 }
 
-
 /* -------------------- MAIN -------------------- */
 
 int
 main(int argc, char** argv)
 {
   int grid_cols = 4; /* default columns */
+  int jobs      = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1)
+    jobs = 1;
+  uint64_t cache_max = CACHE_MAX_BYTES;
+  int recursive      = 0;
+  int path_list      = 0;
+  int sort           = SORT_SCAN;
+  Filter filter      = {.since = FILTER_ANY_TIME};
+
+  engine_init();
+
+  /* The predicates are long options, each taking its PredKey past 256. */
+  struct option longopts[PRED_COUNT + 1] = {{0}};
+  for (int k = 0; k < PRED_COUNT; k++)
+    longopts[k] = (struct option){pred_options[k], required_argument, NULL, 256 + k};
 
   int opt;
-  while ((opt = getopt(argc, argv, "c:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "0c:j:o:rs:", longopts, NULL)) != -1) {
+    if (opt >= 256) {
+      if (filter_set(&filter, opt - 256, optarg) != 0) {
+        fprintf(stderr, "Bad --%s: %s\n", pred_options[opt - 256], optarg);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
     switch (opt) {
+    case '0':
+      path_list = 1;
+      break;
     case 'c':
       grid_cols = atoi(optarg);
       if (grid_cols < 1)
         grid_cols = 4;
       break;
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1)
+        jobs = 1;
+      break;
+    case 'o':
+      for (sort = 0; sort < SORT_MODES && strcmp(optarg, sort_names[sort]) != 0;)
+        sort++;
+      if (sort == SORT_MODES) {
+        fprintf(stderr, "Bad sort order: %s (scan, name, mtime, size or date)\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      recursive = 1;
+      break;
+    case 's':
+      if (parse_size(optarg, &cache_max) != 0) {
+        fprintf(stderr, "Bad cache size: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     default:
-      fprintf(stderr, "Usage: %s [-c columns] [directory or imagefiles...]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [-c columns] [-j jobs] [-o order] [-r] [-s cache size] [filters] [directory, archive or imagefiles... | -0 list]\n"
+                      "Filters: --min-size=bytes --since=date --format=jpeg|png|... --min-width=pixels --orientation=landscape|portrait\n", argv[0]);
       exit(EXIT_FAILURE);
     }
   }
 
-  if (optind >= argc) {
-    fprintf(stderr, "Usage: %s [-c columns] [directory or imagefiles...]\n", argv[0]);
+  if (optind >= argc || (path_list && optind + 1 != argc)) {
+    fprintf(stderr, "Usage: %s [-c columns] [-j jobs] [-o order] [-r] [-s cache size] [filters] [directory, archive or imagefiles... | -0 list]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
+  cache_init(cache_max);
+  if (path_list)
+    abs_roots_init(0, NULL);
+  else
+    abs_roots_init(argc - optind, &argv[optind]);
 
-  ImageList list;
-  list.entries = NULL;
-  list.count   = 0;
+  ImageList list = {0};
+  list.sort      = sort;
+  list.sort_next = sort;
+  list.filter    = filter;
 
-  /* Load images from either a directory or file list. */
-  struct stat st;
-  if (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) {
-    if (load_images_from_dir(argv[optind], &list) != 0) {
-      fprintf(stderr, "Could not read directory.\n");
+  /*
+   * Load images from a NUL-separated path list, or from the files and
+   * directories given; lists and directories are read in the background.
+   */
+  Scanner scan;
+  Watcher watch;
+  watch_open(&watch);
+  if (path_list) {
+    int fd;
+    if (strcmp(argv[optind], "-") == 0) {
+      /* The list takes over stdin, so keys have to come from the terminal. */
+      int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+      fd      = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+      if (tty < 0 || fd < 0 || dup2(tty, STDIN_FILENO) < 0) {
+        fprintf(stderr, "No terminal to read keys from.\n");
+        return 1;
+      }
+      close(tty);
+    } else {
+      fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0 || scan_start_list(&scan, fd, sort_needs(sort) | filter_needs(&filter)) != 0) {
+      fprintf(stderr, "Could not read path list.\n");
       return 1;
     }
   } else {
-    /* treat everything as file paths */
-    load_images_from_argv(argc - optind, &argv[optind], &list);
+    WalkTask* roots;
+    const char* bad = NULL;
+    int nroots      = load_images_from_argv(argc - optind, &argv[optind], &list, &roots);
+    if (scan_start(&scan, roots, nroots, recursive, &watch, &bad) != 0) {
+      if (bad)
+        fprintf(stderr, "Could not read directory %s.\n", bad);
+      else
+        fprintf(stderr, "Could not read directory.\n");
+      return 1;
+    }
+    if (nroots == 0 && list.view_count == 0) {
+      fprintf(stderr, "No images found.\n");
+      return 1;
+    }
   }
+  /* Image files named on the command line are on the grid already. */
+  list_match(&list, 0);
 
-  if (list.count == 0) {
-    fprintf(stderr, "No images found.\n");
+  /* Thumbnails are generated on demand, 'jobs' at a time, as rows come into view. */
+  ThumbPool pool;
+  KeyLoader keys;
+  if (pool_start(&pool, jobs) != 0 || keys_start(&keys) != 0) {
+    fprintf(stderr, "Could not start worker threads.\n");
     return 1;
   }
 
-  /* Generate thumbnails for each image. */
-  for (size_t i = 0; i < list.count; i++) {
-    if (generate_thumbnail(list.entries[i].original_path, &list.entries[i].thumb_path) == 0) {
-      list.entries[i].generated = 1;
-    }
-  }
-
   enable_raw_mode();
 
   ViewerMode mode = MODE_GRID;
@@ -569,12 +8704,43 @@ main(int argc, char** argv)
 
   while (running) {
     if (mode == MODE_GRID) {
+      /* The status line shows the selected image's header, read now if the scan did not. */
+      if (grid_count(&list)) {
+        size_t entry = grid_entry(&list, selected);
+        if (!(list.keys[entry] & KEY_META))
+          list_load_keys(&list, &entry, 1, KEY_META);
+      }
       adjust_scroll_for_selection(&list, selected, grid_cols);
-      render_grid(&list, grid_cols, selected);
+      request_visible_thumbnails(&list, &pool, grid_cols, selected);
+      render_grid(&list, &pool, grid_cols, selected, !scan.finished);
 
-      int ch = read_keypress();
+      int ch = wait_keypress(&pool, &scan, &watch, &keys, &list, grid_cols, &selected);
       if (ch == EOF) {
         running = 0;
+      } else if (filter_typing || (ch == 27 && list_filtered(&list))) {
+        /* Each key narrows or widens the grid at once; Esc drops the filter. */
+        Filter f   = list.filter;
+        size_t len = strlen(f.name);
+        if (ch == 27) {
+          f.name[0]     = '\0';
+          filter_typing = 0;
+        } else if (ch == '\n' || ch == '\r') {
+          filter_typing = 0;
+        } else if (ch == 127 || ch == '\b') {
+          while (len && ((unsigned char)f.name[len - 1] & 0xC0) == 0x80)
+            len--; /* a whole UTF-8 character */
+          f.name[len ? len - 1 : 0] = '\0';
+        } else if (ch >= ' ' && len + 1 < sizeof(f.name)) {
+          f.name[len]     = (char)ch;
+          f.name[len + 1] = '\0';
+        }
+        size_t entry = grid_count(&list) ? grid_entry(&list, selected) : NOT_SHOWN;
+        list_filter(&list, &f);
+        size_t c = entry != NOT_SHOWN ? grid_cell(&list, entry) : NOT_SHOWN;
+        selected = c != NOT_SHOWN ? (int)c : 0;
+      } else if (ch == '/') {
+        filter_typing = 1;
+        list_index_names(&list); /* now, rather than on the first key */
       } else if (ch == 'q') {
         running = 0;
       } else if (ch == 'h') {
@@ -582,7 +8748,7 @@ main(int argc, char** argv)
           selected--;
         }
       } else if (ch == 'l') {
-        if ((selected + 1) < (int)list.count && (selected % grid_cols) < (grid_cols - 1)) {
+        if ((selected + 1) < (int)grid_count(&list) && (selected % grid_cols) < (grid_cols - 1)) {
           selected++;
         }
       } else if (ch == 'k') {
@@ -590,17 +8756,24 @@ main(int argc, char** argv)
           selected -= grid_cols;
         }
       } else if (ch == 'j') {
-        if (selected + grid_cols < (int)list.count) {
+        if (selected + grid_cols < (int)grid_count(&list)) {
           selected += grid_cols;
         }
-      } else if (ch == '\n' || ch == '\r') {
+      } else if (ch == 's') {
+        /* Next order, keeping the same image selected; one whose keys are not all in waits for them. */
+        size_t entry   = grid_count(&list) ? grid_entry(&list, selected) : NOT_SHOWN;
+        list.sort_next = (list.sort_next + 1) % SORT_MODES;
+        if (list_resort(&list) && entry != NOT_SHOWN && grid_cell(&list, entry) != NOT_SHOWN)
+          selected = (int)grid_cell(&list, entry);
+      } else if ((ch == '\n' || ch == '\r') && grid_count(&list) > 0) {
         mode = MODE_FOCUS;
       }
       // Ignore other keys
 
     } else if (mode == MODE_FOCUS) {
       // Show the large focus view for the selected image
-      focus_view(list.entries[selected].original_path);
+      Source src = list_source(&list, grid_entry(&list, selected));
+      focus_view(&src);
       // Return to grid mode
       mode = MODE_GRID;
     }
@@ -610,13 +8783,21 @@ main(int argc, char** argv)
   // Remove images from screen
   kitty_delete_all();
 
-  // Delete thumbnail files
-  remove_thumbnails(&list);
-  free_imagelist(&list);
+  // Wait for in-flight thumbnails; they stay cached for the next run
+  scan_stop(&scan);
+  watch_close(&watch);
+  pool_stop(&pool);
+  keys_stop(&keys);
+  cache_close();
 
   // Clear screen
   printf("\x1b[2J\x1b[H");
   fflush(stdout);
 
+  if (list.view_count == 0) {
+    fprintf(stderr, "No images found.\n");
+    return 1;
+  }
+  free_imagelist(&list);
   return 0;
 }